@@ -7,6 +7,7 @@
 #include <functional>
 #include <iostream>
 #include <set>
+#include <atomic>
 
 #include "types.hpp"
 
@@ -32,6 +33,66 @@ using unique_cube =
     std::unique_ptr<cube<T>,
                     unique_cashed_cube_deleter<T>>;
 
+// Bytes of all the cubes taken from the pools and not yet returned, and
+// the most there ever were (since the last reset), the memory used by
+// the cubes being the peak, as the pools never free any.
+//
+// Only counted when compiled with ZNN_POOL_STATS (e.g. by the
+// inference_benchmark), as the counters are shared by all the threads
+// getting and returning cubes; otherwise they stay at zero.
+
+class pool_memory
+{
+#ifdef ZNN_POOL_STATS
+private:
+    std::atomic<std::size_t> in_use_{0};
+    std::atomic<std::size_t> peak_  {0};
+
+public:
+    void take( std::size_t n )
+    {
+        std::size_t u = ( in_use_ += n );
+        std::size_t p = peak_.load();
+        while ( u > p && !peak_.compare_exchange_weak(p, u) );
+    }
+
+    void give( std::size_t n )
+    {
+        in_use_ -= n;
+    }
+
+    std::size_t in_use() const
+    {
+        return in_use_;
+    }
+
+    std::size_t peak() const
+    {
+        return peak_;
+    }
+
+    void reset_peak()
+    {
+        peak_ = in_use_.load();
+    }
+#else
+public:
+    void take( std::size_t ) {}
+    void give( std::size_t ) {}
+
+    std::size_t in_use() const { return 0; }
+    std::size_t peak()   const { return 0; }
+
+    void reset_peak() {}
+#endif
+
+    static pool_memory& instance()
+    {
+        return zi::singleton<pool_memory>::instance();
+    }
+
+}; // class pool_memory
+
 // The meat
 
 template<typename T>
@@ -39,6 +100,7 @@ class single_size_cube_pool
 {
 private:
     vec3s                      size_;
+    std::size_t                bytes_;
     std::list<cube<T>*>        list_;
     std::mutex                 m_   ;
 
@@ -56,6 +118,7 @@ public:
 public:
     void return_cube( cube<T>* c )
     {
+        pool_memory::instance().give(bytes_);
         std::lock_guard<std::mutex> g(m_);
         list_.push_back(c);
     }
@@ -63,6 +126,7 @@ public:
 public:
     single_size_cube_pool( const vec3s& s )
         : size_{s}
+        , bytes_{s[0] * s[1] * s[2] * sizeof(T)}
         , list_{}
         , m_{}
     {}
@@ -89,6 +153,8 @@ public:
             r = new cube<T>(size_[0],size_[1],size_[2]);
         }
 
+        pool_memory::instance().take(bytes_);
+
         return cube_ptr<T>(r,
                            std::bind(&single_size_cube_pool::return_cube,
                                      this, std::placeholders::_1));
@@ -112,6 +178,8 @@ public:
             r = new cube<T>(size_[0],size_[1],size_[2]);
         }
 
+        pool_memory::instance().take(bytes_);
+
         return unique_cube<T>(r);
     }
 
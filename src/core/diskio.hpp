@@ -6,9 +6,22 @@
 #include <type_traits>
 #include <string>
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
 #include <zi/vl/vl.hpp>
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
 #include "types.hpp"
 
 namespace zi {
@@ -70,19 +83,13 @@ inline void write_n(std::basic_ostream<Char,CharT>& out, const T* v,
 template<typename Char, typename CharT, typename T, std::size_t N>
 void read(std::basic_istream<Char, CharT>& in, zi::vl::vec<T,N>& v)
 {
-    for ( std::size_t i = 0; i < N; ++i )
-    {
-        v[i] = read<T>(in);
-    }
+    read_n(in, v.data(), N);
 }
 
 template<typename Char, typename CharT, typename T, std::size_t N>
 void write(std::basic_ostream<Char, CharT>& out, const zi::vl::vec<T,N>& v)
 {
-    for ( std::size_t i = 0; i < N; ++i )
-    {
-        write(out, v[i]);
-    }
+    write_n(out, v.data(), N);
 }
 
 template<typename Char, typename CharT, typename T>
@@ -198,50 +205,26 @@ public:
 
 } // namespace detail
 
-struct istream
-{
-private:
-    std::unique_ptr<detail::istream_wrapper_type_erasure> stream_;
-
-public:
-    template< class T >
-    explicit istream(T& s)
-        : stream_(new detail::istream_wrapper_type_erasure_of_stream<T>(s))
-    {}
-
-    void read(char* c, size_t n)
-    {
-        if ( n == 0 )
-        {
-            throw std::logic_error("Asked to read 0 bytes?");
-        }
-
-        stream_->read(c, n);
-
-        if ( !(*stream_) )
-        {
-            throw std::runtime_error("Not enough bytes in the stream");
-        }
-    }
+// The typed reads and writes shared by all the readers and writers,
+// everything in terms of the read(char*, size_t) and write(const char*,
+// size_t) of D. Vectors, vecs and cubes are read/written in bulk.
 
+template<class D>
+struct typed_reader
+{
     template< class T >
     void read_n(T* r, size_t n)
     {
-        read(reinterpret_cast<char*>(r), sizeof(T)*n);
-    }
-
-    operator bool() const
-    {
-        return static_cast<bool>(*stream_);
+        static_cast<D*>(this)->read(reinterpret_cast<char*>(r), sizeof(T)*n);
     }
 
     template< class T,
               class =
               typename std::enable_if<std::is_arithmetic<T>::value>::type>
-    istream& operator>>( T& v )
+    D& operator>>( T& v )
     {
-        read(reinterpret_cast<char*>(&v), sizeof(T));
-        return *this;
+        read_n(&v, 1);
+        return *static_cast<D*>(this);
     }
 
     template< class T,
@@ -249,91 +232,64 @@ public:
               typename std::enable_if<!std::is_arithmetic<T>::value>::type,
               class =
               typename std::enable_if<std::is_pod<T>::value>::type>
-    istream& operator>>( T& v )
+    D& operator>>( T& v )
     {
-        read(reinterpret_cast<char*>(&v), sizeof(T));
-        return *this;
+        read_n(&v, 1);
+        return *static_cast<D*>(this);
     }
 
-    istream& operator>>( std::string& s )
+    D& operator>>( std::string& s )
     {
         size_t sz;
         *this >> sz;
         s.resize(sz);
-        read(const_cast<char*>(s.data()), sz);
-        return *this;
+        read_n(const_cast<char*>(s.data()), sz);
+        return *static_cast<D*>(this);
     }
 
     template< typename T >
-    istream& operator>>( std::vector<T>& v )
+    D& operator>>( std::vector<T>& v )
     {
         size_t sz;
         *this >> sz;
         v.resize(sz);
         read_n(v.data(), sz);
-        return *this;
+        return *static_cast<D*>(this);
     }
 
     template<typename T, std::size_t N>
-    istream& operator>>( zi::vl::vec<T,N>& v )
+    D& operator>>( zi::vl::vec<T,N>& v )
     {
-        for ( size_t i = 0; i < N; ++i )
-        {
-            *this >> v[i];
-        }
-        return *this;
+        read_n(v.data(), N);
+        return *static_cast<D*>(this);
     }
 
     template<typename T>
-    istream& operator>>( cube<T>& c )
+    D& operator>>( cube<T>& c )
     {
         read_n(c.memptr(), c.n_elem);
-        return *this;
+        return *static_cast<D*>(this);
     }
 
+}; // struct typed_reader
 
-}; // struct istream
-
-
-struct ostream
+template<class D>
+struct typed_writer
 {
-private:
-    std::unique_ptr<detail::ostream_wrapper_type_erasure> stream_;
-
-public:
-    template< class T >
-    explicit ostream(T& s)
-        : stream_(new detail::ostream_wrapper_type_erasure_of_stream<T>(s))
-    {}
-
-    void write(const char* c, size_t n)
-    {
-        if ( n == 0 )
-        {
-            throw std::logic_error("Asked to write 0 bytes?");
-        }
-
-        stream_->write(c, n);
-    }
-
     template< class T >
     void write_n(const T* r, size_t n)
     {
-        write(reinterpret_cast<const char*>(r), sizeof(T)*n);
-    }
-
-    operator bool() const
-    {
-        return static_cast<bool>(*stream_);
+        static_cast<D*>(this)->write(reinterpret_cast<const char*>(r),
+                                     sizeof(T)*n);
     }
 
     template< class T,
               class =
               typename std::enable_if<std::is_arithmetic<T>::value>::type>
-    ostream& operator<<( const T& v )
+    D& operator<<( const T& v )
     {
-        write(reinterpret_cast<const char*>(&v), sizeof(T));
-        return *this;
+        write_n(&v, 1);
+        return *static_cast<D*>(this);
     }
 
     template< class T,
@@ -341,44 +297,104 @@ public:
               typename std::enable_if<!std::is_arithmetic<T>::value>::type,
               class =
               typename std::enable_if<std::is_pod<T>::value>::type>
-    ostream& operator<<( const T& v )
+    D& operator<<( const T& v )
     {
-        write(reinterpret_cast<const char*>(&v), sizeof(T));
-        return *this;
+        write_n(&v, 1);
+        return *static_cast<D*>(this);
     }
 
-    ostream& operator<<( const std::string& s )
+    D& operator<<( const std::string& s )
     {
         size_t sz = s.size();
         *this << sz;
-        write(s.data(), sz);
-        return *this;
+        write_n(s.data(), sz);
+        return *static_cast<D*>(this);
     }
 
     template< typename T >
-    ostream& operator<<( const std::vector<T>& v )
+    D& operator<<( const std::vector<T>& v )
     {
         size_t sz = v.size();
         *this << sz;
         write_n(v.data(), sz);
-        return *this;
+        return *static_cast<D*>(this);
     }
 
     template<typename T, std::size_t N>
-    ostream& operator<<( const zi::vl::vec<T,N>& v )
+    D& operator<<( const zi::vl::vec<T,N>& v )
     {
-        for ( size_t i = 0; i < N; ++i )
-        {
-            *this << v[i];
-        }
-        return *this;
+        write_n(v.data(), N);
+        return *static_cast<D*>(this);
     }
 
     template<typename T>
-    ostream& operator<<( const cube<T>& c )
+    D& operator<<( const cube<T>& c )
     {
         write_n(c.memptr(), c.n_elem);
-        return *this;
+        return *static_cast<D*>(this);
+    }
+
+}; // struct typed_writer
+
+
+struct istream: typed_reader<istream>
+{
+private:
+    std::unique_ptr<detail::istream_wrapper_type_erasure> stream_;
+
+public:
+    template< class T >
+    explicit istream(T& s)
+        : stream_(new detail::istream_wrapper_type_erasure_of_stream<T>(s))
+    {}
+
+    void read(char* c, size_t n)
+    {
+        if ( n == 0 )
+        {
+            throw std::logic_error("Asked to read 0 bytes?");
+        }
+
+        stream_->read(c, n);
+
+        if ( !(*stream_) )
+        {
+            throw std::runtime_error("Not enough bytes in the stream");
+        }
+    }
+
+    operator bool() const
+    {
+        return static_cast<bool>(*stream_);
+    }
+
+}; // struct istream
+
+
+struct ostream: typed_writer<ostream>
+{
+private:
+    std::unique_ptr<detail::ostream_wrapper_type_erasure> stream_;
+
+public:
+    template< class T >
+    explicit ostream(T& s)
+        : stream_(new detail::ostream_wrapper_type_erasure_of_stream<T>(s))
+    {}
+
+    void write(const char* c, size_t n)
+    {
+        if ( n == 0 )
+        {
+            throw std::logic_error("Asked to write 0 bytes?");
+        }
+
+        stream_->write(c, n);
+    }
+
+    operator bool() const
+    {
+        return static_cast<bool>(*stream_);
     }
 
 }; // struct ostream
@@ -401,4 +417,467 @@ public:
 }; // struct iostream
 
 
+// A file accessed by offset (pread/pwrite), without any buffering or
+// state, so any number of threads can use it at once
+
+class file
+{
+public:
+    enum mode_type
+    {
+        read_only,
+        write_only, // created or truncated
+        read_write
+    };
+
+private:
+    int         fd_ = -1;
+    std::string name_;
+
+    void check( bool ok, const std::string& what ) const
+    {
+        if ( !ok )
+        {
+            throw std::runtime_error(what + " " + name_ + ": " +
+                                     std::strerror(errno));
+        }
+    }
+
+public:
+    explicit file( const std::string& name, mode_type mode = read_only )
+        : name_(name)
+    {
+        int flags = mode == read_only  ? O_RDONLY :
+                    mode == write_only ? O_WRONLY | O_CREAT | O_TRUNC :
+                                         O_RDWR | O_CREAT;
+
+        fd_ = ::open(name.c_str(), flags, 0644);
+        check(fd_ >= 0, "Can't open");
+    }
+
+    ~file()
+    {
+        if ( fd_ >= 0 )
+        {
+            ::close(fd_);
+        }
+    }
+
+    file(const file&) = delete;
+    file& operator=(const file&) = delete;
+
+    uint64_t size() const
+    {
+        struct stat st;
+        check(::fstat(fd_, &st) == 0, "Can't stat");
+        return st.st_size;
+    }
+
+    // Everything written so far is on the disk once this returns
+
+    void sync() const
+    {
+        check(::fsync(fd_) == 0, "Can't sync");
+    }
+
+    // Reads up to n bytes at off, fewer only at the end of the file
+
+    size_t read_some( char* p, size_t n, uint64_t off ) const
+    {
+        size_t done = 0;
+        while ( done < n )
+        {
+            ssize_t k = ::pread(fd_, p + done, n - done, off + done);
+            if ( k < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            check(k >= 0, "Can't read");
+            if ( k == 0 )
+            {
+                break;
+            }
+            done += k;
+        }
+        return done;
+    }
+
+    void read( char* p, size_t n, uint64_t off ) const
+    {
+        if ( read_some(p, n, off) != n )
+        {
+            throw std::runtime_error("Not enough bytes in " + name_);
+        }
+    }
+
+    void write( const char* p, size_t n, uint64_t off ) const
+    {
+        while ( n )
+        {
+            ssize_t k = ::pwrite(fd_, p, n, off);
+            if ( k < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            check(k > 0, "Can't write");
+            p   += k;
+            n   -= k;
+            off += k;
+        }
+    }
+
+}; // class file
+
+
+// Sequential reader of a file, with no virtual calls. Small reads are
+// served from the buffer, reads at least as large as the buffer go
+// straight from the file to the destination.
+
+class buffered_reader: public typed_reader<buffered_reader>
+{
+private:
+    file              file_ ;
+    std::vector<char> buf_  ;
+    size_t            begin_ = 0;
+    size_t            end_   = 0;
+    uint64_t          pos_   = 0; // of the end of the buffered data
+
+public:
+    explicit buffered_reader( const std::string& fname,
+                              size_t buffer_size = 1 << 20 )
+        : file_(fname)
+        , buf_(std::max<size_t>(buffer_size, 1))
+    {}
+
+    void read(char* c, size_t n)
+    {
+        if ( n == 0 )
+        {
+            throw std::logic_error("Asked to read 0 bytes?");
+        }
+
+        size_t k = std::min(n, end_ - begin_);
+        std::memcpy(c, buf_.data() + begin_, k);
+        begin_ += k;
+        c      += k;
+        n      -= k;
+
+        if ( n >= buf_.size() )
+        {
+            file_.read(c, n, pos_);
+            pos_ += n;
+        }
+        else if ( n )
+        {
+            begin_ = 0;
+            end_   = file_.read_some(buf_.data(), buf_.size(), pos_);
+            pos_  += end_;
+
+            if ( end_ < n )
+            {
+                throw std::runtime_error("Not enough bytes in the stream");
+            }
+
+            std::memcpy(c, buf_.data(), n);
+            begin_ = n;
+        }
+    }
+
+    uint64_t tell() const
+    {
+        return pos_ - ( end_ - begin_ );
+    }
+
+    void seek( uint64_t pos )
+    {
+        begin_ = end_ = 0;
+        pos_   = pos;
+    }
+
+}; // class buffered_reader
+
+
+// Sequential writer of a file, with no virtual calls. Small writes are
+// collected in the buffer, writes at least as large as the buffer go
+// straight to the file.
+//
+// With write behind, the full buffers are written by a separate thread
+// (while the next one is being filled), at most max_pending of them
+// waiting at any time. The errors of the writing thread are reported by
+// a later write, flush or close. Nothing can be written once closed.
+
+class buffered_writer: public typed_writer<buffered_writer>
+{
+private:
+    struct chunk
+    {
+        std::vector<char> data;
+        size_t            size;
+        uint64_t          pos ;
+    };
+
+private:
+    file              file_;
+    size_t            size_;
+    std::vector<char> buf_ ;
+    size_t            used_ = 0;
+    uint64_t          pos_  = 0; // of the start of the buffer
+
+    bool                    async_      ;
+    size_t                  max_pending_;
+    std::deque<chunk>       pending_    ;
+    std::vector<std::vector<char>> free_;
+    bool                    writing_ = false;
+    bool                    done_    = false;
+    bool                    closed_  = false;
+    std::exception_ptr      error_   ;
+    std::mutex              mutex_   ;
+    std::condition_variable cv_      ;
+    std::thread             thread_  ;
+
+private:
+    void writer_loop()
+    {
+        std::unique_lock<std::mutex> g(mutex_);
+
+        while ( true )
+        {
+            while ( pending_.empty() && !done_ )
+            {
+                cv_.wait(g);
+            }
+
+            if ( pending_.empty() )
+            {
+                return;
+            }
+
+            chunk c = std::move(pending_.front());
+            pending_.pop_front();
+            writing_ = true;
+
+            g.unlock();
+
+            std::exception_ptr e;
+
+            try
+            {
+                file_.write(c.data.data(), c.size, c.pos);
+            }
+            catch ( ... )
+            {
+                e = std::current_exception();
+            }
+
+            g.lock();
+
+            if ( e )
+            {
+                error_ = e;
+            }
+
+            writing_ = false;
+            free_.push_back(std::move(c.data));
+            cv_.notify_all();
+        }
+    }
+
+    void rethrow()
+    {
+        if ( error_ )
+        {
+            std::exception_ptr e = error_;
+            error_ = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+    // Hands the buffer over to the file (or the writing thread)
+
+    void submit()
+    {
+        if ( used_ == 0 )
+        {
+            return;
+        }
+
+        if ( !async_ )
+        {
+            file_.write(buf_.data(), used_, pos_);
+        }
+        else
+        {
+            std::unique_lock<std::mutex> g(mutex_);
+            rethrow();
+
+            while ( pending_.size() >= max_pending_ )
+            {
+                cv_.wait(g);
+            }
+
+            pending_.push_back(chunk{ std::move(buf_), used_, pos_ });
+            cv_.notify_all();
+
+            if ( free_.empty() )
+            {
+                buf_ = std::vector<char>(size_);
+            }
+            else
+            {
+                buf_ = std::move(free_.back());
+                free_.pop_back();
+            }
+        }
+
+        pos_ += used_;
+        used_ = 0;
+    }
+
+    // Waits for the writing thread to be done with everything submitted
+
+    void drain()
+    {
+        if ( async_ )
+        {
+            std::unique_lock<std::mutex> g(mutex_);
+            while ( !pending_.empty() || writing_ )
+            {
+                cv_.wait(g);
+            }
+            rethrow();
+        }
+    }
+
+public:
+    explicit buffered_writer( const std::string& fname,
+                              size_t buffer_size = 1 << 20,
+                              bool write_behind = false,
+                              size_t max_pending = 2 )
+        : file_(fname, file::write_only)
+        , size_(std::max<size_t>(buffer_size, 1))
+        , buf_(size_)
+        , async_(write_behind)
+        , max_pending_(std::max<size_t>(max_pending, 1))
+    {
+        if ( async_ )
+        {
+            thread_ = std::thread(&buffered_writer::writer_loop, this);
+        }
+    }
+
+    ~buffered_writer()
+    {
+        try
+        {
+            close();
+        }
+        catch ( ... )
+        {
+        }
+    }
+
+    buffered_writer(const buffered_writer&) = delete;
+    buffered_writer& operator=(const buffered_writer&) = delete;
+
+    void write(const char* c, size_t n)
+    {
+        if ( n == 0 )
+        {
+            throw std::logic_error("Asked to write 0 bytes?");
+        }
+
+        if ( closed_ )
+        {
+            throw std::logic_error("Asked to write to a closed file");
+        }
+
+        if ( used_ + n > size_ )
+        {
+            if ( used_ )
+            {
+                size_t k = size_ - used_;
+                std::memcpy(buf_.data() + used_, c, k);
+                used_ = size_;
+                c += k;
+                n -= k;
+                submit();
+            }
+
+            // The caller can reuse its memory as soon as we return, so a
+            // large write is done right away, next to the writing thread
+
+            if ( n >= size_ )
+            {
+                file_.write(c, n, pos_);
+                pos_ += n;
+                return;
+            }
+        }
+
+        std::memcpy(buf_.data() + used_, c, n);
+        used_ += n;
+    }
+
+    uint64_t tell() const
+    {
+        return pos_ + used_;
+    }
+
+    // Everything written so far is in the file once this returns
+
+    void flush()
+    {
+        submit();
+        drain();
+    }
+
+    // Same, on the disk
+
+    void sync()
+    {
+        flush();
+        file_.sync();
+    }
+
+    // Flushes and stops the writing thread, even when the flush fails
+    // (its error is thrown). Closing again does nothing.
+
+    void close()
+    {
+        if ( closed_ )
+        {
+            return;
+        }
+
+        closed_ = true;
+
+        std::exception_ptr e;
+
+        try
+        {
+            flush();
+        }
+        catch ( ... )
+        {
+            e = std::current_exception();
+        }
+
+        if ( thread_.joinable() )
+        {
+            {
+                std::unique_lock<std::mutex> g(mutex_);
+                done_ = true;
+                cv_.notify_all();
+            }
+            thread_.join();
+        }
+
+        if ( e )
+        {
+            std::rethrow_exception(e);
+        }
+    }
+
+}; // class buffered_writer
+
 }}} // namespace zi::znn::io
@@ -0,0 +1,128 @@
+// Throughput of the binary I/O paths of diskio.hpp: the type erased
+// io::ostream/io::istream over the standard streams versus the
+// buffered_writer/buffered_reader (with and without write behind), on a
+// cube written and read both in bulk and one element at the time (as
+// small records are).
+//
+// The file is read right after being written, so the reads are mostly
+// served by the page cache.
+//
+// usage: diskio_benchmark [size in MB] [file]
+
+#include "diskio.hpp"
+
+#include <zi/time.hpp>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+
+namespace arma {
+thread_local arma_rng_cxx11 arma_rng_cxx11_instance;
+}
+
+using namespace zi::znn;
+
+namespace {
+
+double mbs(std::size_t bytes, zi::wall_timer& t)
+{
+    return bytes / 1048576.0 / t.elapsed<double>();
+}
+
+template<typename F>
+void run(const std::string& what, std::size_t bytes, F f)
+{
+    zi::wall_timer t;
+    f();
+    std::cout << what << ": " << mbs(bytes, t) << " MB/s" << std::endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    std::size_t mb    = argc > 1 ? std::atoi(argv[1]) : 1024;
+    std::string fname = argc > 2 ? argv[2] : "/tmp/znn_diskio_benchmark";
+
+    std::size_t n     = mb * 1048576 / sizeof(double);
+    std::size_t bytes = n * sizeof(double);
+
+    cube<double> c(n / 1024, 32, 32);
+    c.randu();
+
+    cube<double> r(c.n_rows, c.n_cols, c.n_slices);
+    const double* p = c.memptr();
+    double*       q = r.memptr();
+
+    auto verify = [&]() {
+        if ( std::memcmp(c.memptr(), r.memptr(), bytes) )
+        {
+            std::cerr << "mismatch" << std::endl;
+            std::exit(1);
+        }
+        r.zeros();
+    };
+
+    run("io::ostream bulk           ", bytes, [&]() {
+            std::ofstream f(fname.c_str(), std::ios::binary);
+            io::ostream   os(f);
+            os << c;
+            f.close();
+        });
+
+    run("io::istream bulk           ", bytes, [&]() {
+            std::ifstream f(fname.c_str(), std::ios::binary);
+            io::istream   is(f);
+            is >> r;
+        });
+    verify();
+
+    run("buffered_writer bulk       ", bytes, [&]() {
+            io::buffered_writer w(fname);
+            w << c;
+            w.close();
+        });
+
+    run("buffered_reader bulk       ", bytes, [&]() {
+            io::buffered_reader rd(fname);
+            rd >> r;
+        });
+    verify();
+
+    run("io::ostream elementwise    ", bytes, [&]() {
+            std::ofstream f(fname.c_str(), std::ios::binary);
+            io::ostream   os(f);
+            for ( std::size_t i = 0; i < n; ++i ) os << p[i];
+            f.close();
+        });
+
+    run("io::istream elementwise    ", bytes, [&]() {
+            std::ifstream f(fname.c_str(), std::ios::binary);
+            io::istream   is(f);
+            for ( std::size_t i = 0; i < n; ++i ) is >> q[i];
+        });
+    verify();
+
+    run("buffered_writer elementwise", bytes, [&]() {
+            io::buffered_writer w(fname);
+            for ( std::size_t i = 0; i < n; ++i ) w << p[i];
+            w.close();
+        });
+
+    run("write behind elementwise   ", bytes, [&]() {
+            io::buffered_writer w(fname, 1 << 20, true);
+            for ( std::size_t i = 0; i < n; ++i ) w << p[i];
+            w.close();
+        });
+
+    run("buffered_reader elementwise", bytes, [&]() {
+            io::buffered_reader rd(fname);
+            for ( std::size_t i = 0; i < n; ++i ) rd >> q[i];
+        });
+    verify();
+
+    std::remove(fname.c_str());
+}
@@ -8,6 +8,7 @@
 #include "types.hpp"
 #include "cube_pool.hpp"
 #include "cube_utils.hpp"
+#include "trace.hpp"
 
 
 namespace zi {
@@ -110,6 +111,8 @@ struct fftw
 
         fftw_plan plan = detail::plans.get_forward(size(in));
 
+        trace::scope ts(trace::fft);
+
         fftw_execute_dft_r2c(plan,
                              const_cast<double*>(in.memptr()),
                              reinterpret_cast<fftw_complex*>(out.memptr()));
@@ -124,6 +127,8 @@ struct fftw
 
         fftw_plan plan = detail::plans.get_backward(size(out));
 
+        trace::scope ts(trace::ifft);
+
         fftw_execute_dft_c2r(plan,
                              reinterpret_cast<fftw_complex*>(
                                  const_cast<complex*>(in.memptr())),
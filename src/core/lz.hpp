@@ -0,0 +1,205 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+
+namespace zi {
+namespace znn {
+namespace lz {
+
+// A small LZ77 codec in the spirit of LZ4: a sequence of
+//
+//    token | [literal length] | literals | offset | [match length]
+//
+// where the high nibble of the token is the number of literals, the
+// low nibble the match length minus 4, 15 meaning that more length
+// bytes follow (each one added, until one is less than 255). The offset
+// is 16 bits (little endian). The last sequence only has literals.
+//
+// Fast on the kind of data we have (runs of labels, smooth images after
+// byte shuffling), and needs nothing but this header.
+
+namespace detail {
+
+inline void put_length( std::vector<char>& out, std::size_t n )
+{
+    while ( n >= 255 )
+    {
+        out.push_back(static_cast<char>(255));
+        n -= 255;
+    }
+    out.push_back(static_cast<char>(n));
+}
+
+inline std::size_t get_length( const unsigned char*& p,
+                               const unsigned char* end )
+{
+    std::size_t n = 0;
+    unsigned char c;
+    do
+    {
+        if ( p == end )
+        {
+            throw std::runtime_error("lz: truncated input");
+        }
+        c  = *p++;
+        n += c;
+    } while ( c == 255 );
+    return n;
+}
+
+inline uint32_t read32( const char* p )
+{
+    uint32_t r;
+    std::memcpy(&r, p, 4);
+    return r;
+}
+
+inline void put_sequence( std::vector<char>& out,
+                          const char* lit, std::size_t nlit,
+                          std::size_t offset, std::size_t nmatch )
+{
+    std::size_t m = nmatch ? nmatch - 4 : 0;
+
+    out.push_back(static_cast<char>(( ( nlit < 15 ? nlit : 15 ) << 4 ) |
+                                    ( m < 15 ? m : 15 )));
+
+    if ( nlit >= 15 )
+    {
+        put_length(out, nlit - 15);
+    }
+
+    out.insert(out.end(), lit, lit + nlit);
+
+    if ( nmatch )
+    {
+        out.push_back(static_cast<char>(offset & 0xff));
+        out.push_back(static_cast<char>(offset >> 8));
+
+        if ( m >= 15 )
+        {
+            put_length(out, m - 15);
+        }
+    }
+}
+
+} // namespace detail
+
+// Appends the compressed in[0..n) to out
+
+inline void compress( const char* in, std::size_t n, std::vector<char>& out )
+{
+    static const std::size_t hash_bits = 14;
+    std::vector<uint32_t> table(1 << hash_bits, 0);
+
+    auto hash = [](uint32_t v) {
+        return ( v * 2654435761u ) >> ( 32 - hash_bits );
+    };
+
+    std::size_t anchor = 0;
+    std::size_t i      = 0;
+
+    // table stores position + 1, 0 being empty
+
+    while ( i + 4 <= n )
+    {
+        uint32_t    v = detail::read32(in + i);
+        uint32_t&   e = table[hash(v)];
+        std::size_t c = e;
+        e = static_cast<uint32_t>(i + 1);
+
+        if ( c && i - ( c - 1 ) <= 0xffff &&
+             detail::read32(in + c - 1) == v )
+        {
+            std::size_t m = c - 1;
+            std::size_t l = 4;
+
+            while ( i + l < n && in[m + l] == in[i + l] )
+            {
+                ++l;
+            }
+
+            detail::put_sequence(out, in + anchor, i - anchor, i - m, l);
+
+            i     += l;
+            anchor = i;
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    detail::put_sequence(out, in + anchor, n - anchor, 0, 0);
+}
+
+// Decompresses exactly n bytes into out, throws on corrupt input
+
+inline void decompress( const char* in, std::size_t len,
+                        char* out, std::size_t n )
+{
+    const unsigned char* p   = reinterpret_cast<const unsigned char*>(in);
+    const unsigned char* end = p + len;
+    std::size_t          o   = 0;
+
+    while ( p < end )
+    {
+        unsigned char token = *p++;
+
+        std::size_t nlit = token >> 4;
+        if ( nlit == 15 )
+        {
+            nlit += detail::get_length(p, end);
+        }
+
+        if ( nlit > static_cast<std::size_t>(end - p) || nlit > n - o )
+        {
+            throw std::runtime_error("lz: corrupt input");
+        }
+
+        std::memcpy(out + o, p, nlit);
+        p += nlit;
+        o += nlit;
+
+        if ( p == end )
+        {
+            break;
+        }
+
+        if ( end - p < 2 )
+        {
+            throw std::runtime_error("lz: truncated input");
+        }
+
+        std::size_t offset = p[0] | ( p[1] << 8 );
+        p += 2;
+
+        std::size_t l = ( token & 15 ) + 4;
+        if ( ( token & 15 ) == 15 )
+        {
+            l += detail::get_length(p, end);
+        }
+
+        if ( offset == 0 || offset > o || l > n - o )
+        {
+            throw std::runtime_error("lz: corrupt input");
+        }
+
+        // Byte by byte, the match can overlap the output
+
+        for ( std::size_t k = 0; k < l; ++k, ++o )
+        {
+            out[o] = out[o - offset];
+        }
+    }
+
+    if ( o != n )
+    {
+        throw std::runtime_error("lz: size mismatch");
+    }
+}
+
+}}} // namespace zi::znn::lz
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <cstddef>
+
+#include "types.hpp"
+
+namespace zi {
+namespace znn {
+
+// A fixed number of mutexes shared among a (much) larger number of
+// objects, identified by up to three indices
+
+class striped_locks
+{
+private:
+    std::vector<std::mutex> mutexes_;
+
+public:
+    explicit striped_locks(std::size_t n)
+        : mutexes_(n)
+    {
+        ZI_ASSERT(n>0);
+    }
+
+    std::mutex& get(std::size_t a, std::size_t b = 0, std::size_t c = 0)
+    {
+        std::size_t h = a * 73856093 ^ b * 19349663 ^ c * 83492791;
+        return mutexes_[h % mutexes_.size()];
+    }
+
+    std::size_t size() const
+    {
+        return mutexes_.size();
+    }
+
+}; // class striped_locks
+
+}} // namespace zi::znn
@@ -0,0 +1,565 @@
+#pragma once
+
+#include <zi/utility/singleton.hpp>
+#include <zi/async.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "types.hpp"
+
+// Low overhead tracing of the scheduler and the layers. Each thread
+// records (type, layer, featuremap, queued, start, end) events into its
+// own ring buffer, so recording never takes a lock. When tracing is
+// disabled the only cost is a relaxed load of a single atomic flag.
+//
+// The buffers are meant to be read (dumped/summarized) while the
+// network is quiescent, e.g. between iterations.
+
+namespace zi {
+namespace znn {
+namespace trace {
+
+enum event_type : uint8_t
+{
+    // Top level tasks executed by the async pool
+    forward_task = 0,
+    backward_task,
+    dispatch_task,
+    update_task,
+
+    // Work done inside of the tasks
+    fft,
+    ifft,
+    mult,
+    accumulate,
+    epilogue,
+    pooling,
+    convolve,
+    allreduce,
+
+    num_event_types
+};
+
+inline const char* event_name( uint8_t t )
+{
+    static const char* names[] = { "forward", "backward", "dispatch",
+                                   "update", "fft", "ifft", "mult",
+                                   "accumulate", "epilogue", "pooling",
+                                   "convolve", "allreduce" };
+    return ( t < num_event_types ) ? names[t] : "unknown";
+}
+
+inline bool is_task( uint8_t t )
+{
+    return t < fft;
+}
+
+static const uint32_t none = 0xffffffff;
+
+struct event
+{
+    uint64_t queued;
+    uint64_t start ;
+    uint64_t end   ;
+    uint32_t layer ;
+    uint32_t fmap  ;
+    uint8_t  type  ;
+};
+
+namespace detail {
+
+class ring_buffer
+{
+private:
+    std::vector<event> events_;
+    uint64_t           head_ = 0;
+    std::size_t        tid_;
+
+public:
+    ring_buffer( std::size_t capacity, std::size_t tid )
+        : events_(capacity)
+        , tid_(tid)
+    {}
+
+    void push( const event& e )
+    {
+        events_[head_ % events_.size()] = e;
+        ++head_;
+    }
+
+    void clear()
+    {
+        head_ = 0;
+    }
+
+    std::size_t tid() const
+    {
+        return tid_;
+    }
+
+    template<typename F>
+    void for_each( F f ) const
+    {
+        uint64_t first = ( head_ > events_.size() ) ?
+            head_ - events_.size() : 0;
+
+        for ( uint64_t i = first; i < head_; ++i )
+        {
+            f(events_[i % events_.size()]);
+        }
+    }
+
+}; // class ring_buffer
+
+class tracer_impl
+{
+private:
+    // The buffers are never freed, as the worker threads can still be
+    // closing their last events while the process exits
+
+    std::mutex                            m_;
+    std::vector<ring_buffer*>             buffers_;
+    std::size_t                           capacity_ = 1 << 16;
+
+public:
+    std::atomic<bool>                     enabled;
+    std::chrono::steady_clock::time_point epoch;
+
+    tracer_impl()
+        : enabled(false)
+        , epoch(std::chrono::steady_clock::now())
+    {}
+
+    ring_buffer* new_buffer()
+    {
+        guard g(m_);
+        buffers_.push_back(new ring_buffer(capacity_, buffers_.size()));
+        return buffers_.back();
+    }
+
+    void set_capacity( std::size_t c )
+    {
+        guard g(m_);
+        capacity_ = c;
+    }
+
+    void clear()
+    {
+        guard g(m_);
+        for ( auto& b: buffers_ ) b->clear();
+        epoch = std::chrono::steady_clock::now();
+    }
+
+    template<typename F>
+    void for_each( F f )
+    {
+        guard g(m_);
+        for ( auto& b: buffers_ )
+        {
+            std::size_t tid = b->tid();
+            b->for_each([&](const event& e) { f(tid, e); });
+        }
+    }
+
+    std::size_t num_threads()
+    {
+        guard g(m_);
+        return buffers_.size();
+    }
+
+}; // class tracer_impl
+
+namespace {
+tracer_impl& tracer = zi::singleton<tracer_impl>::instance();
+}
+
+inline ring_buffer& local_buffer()
+{
+    static thread_local ring_buffer* buffer = tracer.new_buffer();
+    return *buffer;
+}
+
+// The layer and featuremap of the task currently executed by this
+// thread. The events recorded within the task inherit them.
+
+struct context
+{
+    uint32_t layer = none;
+    uint32_t fmap  = none;
+};
+
+inline context& local_context()
+{
+    static thread_local context ctx;
+    return ctx;
+}
+
+} // namespace detail
+
+inline bool enabled()
+{
+    return detail::tracer.enabled.load(std::memory_order_relaxed);
+}
+
+inline void enable()
+{
+    detail::tracer.enabled = true;
+}
+
+inline void disable()
+{
+    detail::tracer.enabled = false;
+}
+
+// Should be called before the first event is recorded
+inline void set_buffer_capacity( std::size_t n )
+{
+    detail::tracer.set_capacity(n);
+}
+
+inline void clear()
+{
+    detail::tracer.clear();
+}
+
+namespace detail {
+
+inline uint64_t clock()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+        (std::chrono::steady_clock::now() - tracer.epoch).count();
+}
+
+} // namespace detail
+
+// Zero when tracing is disabled
+inline uint64_t now()
+{
+    return enabled() ? detail::clock() : 0;
+}
+
+class scope
+{
+private:
+    bool     on_   ;
+    event    e_    ;
+    uint32_t old_layer_;
+    uint32_t old_fmap_ ;
+
+public:
+    scope( uint8_t type,
+           std::size_t layer = none,
+           std::size_t fmap  = none,
+           uint64_t queued = 0 )
+        : on_(enabled())
+        , old_layer_(none)
+        , old_fmap_(none)
+    {
+        if ( on_ )
+        {
+            detail::context& ctx = detail::local_context();
+
+            old_layer_ = ctx.layer;
+            old_fmap_  = ctx.fmap;
+
+            e_.type   = type;
+            e_.layer  = ( layer == none ) ? ctx.layer : layer;
+            e_.fmap   = ( fmap  == none ) ? ctx.fmap  : fmap ;
+
+            ctx.layer = e_.layer;
+            ctx.fmap  = e_.fmap;
+
+            e_.start  = detail::clock();
+            e_.queued = queued ? queued : e_.start;
+        }
+    }
+
+    ~scope()
+    {
+        if ( on_ )
+        {
+            e_.end = detail::clock();
+            detail::local_buffer().push(e_);
+
+            detail::context& ctx = detail::local_context();
+            ctx.layer = old_layer_;
+            ctx.fmap  = old_fmap_;
+        }
+    }
+
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+}; // class scope
+
+// Attributes the events recorded within the scope to the given layer
+// and featuremap, without recording an event of its own.
+
+class attribute_to
+{
+private:
+    bool     on_       ;
+    uint32_t old_layer_;
+    uint32_t old_fmap_ ;
+
+public:
+    attribute_to( std::size_t layer, std::size_t fmap )
+        : on_(enabled())
+        , old_layer_(none)
+        , old_fmap_(none)
+    {
+        if ( on_ )
+        {
+            detail::context& ctx = detail::local_context();
+
+            old_layer_ = ctx.layer;
+            old_fmap_  = ctx.fmap;
+            ctx.layer  = layer;
+            ctx.fmap   = fmap;
+        }
+    }
+
+    ~attribute_to()
+    {
+        if ( on_ )
+        {
+            detail::context& ctx = detail::local_context();
+            ctx.layer = old_layer_;
+            ctx.fmap  = old_fmap_;
+        }
+    }
+
+    attribute_to(const attribute_to&) = delete;
+    attribute_to& operator=(const attribute_to&) = delete;
+
+}; // class attribute_to
+
+namespace detail {
+
+inline void run_task( uint8_t type, std::size_t layer, std::size_t fmap,
+                      uint64_t queued, const std::function<void()>& f )
+{
+    scope s(type, layer, fmap, queued);
+    f();
+}
+
+} // namespace detail
+
+// Same as zi::async::async_priority_mem, except that, when tracing is
+// enabled, the time spent in the queue and executing is recorded
+
+template<typename... Args>
+inline void async_priority_mem( std::size_t priority, std::size_t bytes,
+                                uint8_t type, std::size_t layer,
+                                std::size_t fmap, Args&&... args )
+{
+    if ( enabled() )
+    {
+        std::function<void()> f = std::bind(std::forward<Args>(args)...);
+        zi::async::async_priority_mem(priority, bytes, &detail::run_task,
+                                      type, layer, fmap, now(),
+                                      std::move(f));
+    }
+    else
+    {
+        zi::async::async_priority_mem(priority, bytes,
+                                      std::forward<Args>(args)...);
+    }
+}
+
+template<typename... Args>
+inline void async_priority( std::size_t priority, uint8_t type,
+                            std::size_t layer, std::size_t fmap,
+                            Args&&... args )
+{
+    async_priority_mem(priority, 0, type, layer, fmap,
+                       std::forward<Args>(args)...);
+}
+
+template<typename... Args>
+inline void async( uint8_t type, std::size_t layer, std::size_t fmap,
+                   Args&&... args )
+{
+    async_priority(0, type, layer, fmap, std::forward<Args>(args)...);
+}
+
+template<typename R>
+inline R run_task_future( uint8_t type, std::size_t layer, std::size_t fmap,
+                          uint64_t queued, const std::function<R()>& f )
+{
+    scope s(type, layer, fmap, queued);
+    return f();
+}
+
+// Same as zi::async::async_priority_future, records the task as above
+
+template<typename... Args>
+inline auto async_priority_future( std::size_t priority, uint8_t type,
+                                   std::size_t layer, std::size_t fmap,
+                                   Args&&... args )
+    -> decltype(zi::async::async_priority_future
+                (priority, std::forward<Args>(args)...))
+{
+    if ( enabled() )
+    {
+        typedef decltype(std::bind(std::forward<Args>(args)...)()) R;
+        std::function<R()> f = std::bind(std::forward<Args>(args)...);
+        return zi::async::async_priority_future
+            (priority, &run_task_future<R>, type, layer, fmap, now(),
+             std::move(f));
+    }
+    else
+    {
+        return zi::async::async_priority_future
+            (priority, std::forward<Args>(args)...);
+    }
+}
+
+template<typename... Args>
+inline auto async_future( uint8_t type, std::size_t layer, std::size_t fmap,
+                          Args&&... args )
+    -> decltype(zi::async::async_priority_future
+                (0, std::forward<Args>(args)...))
+{
+    return async_priority_future(0, type, layer, fmap,
+                                 std::forward<Args>(args)...);
+}
+
+// Chrome trace_event format, can be opened with chrome://tracing
+
+inline void write_chrome_trace( std::ostream& out )
+{
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    bool first = true;
+
+    detail::tracer.for_each([&](std::size_t tid, const event& e) {
+            out << ( first ? "\n" : ",\n" );
+            first = false;
+
+            out << "{\"name\":\"" << event_name(e.type)
+                << "\",\"cat\":\"" << ( is_task(e.type) ? "task" : "work" )
+                << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << tid
+                << std::fixed << std::setprecision(3)
+                << ",\"ts\":" << e.start / 1000.0
+                << ",\"dur\":" << ( e.end - e.start ) / 1000.0
+                << ",\"args\":{";
+
+            if ( e.layer != none ) out << "\"layer\":" << e.layer << ",";
+            if ( e.fmap  != none ) out << "\"fmap\":"  << e.fmap  << ",";
+
+            out << "\"queued_us\":" << ( e.start - e.queued ) / 1000.0
+                << "}}";
+        });
+
+    out << "\n]}\n";
+}
+
+inline void write_chrome_trace( const std::string& fname )
+{
+    std::ofstream out(fname.c_str());
+    write_chrome_trace(out);
+}
+
+// Per layer summary. For each layer we consider the window between the
+// start of its first task and the end of its last one. Busy time is the
+// total time spent executing the layer's tasks, queueing time is the
+// total time the tasks spent waiting in the pool and idle time is the
+// thread time within the window that no task (of any layer) used.
+
+inline void print_summary( std::ostream& out = std::cout )
+{
+    struct layer_stats
+    {
+        std::size_t tasks = 0;
+        uint64_t    busy  = 0;
+        uint64_t    queue = 0;
+        uint64_t    begin = std::numeric_limits<uint64_t>::max();
+        uint64_t    end   = 0;
+        uint64_t    work[num_event_types] = {0};
+    };
+
+    std::map<uint32_t, layer_stats> layers;
+    std::vector<std::pair<uint64_t,uint64_t>> busy;
+
+    std::size_t nthreads = 0;
+
+    detail::tracer.for_each([&](std::size_t tid, const event& e) {
+            nthreads = std::max(nthreads, tid + 1);
+            layer_stats& s = layers[e.layer];
+            s.work[e.type] += e.end - e.start;
+            if ( is_task(e.type) )
+            {
+                ++s.tasks;
+                s.busy  += e.end - e.start;
+                s.queue += e.start - e.queued;
+                s.begin  = std::min(s.begin, e.start);
+                s.end    = std::max(s.end, e.end);
+                busy.emplace_back(e.start, e.end);
+            }
+        });
+
+    auto busy_within = [&](uint64_t b, uint64_t e) {
+        uint64_t r = 0;
+        for ( auto& t: busy )
+        {
+            uint64_t lo = std::max(b, t.first);
+            uint64_t hi = std::min(e, t.second);
+            if ( hi > lo ) r += hi - lo;
+        }
+        return r;
+    };
+
+    out << std::fixed << std::setprecision(3)
+        << "layer      tasks     busy(ms)    queue(ms)     idle(ms)\n";
+
+    for ( auto& l: layers )
+    {
+        const layer_stats& s = l.second;
+
+        if ( s.tasks == 0 ) continue;
+
+        uint64_t window = ( s.end - s.begin ) * nthreads;
+        uint64_t used   = busy_within(s.begin, s.end);
+        uint64_t idle   = ( window > used ) ? window - used : 0;
+
+        if ( l.first == none )
+            out << std::setw(5) << "-";
+        else
+            out << std::setw(5) << l.first;
+
+        out << std::setw(11) << s.tasks
+            << std::setw(13) << s.busy  / 1e6
+            << std::setw(13) << s.queue / 1e6
+            << std::setw(13) << idle    / 1e6 << "\n";
+
+        bool any = false;
+        for ( uint8_t t = fft; t < num_event_types; ++t )
+        {
+            if ( s.work[t] )
+            {
+                out << ( any ? " " : "      " )
+                    << event_name(t) << ":" << s.work[t] / 1e6;
+                any = true;
+            }
+        }
+        if ( any ) out << "\n";
+    }
+
+    out << std::flush;
+}
+
+}}} // namespace zi::znn::trace
@@ -0,0 +1,172 @@
+// Scaling benchmark of the data parallel training. Runs the same amount
+// of training per process with 1, 2, 4 and 8 processes on this machine
+// (communicating through unix sockets), and reports the throughput and
+// the scaling efficiency relative to a single process.
+//
+// usage: benchmark [iterations] [width] [input size]
+
+#include "data_parallel_network.hpp"
+#include "ring.hpp"
+#include "../network/layered_network.hpp"
+#include "../network/layered_network_data.hpp"
+#include "../network/parallel_network.hpp"
+#include "../transfer_fn/transfer_fn.hpp"
+
+#include <zi/time.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+namespace arma {
+thread_local arma_rng_cxx11 arma_rng_cxx11_instance;
+}
+
+using namespace zi::znn;
+
+namespace {
+
+// A single process of the ring, prints the number of samples per second
+// it processed
+
+int worker(const std::string& addr, size_t rank, size_t size,
+           size_t iterations, size_t width, size_t input)
+{
+    zi::async::set_concurrency(1);
+
+    layered_network net(1);
+    net.add_layer(width, vec3s(5,5,1), 0.01);
+    net.add_layer(width, vec3s(5,5,1), 0.01);
+    net.add_layer(1, vec3s(1,1,1), 0.01);
+
+    layered_network_data nld(net);
+    parallel_network     pnet(nld, make_transfer_fn<sigmoid>());
+
+    distributed::ring                  r(addr, rank, size);
+    distributed::data_parallel_network dnet(pnet, r);
+
+    std::vector<cube<double>> in(1);
+    in[0].randu(input, input, 1);
+
+    r.barrier();
+    zi::wall_timer timer;
+
+    for ( size_t i = 0; i < iterations; ++i )
+    {
+        std::vector<cube<double>> out = dnet.forward(in);
+        out[0] -= 0.5;
+        dnet.backward(out);
+        dnet.grad_update();
+    }
+
+    r.barrier();
+
+    if ( rank == 0 )
+    {
+        std::cout << iterations * size / timer.elapsed<double>() << std::endl;
+    }
+
+    return 0;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    if ( argc == 8 && std::string(argv[1]) == "--worker" )
+    {
+        return worker(argv[2], std::atoi(argv[3]), std::atoi(argv[4]),
+                      std::atoi(argv[5]), std::atoi(argv[6]),
+                      std::atoi(argv[7]));
+    }
+
+    std::string iterations = argc > 1 ? argv[1] : "20";
+    std::string width      = argc > 2 ? argv[2] : "8";
+    std::string input      = argc > 3 ? argv[3] : "40";
+
+    std::string addr = "unix:/tmp/znn_benchmark_" + std::to_string(::getpid());
+
+    double base = 0;
+
+    for ( size_t n: { 1, 2, 4, 8 } )
+    {
+        // The workers re-execute this binary, so that they don't inherit
+        // the state (and the threads) of this process
+
+        int fds[2];
+        if ( ::pipe(fds) )
+        {
+            std::cerr << "pipe failed" << std::endl;
+            return 1;
+        }
+
+        std::vector<pid_t> pids;
+
+        for ( size_t rank = 0; rank < n; ++rank )
+        {
+            std::string srank = std::to_string(rank);
+            std::string ssize = std::to_string(n);
+
+            pid_t pid = ::fork();
+
+            if ( pid == 0 )
+            {
+                if ( rank == 0 )
+                {
+                    ::dup2(fds[1], STDOUT_FILENO);
+                }
+
+                ::close(fds[0]);
+                ::close(fds[1]);
+
+                const char* args[] = { argv[0], "--worker", addr.c_str(),
+                                       srank.c_str(), ssize.c_str(),
+                                       iterations.c_str(), width.c_str(),
+                                       input.c_str(), nullptr };
+                ::execv(argv[0], const_cast<char**>(args));
+                ::_exit(127);
+            }
+
+            pids.push_back(pid);
+        }
+
+        ::close(fds[1]);
+
+        std::string result;
+        char buf[64];
+        ssize_t k;
+        while ( (k = ::read(fds[0], buf, sizeof(buf))) > 0 )
+        {
+            result.append(buf, k);
+        }
+        ::close(fds[0]);
+
+        bool ok = true;
+        for ( auto pid: pids )
+        {
+            int status;
+            ::waitpid(pid, &status, 0);
+            ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+
+        if ( !ok || result.empty() )
+        {
+            std::cerr << n << " processes: failed" << std::endl;
+            return 1;
+        }
+
+        double rate = std::atof(result.c_str());
+        if ( n == 1 )
+        {
+            base = rate;
+        }
+
+        std::cout << n << " processes: " << rate << " samples/s, "
+                  << "efficiency " << ( 100 * rate / ( base * n ) ) << "%"
+                  << std::endl;
+    }
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include <zi/async.hpp>
+
+#include "ring.hpp"
+#include "../network/layered_network_data.hpp"
+#include "../network/parallel_network.hpp"
+#include "../core/trace.hpp"
+
+namespace zi {
+namespace znn {
+namespace distributed {
+
+// Data parallel training over a ring of processes. Each process runs
+// its own parallel_network on its own samples; the gradients are
+// averaged over all the processes (ring all-reduce) so that every one
+// of them applies the same update. The weights are initially
+// broadcast from the process of rank 0.
+//
+// The gradients of each layer are sent as soon as the backward pass is
+// done with the layer, by a separate communication thread, while the
+// backward pass continues with the layers below.
+
+class data_parallel_network
+{
+private:
+    typedef std::vector<cube<double>> cubes_type;
+
+private:
+    parallel_network&     net_ ;
+    layered_network_data& data_;
+    ring&                 ring_;
+
+    // Packed gradients of each layer, the biases first
+
+    std::vector<std::vector<double>> buffers_;
+
+    std::vector<zi::async::promise<void>> reduced_;
+
+    std::deque<size_t>      queue_   ;
+    bool                    done_    = false;
+    std::exception_ptr      error_   ; // of the ring, failing the rest
+    std::mutex              mutex_   ;
+    std::condition_variable cv_      ;
+    std::thread             thread_  ;
+
+private:
+    size_t layer_size(size_t l)
+    {
+        network_layer& nl = data_.layer(l);
+        return nl.num_outputs() + nl.num_inputs() * nl.num_outputs()
+            * nl.filter_size()[0] * nl.filter_size()[1] * nl.filter_size()[2];
+    }
+
+    template<typename F>
+    void for_each_weight(size_t l, F f)
+    {
+        network_layer& nl = data_.layer(l);
+        double* p = buffers_[l].data();
+
+        for ( size_t j = 0; j < nl.num_outputs(); ++j )
+        {
+            f(p++, data_.dEdB(l,j));
+        }
+
+        for ( size_t i = 0; i < nl.num_inputs(); ++i )
+        {
+            for ( size_t j = 0; j < nl.num_outputs(); ++j )
+            {
+                cube<double>& w = *data_.dEdW(l,i,j);
+                for ( size_t k = 0; k < w.n_elem; ++k )
+                {
+                    f(p++, w.memptr()[k]);
+                }
+            }
+        }
+    }
+
+    void reduce_layer(size_t l)
+    {
+        trace::attribute_to ta(l, trace::none);
+
+        for_each_weight(l, [](double* p, double& g) { *p = g; });
+
+        ring_.allreduce(buffers_[l].data(), buffers_[l].size());
+
+        double scale = 1.0 / ring_.size();
+        for_each_weight(l, [scale](double* p, double& g) { g = *p * scale; });
+
+        reduced_[l].set_value();
+    }
+
+    void comm_loop()
+    {
+        while (true)
+        {
+            size_t l;
+
+            {
+                std::unique_lock<std::mutex> g(mutex_);
+                while ( queue_.empty() && !done_ )
+                {
+                    cv_.wait(g);
+                }
+
+                if ( queue_.empty() )
+                {
+                    return;
+                }
+
+                l = queue_.front();
+                queue_.pop_front();
+
+                if ( error_ )
+                {
+                    reduced_[l].set_exception(error_);
+                    continue;
+                }
+            }
+
+            // A failed all-reduce leaves the ring out of step with the
+            // other processes: this layer, the queued ones and all the
+            // later ones are failed with its error, which grad_update()
+            // rethrows
+
+            try
+            {
+                reduce_layer(l);
+            }
+            catch (...)
+            {
+                std::unique_lock<std::mutex> g(mutex_);
+
+                error_ = std::current_exception();
+                reduced_[l].set_exception(error_);
+
+                for ( size_t q: queue_ )
+                {
+                    reduced_[q].set_exception(error_);
+                }
+                queue_.clear();
+            }
+        }
+    }
+
+    void enqueue(size_t l)
+    {
+        std::unique_lock<std::mutex> g(mutex_);
+        queue_.push_back(l);
+        cv_.notify_one();
+    }
+
+    // Makes the weights the same as the ones of rank 0
+
+    void broadcast_weights()
+    {
+        for ( size_t l = 0; l < data_.num_layers(); ++l )
+        {
+            network_layer& nl = data_.layer(l);
+
+            for ( size_t j = 0; j < nl.num_outputs(); ++j )
+            {
+                ring_.broadcast(&nl.bias(j), 1);
+            }
+
+            for ( size_t i = 0; i < nl.num_inputs(); ++i )
+            {
+                for ( size_t j = 0; j < nl.num_outputs(); ++j )
+                {
+                    ring_.broadcast(nl.filter(i,j).memptr(),
+                                    nl.filter(i,j).n_elem);
+                }
+            }
+        }
+
+        net_.init();
+    }
+
+public:
+    data_parallel_network( parallel_network& net, ring& r )
+        : net_(net)
+        , data_(net.data())
+        , ring_(r)
+        , buffers_(net.data().num_layers())
+        , reduced_(net.data().num_layers())
+    {
+        // The gradients have to be averaged before the update
+
+        net_.set_fused_update(false);
+
+        for ( size_t l = 0; l < buffers_.size(); ++l )
+        {
+            buffers_[l].resize(layer_size(l));
+        }
+
+        broadcast_weights();
+
+        thread_ = std::thread(&data_parallel_network::comm_loop, this);
+    }
+
+    ~data_parallel_network()
+    {
+        {
+            std::unique_lock<std::mutex> g(mutex_);
+            done_ = true;
+            cv_.notify_one();
+        }
+        thread_.join();
+    }
+
+    data_parallel_network(const data_parallel_network&) = delete;
+    data_parallel_network& operator=(const data_parallel_network&) = delete;
+
+    cubes_type forward(const cubes_type& input)
+    {
+        return net_.forward(input);
+    }
+
+    // The averaging of the gradients might still be in progress when
+    // this returns, grad_update() waits for it
+
+    void backward(const cubes_type& grads)
+    {
+        for ( auto& r: reduced_ )
+        {
+            r = zi::async::promise<void>();
+        }
+
+        zi::async::future<void> done = net_.backward_async(grads);
+
+        // The layers whose gradients failed are not reduced, their
+        // errors go to grad_update() instead
+
+        for ( size_t l = data_.num_layers(); l > 0; --l )
+        {
+            net_.gradients_ready(l-1).when_complete(
+                [this,l](zi::async::future<void> f) {
+                    try
+                    {
+                        f.get();
+                        enqueue(l-1);
+                    }
+                    catch (...)
+                    {
+                        reduced_[l-1].set_exception(std::current_exception());
+                    }
+                });
+        }
+
+        done.get();
+    }
+
+    // Rethrows the error of the backward pass or of the averaging, once
+    // the communication thread is done with all the layers
+
+    void grad_update()
+    {
+        for ( auto& r: reduced_ )
+        {
+            r.get_future().wait();
+        }
+
+        for ( auto& r: reduced_ )
+        {
+            r.get_future().get();
+        }
+
+        net_.grad_update();
+    }
+
+    size_t rank() const
+    {
+        return ring_.rank();
+    }
+
+    size_t size() const
+    {
+        return ring_.size();
+    }
+
+}; // class data_parallel_network
+
+}}} // namespace zi::znn::distributed
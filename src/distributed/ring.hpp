@@ -0,0 +1,384 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <cstddef>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "../core/trace.hpp"
+
+namespace zi {
+namespace znn {
+namespace distributed {
+
+// A ring of processes, each one connected to the next (that it sends
+// to) and to the previous one (that it receives from). The address is
+// either "unix:<path>", in which case the process of rank r listens on
+// the socket <path>.r, or "tcp:<host>:<port>", the process of rank r
+// listening on <port>+r.
+
+class ring
+{
+private:
+    std::size_t       rank_;
+    std::size_t       size_;
+    int               next_ = -1;
+    int               prev_ = -1;
+    std::vector<char> buffer_;
+
+private:
+    static void check( bool ok, const std::string& what )
+    {
+        if ( !ok )
+        {
+            throw std::runtime_error("ring: " + what + ": " +
+                                     std::strerror(errno));
+        }
+    }
+
+    struct address
+    {
+        bool        unix_socket;
+        std::string path_or_host;
+        int         port;
+    };
+
+    static address parse( const std::string& a, std::size_t rank )
+    {
+        address r;
+
+        if ( a.compare(0, 5, "unix:") == 0 )
+        {
+            r.unix_socket  = true;
+            r.path_or_host = a.substr(5) + "." + std::to_string(rank);
+            r.port         = 0;
+        }
+        else if ( a.compare(0, 4, "tcp:") == 0 )
+        {
+            std::size_t c = a.rfind(':');
+            if ( c <= 4 )
+            {
+                throw std::invalid_argument("ring: no port in " + a);
+            }
+            r.unix_socket  = false;
+            r.path_or_host = a.substr(4, c - 4);
+            r.port         = std::stoi(a.substr(c + 1)) + static_cast<int>(rank);
+        }
+        else
+        {
+            throw std::invalid_argument("ring: unknown address " + a);
+        }
+
+        return r;
+    }
+
+    // Calls f with the sockaddr of the given address
+
+    template<typename F>
+    static int with_sockaddr( const address& a, F f )
+    {
+        if ( a.unix_socket )
+        {
+            sockaddr_un sa;
+            std::memset(&sa, 0, sizeof(sa));
+            sa.sun_family = AF_UNIX;
+
+            if ( a.path_or_host.size() >= sizeof(sa.sun_path) )
+            {
+                throw std::invalid_argument("ring: path too long");
+            }
+
+            std::strcpy(sa.sun_path, a.path_or_host.c_str());
+            return f(AF_UNIX, reinterpret_cast<sockaddr*>(&sa), sizeof(sa));
+        }
+
+        addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        addrinfo* res = nullptr;
+        if ( getaddrinfo(a.path_or_host.c_str(),
+                         std::to_string(a.port).c_str(), &hints, &res) )
+        {
+            throw std::runtime_error("ring: can't resolve " + a.path_or_host);
+        }
+
+        int r = f(AF_INET, res->ai_addr, res->ai_addrlen);
+        freeaddrinfo(res);
+        return r;
+    }
+
+    static int listen_on( const address& a )
+    {
+        if ( a.unix_socket )
+        {
+            ::unlink(a.path_or_host.c_str());
+        }
+
+        return with_sockaddr(a, [](int family, sockaddr* sa, socklen_t len) {
+                int fd = ::socket(family, SOCK_STREAM, 0);
+                check(fd >= 0, "socket");
+
+                int one = 1;
+                ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+                check(::bind(fd, sa, len) == 0, "bind");
+                check(::listen(fd, 1) == 0, "listen");
+                return fd;
+            });
+    }
+
+    // The next process might not be listening yet, so we retry for a
+    // while
+
+    static int connect_to( const address& a )
+    {
+        return with_sockaddr(a, [&a](int family, sockaddr* sa, socklen_t len) {
+                for ( int attempt = 0; ; ++attempt )
+                {
+                    int fd = ::socket(family, SOCK_STREAM, 0);
+                    check(fd >= 0, "socket");
+
+                    if ( ::connect(fd, sa, len) == 0 )
+                    {
+                        if ( !a.unix_socket )
+                        {
+                            int one = 1;
+                            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+                                         &one, sizeof(one));
+                        }
+                        return fd;
+                    }
+
+                    ::close(fd);
+                    check(attempt < 600, "connect");
+
+                    std::this_thread::sleep_for(
+                        std::chrono::milliseconds(50));
+                }
+            });
+    }
+
+    static void set_nonblocking( int fd )
+    {
+        int flags = ::fcntl(fd, F_GETFL, 0);
+        check(flags >= 0 && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0,
+              "fcntl");
+    }
+
+public:
+    ring( const std::string& addr, std::size_t rank, std::size_t size )
+        : rank_(rank)
+        , size_(size)
+    {
+        ZI_ASSERT(rank<size);
+
+        if ( size_ == 1 )
+        {
+            return;
+        }
+
+        address self = parse(addr, rank_);
+        address next = parse(addr, (rank_ + 1) % size_);
+
+        int listener = listen_on(self);
+
+        next_ = connect_to(next);
+        prev_ = ::accept(listener, nullptr, nullptr);
+        check(prev_ >= 0, "accept");
+
+        ::close(listener);
+
+        if ( self.unix_socket )
+        {
+            ::unlink(self.path_or_host.c_str());
+        }
+
+        set_nonblocking(next_);
+        set_nonblocking(prev_);
+    }
+
+    ~ring()
+    {
+        if ( next_ >= 0 ) ::close(next_);
+        if ( prev_ >= 0 ) ::close(prev_);
+    }
+
+    ring(const ring&) = delete;
+    ring& operator=(const ring&) = delete;
+
+    std::size_t rank() const
+    {
+        return rank_;
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+    // Sends sn bytes to the next process while receiving rn bytes from
+    // the previous one. Both directions progress at the same time, so
+    // the ring can't deadlock on large messages.
+
+    void exchange( const char* s, std::size_t sn, char* r, std::size_t rn )
+    {
+        while ( sn || rn )
+        {
+            pollfd fds[2];
+            nfds_t n = 0;
+
+            if ( sn )
+            {
+                fds[n].fd = next_;
+                fds[n].events = POLLOUT;
+                ++n;
+            }
+
+            if ( rn )
+            {
+                fds[n].fd = prev_;
+                fds[n].events = POLLIN;
+                ++n;
+            }
+
+            if ( ::poll(fds, n, -1) < 0 )
+            {
+                check(errno == EINTR, "poll");
+                continue;
+            }
+
+            for ( nfds_t i = 0; i < n; ++i )
+            {
+                if ( fds[i].fd == next_ && fds[i].revents )
+                {
+                    ssize_t k = ::send(next_, s, sn, MSG_NOSIGNAL);
+                    if ( k < 0 )
+                    {
+                        check(errno == EAGAIN || errno == EINTR, "send");
+                        continue;
+                    }
+                    s  += k;
+                    sn -= k;
+                }
+                else if ( fds[i].fd == prev_ && fds[i].revents )
+                {
+                    ssize_t k = ::recv(prev_, r, rn, 0);
+                    if ( k == 0 )
+                    {
+                        throw std::runtime_error("ring: connection closed");
+                    }
+                    if ( k < 0 )
+                    {
+                        check(errno == EAGAIN || errno == EINTR, "recv");
+                        continue;
+                    }
+                    r  += k;
+                    rn -= k;
+                }
+            }
+        }
+    }
+
+    // Replaces data with the sum over all the processes. Ring algorithm:
+    // the data is split into size() segments, each process first
+    // reduces one of them (reduce-scatter) and then sends it around
+    // (all-gather), so each process sends and receives 2(p-1)/p of the
+    // data in total, regardless of the number of processes.
+
+    void allreduce( double* data, std::size_t n )
+    {
+        if ( size_ == 1 || n == 0 )
+        {
+            return;
+        }
+
+        trace::scope ts(trace::allreduce);
+
+        auto offset = [&](std::size_t seg) {
+            return n * ( seg % size_ ) / size_;
+        };
+
+        auto length = [&](std::size_t seg) {
+            seg %= size_;
+            return n * ( seg + 1 ) / size_ - n * seg / size_;
+        };
+
+        buffer_.resize(( n / size_ + 1 ) * sizeof(double));
+        double* in = reinterpret_cast<double*>(buffer_.data());
+
+        for ( std::size_t s = 0; s < size_ - 1; ++s )
+        {
+            std::size_t sseg = rank_ + size_ - s;
+            std::size_t rseg = rank_ + size_ - s - 1;
+
+            exchange(reinterpret_cast<const char*>(data + offset(sseg)),
+                     length(sseg) * sizeof(double),
+                     buffer_.data(), length(rseg) * sizeof(double));
+
+            double* out = data + offset(rseg);
+            for ( std::size_t i = 0, l = length(rseg); i < l; ++i )
+            {
+                out[i] += in[i];
+            }
+        }
+
+        for ( std::size_t s = 0; s < size_ - 1; ++s )
+        {
+            std::size_t sseg = rank_ + size_ + 1 - s;
+            std::size_t rseg = rank_ + size_ - s;
+
+            exchange(reinterpret_cast<const char*>(data + offset(sseg)),
+                     length(sseg) * sizeof(double),
+                     reinterpret_cast<char*>(data + offset(rseg)),
+                     length(rseg) * sizeof(double));
+        }
+    }
+
+    // Replaces data with the one of the process of rank 0
+
+    void broadcast( double* data, std::size_t n )
+    {
+        if ( size_ == 1 || n == 0 )
+        {
+            return;
+        }
+
+        char* p = reinterpret_cast<char*>(data);
+
+        if ( rank_ > 0 )
+        {
+            exchange(nullptr, 0, p, n * sizeof(double));
+        }
+
+        if ( rank_ < size_ - 1 )
+        {
+            exchange(p, n * sizeof(double), nullptr, 0);
+        }
+    }
+
+    void barrier()
+    {
+        double x = 0;
+        allreduce(&x, 1);
+    }
+
+}; // class ring
+
+}}} // namespace zi::znn::distributed
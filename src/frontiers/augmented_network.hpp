@@ -0,0 +1,392 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <cstddef>
+#include <stdexcept>
+
+#include "../core/types.hpp"
+#include "../core/cube_utils.hpp"
+#include "../core/cube_pool.hpp"
+#include "../core/fft.hpp"
+#include "../network/layered_network.hpp"
+#include "../network/layered_network_data.hpp"
+#include "../network/parallel_network.hpp"
+#include "../network/shared_filter_spectra.hpp"
+#include "../transfer_fn/transfer_fn.hpp"
+#include "mapped_volume.hpp"
+#include "sliding_window.hpp"
+#include "utility.hpp"
+
+namespace zi {
+namespace znn {
+namespace frontiers {
+
+// Test time augmentation: the average of the outputs of the network
+// over the 8 flips of the input (16 with the rotation in the xy plane),
+// each transformed back.
+//
+// Convolving a transformed input with a filter gives the transformed
+// output of the input convolved with the transformed filter, and the
+// pooling (max over a window of 2) commutes with the flips as well.
+// The output of the network over the input transformed by d, transformed
+// back, is then the output of a copy of the network whose filters are
+// transformed by d (and its pooling sizes swapped, when rotated) over
+// the input itself. Instead of transforming the data, each tile is
+// given as is to the transformed copies of the network, which:
+//
+//   - gathers each tile once, instead of once per transform;
+//   - computes the transforms of the inputs once, shared by all the
+//     copies (read only by their first layers);
+//   - needs no transforming of the outputs back, and adds each copy's
+//     output to the average as soon as it's done, while the other
+//     copies are still working;
+//   - keeps the transforms of the filters of the network cached, for
+//     the tile size, once for all the flips: a flipped filter's
+//     transform is the original's, remapped, conjugated and shifted in
+//     phase, which is applied in the multiplication by it (see
+//     pairwise_mult_flipped). With the rotations, the rotated filters'
+//     transforms are cached as well: a rotation can't be applied to the
+//     half transforms (x being halved, but not y);
+//   - runs all the copies at once, so their tasks fill the thread pool
+//     together (the narrow first and last layers of a single pass
+//     can't).
+//
+// The rest of the work of the copies is distinct, so the augmentation
+// still costs up to the number of transforms times the forward pass,
+// less the shared parts above.
+
+// The 8 flips (16 with the rotations)
+
+inline std::vector<dihedral> dihedral_group( bool rotations = false )
+{
+    std::vector<dihedral> r;
+
+    for ( std::size_t i = 0; i < ( rotations ? 16u : 8u ); ++i )
+    {
+        dihedral d;
+        d.flip_x = i & 1;
+        d.flip_y = i & 2;
+        d.flip_z = i & 4;
+        d.rotate = i & 8;
+        r.push_back(d);
+    }
+
+    return r;
+}
+
+// The cube c transformed by d, as the regions gathered from a volume
+// are: rotated, the x and y sizes are swapped (c doesn't have to be
+// square)
+
+template<typename T>
+inline cube<T> transformed( const cube<T>& c, const dihedral& d )
+{
+    vec3s s = size(c);
+    vec3s t = d.rotate ? vec3s(s[1], s[0], s[2]) : s;
+
+    cube<T> r(t[0], t[1], t[2]);
+
+    detail::for_each_transformed(
+        t, d, r.memptr(),
+        [&](T* o, std::size_t a, std::size_t b, std::size_t z) {
+            *o = c(a,b,z);
+        });
+
+    return r;
+}
+
+// The copy of the network whose output over an input is the output of
+// net over the input transformed by d, transformed back
+
+inline layered_network transformed_network( layered_network& net,
+                                            const dihedral& d )
+{
+    layered_network r(net.num_inputs());
+
+    for ( std::size_t l = 0; l < net.num_layers(); ++l )
+    {
+        const network_layer& nl = net.layer(l);
+
+        vec3s fs = nl.filter_size();
+        vec3s ps = nl.pooling_size();
+
+        if ( d.rotate )
+        {
+            std::swap(fs[0], fs[1]);
+            std::swap(ps[0], ps[1]);
+        }
+
+        std::size_t n = fs[0] * fs[1] * fs[2];
+
+        std::vector<double> biases(nl.num_outputs());
+        std::vector<double> filters(nl.num_inputs() * nl.num_outputs() * n);
+
+        for ( std::size_t j = 0; j < nl.num_outputs(); ++j )
+        {
+            biases[j] = nl.bias(j);
+        }
+
+        for ( std::size_t i = 0; i < nl.num_inputs(); ++i )
+        {
+            for ( std::size_t j = 0; j < nl.num_outputs(); ++j )
+            {
+                cube<double> f = transformed(nl.filter(i,j), d);
+                std::copy(f.memptr(), f.memptr() + n,
+                          filters.begin() + ( i * nl.num_outputs() + j ) * n);
+            }
+        }
+
+        r.add_layer(network_layer(nl.num_inputs(), nl.num_outputs(), fs, ps,
+                                  nl.learning_rate(), optimizer(),
+                                  biases.data(), filters.data()));
+    }
+
+    return r;
+}
+
+// Works as a parallel_network (in the inference mode) for the
+// sliding_window: the forward pass leaves the average of out(data) of
+// the copies in data().output(0), out being e.g. cross_entropy_output
+// (the average of the probabilities), so the sliding window is to
+// store the first output.
+
+class augmented_network
+{
+public:
+    typedef std::function<cube<double>&(layered_network_data&)> output_fn;
+
+private:
+    struct copy
+    {
+        layered_network                       net ;
+        std::unique_ptr<layered_network_data> data;
+        std::unique_ptr<parallel_network>     pn  ;
+    };
+
+private:
+    std::vector<std::unique_ptr<copy>> copies_ ;
+    output_fn                          out_    ;
+    vec3s                              fov_    ;
+    bool                               keep_   = true;
+
+    // The transforms of the filters of the unflipped copies (the first
+    // one, and the first rotated one), shared by the flipped ones
+
+    std::vector<std::unique_ptr<shared_filter_spectra>> spectra_;
+
+    std::mutex                         m_      ;
+    unique_cube<double>                sum_    ;
+    std::size_t                        summed_ = 0;
+
+private:
+    // Adds the output of the copy c to the average, done with the last
+    // one
+
+    void accumulate( copy& c )
+    {
+        cube<double>& o = out_(*c.data);
+
+        std::lock_guard<std::mutex> g(m_);
+
+        if ( summed_ == 0 )
+        {
+            sum_ = pool<double>::get_unique_copy(o);
+        }
+        else
+        {
+            *sum_ += o;
+        }
+
+        if ( ++summed_ == copies_.size() )
+        {
+            *sum_ /= static_cast<double>(copies_.size());
+            copies_[0]->data->output(0) = std::move(sum_);
+        }
+    }
+
+public:
+    augmented_network( layered_network& net, transfer_fn tf,
+                       output_fn out = sliding_window<parallel_network>
+                       ::first_output,
+                       bool rotations = false )
+        : out_(out)
+        , fov_(net.fov())
+    {
+        if ( rotations && fov_[0] != fov_[1] )
+        {
+            throw std::invalid_argument("augmented_network: the rotations "
+                                        "need the same fov along x and y");
+        }
+
+        for ( auto& d: dihedral_group(rotations) )
+        {
+            copies_.emplace_back(new copy{ transformed_network(net, d),
+                        nullptr, nullptr });
+
+            copy& c = *copies_.back();
+            c.data.reset(new layered_network_data(c.net));
+            c.pn.reset(new parallel_network(*c.data, tf));
+            c.pn->set_inference(true);
+
+            if ( !d.flip_x && !d.flip_y && !d.flip_z )
+            {
+                spectra_.emplace_back(new shared_filter_spectra(*c.data));
+            }
+
+            // Rotated, the filter flipped along x is the rotated one
+            // flipped along y (and the other way around)
+
+            vec3s flips(d.flip_x, d.flip_y, d.flip_z);
+            if ( d.rotate )
+            {
+                std::swap(flips[0], flips[1]);
+            }
+
+            c.pn->set_filter_spectra(spectra_.back().get(), flips);
+        }
+    }
+
+    augmented_network(const augmented_network&) = delete;
+    augmented_network& operator=(const augmented_network&) = delete;
+
+    std::size_t num_transforms() const
+    {
+        return copies_.size();
+    }
+
+    vec3s fov() const
+    {
+        return fov_;
+    }
+
+    layered_network_data& data()
+    {
+        return *copies_[0]->data;
+    }
+
+    // The number of copies whose filters' transforms are kept, the
+    // others sharing them
+
+    std::size_t num_spectra() const
+    {
+        return spectra_.size();
+    }
+
+    // Memory of the forward pass of a single copy, with the transforms
+    // of its filters
+
+    std::size_t copy_bytes( const vec3s& s )
+    {
+        return frontiers::forward_bytes(*copies_[0]->pn, s);
+    }
+
+    bool keep_filter_transforms() const
+    {
+        return keep_;
+    }
+
+    void set_keep_filter_transforms( bool k )
+    {
+        keep_ = k;
+        for ( auto& c: copies_ )
+        {
+            c->pn->set_keep_filter_transforms(k);
+        }
+    }
+
+    // Takes over the inputs, as parallel_network does
+
+    zi::async::future<void>
+    forward_async( std::vector<unique_cube<double>>& input )
+    {
+        ZI_ASSERT(input.size()>0);
+
+        vec3s s = size(*input[0]);
+
+        std::vector<std::shared_ptr<const cube<complex>>> spectra;
+
+        for ( auto& in: input )
+        {
+            spectra.emplace_back(fftw::forward_copy(*in));
+            in.reset();
+        }
+
+        summed_ = 0;
+
+        std::vector<zi::async::future<void>> done;
+
+        for ( auto& c: copies_ )
+        {
+            copy* cp = c.get();
+            done.push_back(cp->pn->forward_async(spectra, s).then(
+                               [this, cp]() { accumulate(*cp); }));
+        }
+
+        return zi::async::when_all(done);
+    }
+
+    std::vector<cube<double>> forward( const std::vector<cube<double>>& input )
+    {
+        std::vector<unique_cube<double>> in;
+        for ( auto& c: input )
+        {
+            in.push_back(pool<double>::get_unique_copy(c));
+        }
+
+        forward_async(in).get();
+
+        return { *data().output(0) };
+    }
+
+}; // class augmented_network
+
+// All the copies are in flight at once, the kept transforms of the
+// filters held once per num_spectra() (the ones computed for a single
+// use are held by each copy)
+
+inline std::size_t forward_bytes( augmented_network& net, const vec3s& s )
+{
+    std::size_t f = net.keep_filter_transforms()
+        ? filter_spectra_bytes(net.data(), s) : 0;
+
+    return net.num_transforms() * ( net.copy_bytes(s) - f )
+        + net.num_spectra() * f;
+}
+
+// process_whole_cube with the test time augmentation, each of the
+// concurrent_tiles tiles in flight on its own augmented_network
+
+inline void process_whole_cube_augmented( const std::string& ifname,
+                                          const std::string& ofname,
+                                          layered_network& net,
+                                          transfer_fn tf,
+                                          const vec3s& tile,
+                                          size_t concurrent_tiles,
+                                          size_t max_bytes = 0,
+                                          bool cross_entropy = true,
+                                          bool rotations = false )
+{
+    std::vector<std::unique_ptr<augmented_network>> nets;
+    std::vector<augmented_network*>                 lanes;
+
+    augmented_network::output_fn out = cross_entropy
+        ? augmented_network::output_fn(cross_entropy_output)
+        : augmented_network::output_fn(sliding_window<parallel_network>
+                                       ::first_output);
+
+    for ( size_t i = 0; i < std::max<size_t>(concurrent_tiles, 1); ++i )
+    {
+        nets.emplace_back(new augmented_network(net, tf, out, rotations));
+        lanes.push_back(nets.back().get());
+    }
+
+    sliding_window<augmented_network> sw(lanes, tile, max_bytes);
+
+    process_whole_cube(sw, ifname, ofname, false);
+}
+
+}}} // namespace zi::znn::frontiers
@@ -0,0 +1,789 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <cerrno>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../core/types.hpp"
+#include "../core/diskio.hpp"
+#include "../core/lz.hpp"
+
+#include "mapped_volume.hpp"
+
+namespace zi {
+namespace znn {
+namespace frontiers {
+
+// Chunked volume file: the volume is split into chunks of a fixed size
+// (the ones at the upper boundary padded), each one stored compressed
+// on its own, so that any region can be read by reading and decoding
+// only the chunks it touches.
+//
+//    uint64   magic
+//    uint32   element type (chunked::type)
+//    uint32   reserved
+//    uint64   size[3], chunk size[3]
+//    double   scale, offset      value = stored * scale + offset
+//    { uint64 offset, uint32 length, uint32 codec }   per chunk, x fastest
+//    chunk data
+//
+// Within a chunk the elements are byte shuffled (all the first bytes of
+// the elements, then all the second ones, ...) before being compressed
+// with lz, which makes smooth data compress much better.
+
+namespace chunked {
+
+enum type : uint32_t
+{
+    uint8   = 0,
+    uint16  = 1,
+    float16 = 2,
+    float32 = 3,
+    float64 = 4
+};
+
+enum codec : uint32_t
+{
+    raw = 0,
+    lz  = 1
+};
+
+static const uint64_t magic = 0x314b4e4843564e5aULL; // ZNVCHNK1
+
+inline std::size_t type_size( uint32_t t )
+{
+    static const std::size_t sizes[] = { 1, 2, 2, 4, 8 };
+    if ( t > float64 )
+    {
+        throw std::runtime_error("chunked: unknown element type");
+    }
+    return sizes[t];
+}
+
+// IEEE 754 half precision, rounding to the nearest even
+
+inline uint16_t float_to_half( float f )
+{
+    uint32_t x;
+    std::memcpy(&x, &f, 4);
+
+    uint32_t sign = ( x >> 16 ) & 0x8000;
+    int32_t  exp  = static_cast<int32_t>(( x >> 23 ) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+
+    if ( ( ( x >> 23 ) & 0xff ) == 0xff ) // inf or nan
+    {
+        return static_cast<uint16_t>(sign | 0x7c00 | ( mant ? 0x200 : 0 ));
+    }
+
+    if ( exp >= 31 ) // overflow
+    {
+        return static_cast<uint16_t>(sign | 0x7c00);
+    }
+
+    if ( exp <= 0 ) // subnormal or zero
+    {
+        if ( exp < -10 )
+        {
+            return static_cast<uint16_t>(sign);
+        }
+
+        mant |= 0x800000;
+        uint32_t shift = 14 - exp;
+        uint32_t h     = mant >> shift;
+        uint32_t rem   = mant & ( ( 1u << shift ) - 1 );
+        uint32_t half  = 1u << ( shift - 1 );
+
+        if ( rem > half || ( rem == half && ( h & 1 ) ) )
+        {
+            ++h;
+        }
+
+        return static_cast<uint16_t>(sign | h);
+    }
+
+    uint32_t h   = ( static_cast<uint32_t>(exp) << 10 ) | ( mant >> 13 );
+    uint32_t rem = mant & 0x1fff;
+
+    if ( rem > 0x1000 || ( rem == 0x1000 && ( h & 1 ) ) )
+    {
+        ++h; // might carry into the exponent, up to inf, which is right
+    }
+
+    return static_cast<uint16_t>(sign | h);
+}
+
+inline float half_to_float( uint16_t h )
+{
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exp  = ( h >> 10 ) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+
+    if ( exp == 0 )
+    {
+        if ( mant == 0 )
+        {
+            x = sign;
+        }
+        else
+        {
+            exp = 127 - 15 + 1;
+            while ( !( mant & 0x400 ) )
+            {
+                mant <<= 1;
+                --exp;
+            }
+            x = sign | ( exp << 23 ) | ( ( mant & 0x3ff ) << 13 );
+        }
+    }
+    else if ( exp == 31 )
+    {
+        x = sign | 0x7f800000 | ( mant << 13 );
+    }
+    else
+    {
+        x = sign | ( ( exp - 15 + 127 ) << 23 ) | ( mant << 13 );
+    }
+
+    float f;
+    std::memcpy(&f, &x, 4);
+    return f;
+}
+
+// The stored value of v, and the value of the stored element at p
+
+inline void encode( uint32_t t, double v, char* p )
+{
+    switch ( t )
+    {
+    case uint8:
+    {
+        double r = std::round(std::min(std::max(v, 0.0), 255.0));
+        *reinterpret_cast<uint8_t*>(p) = static_cast<uint8_t>(r);
+        break;
+    }
+    case uint16:
+    {
+        double r = std::round(std::min(std::max(v, 0.0), 65535.0));
+        uint16_t u = static_cast<uint16_t>(r);
+        std::memcpy(p, &u, 2);
+        break;
+    }
+    case float16:
+    {
+        uint16_t u = float_to_half(static_cast<float>(v));
+        std::memcpy(p, &u, 2);
+        break;
+    }
+    case float32:
+    {
+        float f = static_cast<float>(v);
+        std::memcpy(p, &f, 4);
+        break;
+    }
+    default:
+        std::memcpy(p, &v, 8);
+    }
+}
+
+template<uint32_t T> struct decoder;
+
+template<> struct decoder<uint8>
+{
+    static double get( const char* p )
+    {
+        return *reinterpret_cast<const uint8_t*>(p);
+    }
+};
+
+template<> struct decoder<uint16>
+{
+    static double get( const char* p )
+    {
+        uint16_t u;
+        std::memcpy(&u, p, 2);
+        return u;
+    }
+};
+
+template<> struct decoder<float16>
+{
+    static double get( const char* p )
+    {
+        uint16_t u;
+        std::memcpy(&u, p, 2);
+        return half_to_float(u);
+    }
+};
+
+template<> struct decoder<float32>
+{
+    static double get( const char* p )
+    {
+        float f;
+        std::memcpy(&f, p, 4);
+        return f;
+    }
+};
+
+template<> struct decoder<float64>
+{
+    static double get( const char* p )
+    {
+        double d;
+        std::memcpy(&d, p, 8);
+        return d;
+    }
+};
+
+inline void shuffle( const char* in, char* out, std::size_t n, std::size_t e )
+{
+    for ( std::size_t i = 0; i < n; ++i )
+        for ( std::size_t b = 0; b < e; ++b )
+            out[b * n + i] = in[i * e + b];
+}
+
+inline void unshuffle( const char* in, char* out, std::size_t n, std::size_t e )
+{
+    for ( std::size_t b = 0; b < e; ++b )
+        for ( std::size_t i = 0; i < n; ++i )
+            out[i * e + b] = in[b * n + i];
+}
+
+struct chunk_entry
+{
+    uint64_t offset;
+    uint32_t length;
+    uint32_t codec ;
+};
+
+inline std::size_t num_threads( std::size_t work )
+{
+    std::size_t n = std::max<std::size_t>(1, std::thread::hardware_concurrency());
+    return std::max<std::size_t>(1, std::min(n, work));
+}
+
+} // namespace chunked
+
+
+// Saves c as a chunked volume with elements of the given type. Integer
+// types store the values as they are when they all fit, otherwise the
+// range of c is mapped linearly onto the range of the type. The chunks
+// are encoded in parallel.
+
+template<typename T>
+inline void save_chunked( const std::string& fname, const cube<T>& c,
+                          uint32_t type = chunked::float32,
+                          const vec3s& chunk = vec3s(64,64,16) )
+{
+    std::size_t esize = chunked::type_size(type);
+
+    double scale  = 1;
+    double offset = 0;
+
+    if ( type == chunked::uint8 || type == chunked::uint16 )
+    {
+        double lo  = static_cast<double>(c.min());
+        double hi  = static_cast<double>(c.max());
+        double top = type == chunked::uint8 ? 255 : 65535;
+
+        bool integral = lo >= 0 && hi <= top;
+        for ( std::size_t i = 0; integral && i < c.n_elem; ++i )
+        {
+            double v = c.memptr()[i];
+            integral = v == std::floor(v);
+        }
+
+        if ( !integral )
+        {
+            offset = lo;
+            scale  = hi > lo ? ( hi - lo ) / top : 1;
+        }
+    }
+
+    vec3s size(c.n_rows, c.n_cols, c.n_slices);
+    vec3s n((size[0] + chunk[0] - 1) / chunk[0],
+            (size[1] + chunk[1] - 1) / chunk[1],
+            (size[2] + chunk[2] - 1) / chunk[2]);
+
+    std::size_t nchunks = n[0] * n[1] * n[2];
+    std::size_t nelem   = chunk[0] * chunk[1] * chunk[2];
+
+    std::vector<std::vector<char>> data(nchunks);
+    std::vector<chunked::chunk_entry> index(nchunks);
+
+    auto encode_chunk = [&](std::size_t i) {
+        vec3s o(i % n[0] * chunk[0], i / n[0] % n[1] * chunk[1],
+                i / n[0] / n[1] * chunk[2]);
+
+        // The padding replicates the boundary, which compresses well
+
+        std::vector<char> elems(nelem * esize);
+        char* p = elems.data();
+
+        for ( std::size_t z = 0; z < chunk[2]; ++z )
+            for ( std::size_t y = 0; y < chunk[1]; ++y )
+                for ( std::size_t x = 0; x < chunk[0]; ++x, p += esize )
+                {
+                    double v = c(std::min(o[0] + x, size[0] - 1),
+                                 std::min(o[1] + y, size[1] - 1),
+                                 std::min(o[2] + z, size[2] - 1));
+                    chunked::encode(type, ( v - offset ) / scale, p);
+                }
+
+        std::vector<char> shuffled(elems.size());
+        chunked::shuffle(elems.data(), shuffled.data(), nelem, esize);
+
+        lz::compress(shuffled.data(), shuffled.size(), data[i]);
+        index[i].codec = chunked::lz;
+
+        if ( data[i].size() >= shuffled.size() )
+        {
+            data[i] = std::move(shuffled);
+            index[i].codec = chunked::raw;
+        }
+
+        index[i].length = static_cast<uint32_t>(data[i].size());
+    };
+
+    std::size_t nt = chunked::num_threads(nchunks);
+    std::vector<std::thread> threads;
+
+    for ( std::size_t t = 0; t < nt; ++t )
+    {
+        threads.emplace_back([&,t]() {
+                for ( std::size_t i = t; i < nchunks; i += nt )
+                {
+                    encode_chunk(i);
+                }
+            });
+    }
+
+    for ( auto& t: threads )
+    {
+        t.join();
+    }
+
+    uint64_t pos = 8 + 4 + 4 + 6 * 8 + 2 * 8 + nchunks * 16;
+    for ( std::size_t i = 0; i < nchunks; ++i )
+    {
+        index[i].offset = pos;
+        pos += index[i].length;
+    }
+
+    std::ofstream out(fname.c_str(), std::ios::binary);
+
+    io::write(out, chunked::magic);
+    io::write(out, type);
+    io::write(out, static_cast<uint32_t>(0));
+    io::write(out, size);
+    io::write(out, chunk);
+    io::write(out, scale);
+    io::write(out, offset);
+
+    for ( auto& e: index )
+    {
+        io::write(out, e.offset);
+        io::write(out, e.length);
+        io::write(out, e.codec);
+    }
+
+    for ( auto& d: data )
+    {
+        io::write_n(out, d.data(), d.size());
+    }
+
+    if ( !out )
+    {
+        throw std::runtime_error("save_chunked: can't write " + fname);
+    }
+}
+
+// True if the file is a chunked volume
+
+inline bool is_chunked( const std::string& fname )
+{
+    std::ifstream in(fname.c_str(), std::ios::binary);
+    uint64_t m = 0;
+    in.read(reinterpret_cast<char*>(&m), sizeof(m));
+    return in && m == chunked::magic;
+}
+
+// A chunked volume file, read on demand. Only the chunks touched by a
+// region are read (with pread, so any number of threads can gather at
+// the same time), the missing ones in parallel. The decoded chunks are
+// kept in an LRU cache of bounded size, in their stored (compact) type.
+
+template<typename T>
+class chunked_volume: public volume<T>
+{
+private:
+    typedef std::shared_ptr<const std::vector<char>> chunk_ptr;
+
+private:
+    int         fd_ = -1;
+    std::string fname_;
+
+    uint32_t    type_  ;
+    std::size_t esize_ ;
+    vec3s       size_  ;
+    vec3s       chunk_ ;
+    vec3s       n_     ;
+    double      scale_ ;
+    double      offset_;
+
+    std::vector<chunked::chunk_entry> index_;
+
+    vec3s       off_   ;
+    vec3s       vsize_ ;
+
+    // LRU cache of the decoded chunks, most recently used first
+
+    typedef std::list<std::pair<std::size_t, chunk_ptr>> lru_type;
+
+    mutable std::mutex  mutex_   ;
+    mutable lru_type    lru_     ;
+    mutable std::size_t cached_  = 0;
+    std::size_t         capacity_;
+    mutable std::unordered_map<std::size_t, typename lru_type::iterator> map_;
+
+private:
+    static void check( bool ok, const std::string& what )
+    {
+        if ( !ok )
+        {
+            throw std::runtime_error("chunked_volume: " + what + ": " +
+                                     std::strerror(errno));
+        }
+    }
+
+    void pread_all( char* p, std::size_t n, uint64_t off ) const
+    {
+        while ( n )
+        {
+            ssize_t k = ::pread(fd_, p, n, off);
+            if ( k < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            check(k > 0, "read " + fname_);
+            p   += k;
+            n   -= k;
+            off += k;
+        }
+    }
+
+    chunk_ptr load_chunk( std::size_t i ) const
+    {
+        const chunked::chunk_entry& e = index_[i];
+        std::size_t bytes = chunk_[0] * chunk_[1] * chunk_[2] * esize_;
+
+        std::vector<char> stored(e.length);
+        pread_all(stored.data(), e.length, e.offset);
+
+        std::vector<char> shuffled;
+        if ( e.codec == chunked::lz )
+        {
+            shuffled.resize(bytes);
+            lz::decompress(stored.data(), stored.size(),
+                           shuffled.data(), bytes);
+        }
+        else if ( e.length == bytes )
+        {
+            shuffled = std::move(stored);
+        }
+        else
+        {
+            throw std::runtime_error("chunked_volume: corrupt " + fname_);
+        }
+
+        std::shared_ptr<std::vector<char>> r(new std::vector<char>(bytes));
+        chunked::unshuffle(shuffled.data(), r->data(), bytes / esize_, esize_);
+
+        return r;
+    }
+
+    chunk_ptr find( std::size_t i ) const
+    {
+        std::lock_guard<std::mutex> g(mutex_);
+
+        auto it = map_.find(i);
+        if ( it == map_.end() )
+        {
+            return chunk_ptr();
+        }
+
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->second;
+    }
+
+    void insert( std::size_t i, const chunk_ptr& c ) const
+    {
+        std::lock_guard<std::mutex> g(mutex_);
+
+        if ( map_.count(i) )
+        {
+            return;
+        }
+
+        lru_.emplace_front(i, c);
+        map_[i]  = lru_.begin();
+        cached_ += c->size();
+
+        while ( cached_ > capacity_ && lru_.size() > 1 )
+        {
+            cached_ -= lru_.back().second->size();
+            map_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+    }
+
+    // The chunks with the given indices, reading the missing ones in
+    // parallel
+
+    std::vector<chunk_ptr> chunks( const std::vector<std::size_t>& ids ) const
+    {
+        std::vector<chunk_ptr>   r(ids.size());
+        std::vector<std::size_t> missing;
+
+        for ( std::size_t k = 0; k < ids.size(); ++k )
+        {
+            r[k] = find(ids[k]);
+            if ( !r[k] )
+            {
+                missing.push_back(k);
+            }
+        }
+
+        auto load = [&](std::size_t t, std::size_t nt) {
+            for ( std::size_t m = t; m < missing.size(); m += nt )
+            {
+                std::size_t k = missing[m];
+                r[k] = load_chunk(ids[k]);
+                insert(ids[k], r[k]);
+            }
+        };
+
+        std::size_t nt = chunked::num_threads(missing.size());
+
+        if ( nt == 1 )
+        {
+            load(0, 1);
+        }
+        else
+        {
+            std::vector<std::thread> threads;
+            for ( std::size_t t = 0; t < nt; ++t )
+            {
+                threads.emplace_back(load, t, nt);
+            }
+            for ( auto& t: threads )
+            {
+                t.join();
+            }
+        }
+
+        return r;
+    }
+
+    template<uint32_t Type>
+    void gather_as( const vec3s& from, const vec3s& s,
+                    const dihedral& d, T* out ) const
+    {
+        // Per dimension: the chunk (relative to the first one touched)
+        // and the offset within the chunk of each coordinate of the
+        // region
+
+        std::vector<std::size_t> ci[3], co[3];
+        vec3s first, last;
+        std::size_t stride = 1;
+
+        for ( std::size_t k = 0; k < 3; ++k )
+        {
+            std::vector<std::size_t> p(s[k]);
+            for ( std::size_t i = 0; i < s[k]; ++i )
+            {
+                p[i] = detail::mirror_coordinate(size_[k], off_[k], from[k] + i);
+            }
+
+            first[k] = *std::min_element(p.begin(), p.end()) / chunk_[k];
+            last[k]  = *std::max_element(p.begin(), p.end()) / chunk_[k];
+
+            ci[k].resize(s[k]);
+            co[k].resize(s[k]);
+
+            for ( std::size_t i = 0; i < s[k]; ++i )
+            {
+                ci[k][i] = p[i] / chunk_[k] - first[k];
+                co[k][i] = p[i] % chunk_[k] * stride;
+            }
+
+            stride *= chunk_[k];
+        }
+
+        vec3s nc = last - first + vec3s::one;
+
+        std::vector<std::size_t> ids;
+        for ( std::size_t z = 0; z < nc[2]; ++z )
+            for ( std::size_t y = 0; y < nc[1]; ++y )
+                for ( std::size_t x = 0; x < nc[0]; ++x )
+                {
+                    ids.push_back(( first[0] + x ) + n_[0] *
+                                  ( ( first[1] + y ) + n_[1] *
+                                    ( first[2] + z ) ));
+                }
+
+        std::vector<chunk_ptr> cs = chunks(ids);
+
+        std::vector<const char*> data(cs.size());
+        for ( std::size_t k = 0; k < cs.size(); ++k )
+        {
+            data[k] = cs[k]->data();
+        }
+
+        std::size_t esize  = esize_;
+        double      scale  = scale_;
+        double      offset = offset_;
+
+        detail::for_each_transformed(
+            s, d, out, [&](T* o, std::size_t a, std::size_t b, std::size_t c) {
+                const char* chunk =
+                    data[ci[0][a] + nc[0] * ( ci[1][b] + nc[1] * ci[2][c] )];
+                double v = chunked::decoder<Type>::get(
+                    chunk + ( co[0][a] + co[1][b] + co[2][c] ) * esize );
+                *o = static_cast<T>(v * scale + offset);
+            });
+    }
+
+public:
+    chunked_volume( const std::string& fname,
+                    const vec3s& fov = vec3s::one,
+                    std::size_t cache_bytes = 256 << 20 )
+        : fname_(fname)
+        , capacity_(cache_bytes)
+    {
+        std::ifstream in(fname.c_str(), std::ios::binary);
+
+        if ( !in || io::read<uint64_t>(in) != chunked::magic )
+        {
+            throw std::runtime_error("chunked_volume: " + fname +
+                                     " is not a chunked volume");
+        }
+
+        type_  = io::read<uint32_t>(in);
+        io::read<uint32_t>(in);
+        esize_ = chunked::type_size(type_);
+
+        io::read(in, size_);
+        io::read(in, chunk_);
+        io::read(in, scale_);
+        io::read(in, offset_);
+
+        n_ = vec3s((size_[0] + chunk_[0] - 1) / chunk_[0],
+                   (size_[1] + chunk_[1] - 1) / chunk_[1],
+                   (size_[2] + chunk_[2] - 1) / chunk_[2]);
+
+        index_.resize(n_[0] * n_[1] * n_[2]);
+        for ( auto& e: index_ )
+        {
+            io::read(in, e.offset);
+            io::read(in, e.length);
+            io::read(in, e.codec );
+        }
+
+        off_   = fov / vec3s(2,2,2);
+        vsize_ = size_ + fov - vec3s::one;
+
+        for ( std::size_t k = 0; k < 3; ++k )
+        {
+            if ( off_[k] > size_[k] )
+            {
+                throw std::invalid_argument("chunked_volume: fov too large "
+                                            "for " + fname);
+            }
+        }
+
+        fd_ = ::open(fname.c_str(), O_RDONLY);
+        check(fd_ >= 0, "open " + fname);
+    }
+
+    ~chunked_volume()
+    {
+        if ( fd_ >= 0 )
+        {
+            ::close(fd_);
+        }
+    }
+
+    chunked_volume(const chunked_volume&) = delete;
+    chunked_volume& operator=(const chunked_volume&) = delete;
+
+    using volume<T>::gather;
+
+    const vec3s& size() const override
+    {
+        return vsize_;
+    }
+
+    // Of the volume itself, without the mirroring
+
+    const vec3s& data_size() const
+    {
+        return size_;
+    }
+
+    void gather( const vec3s& from, const vec3s& s,
+                 const dihedral& d, T* out ) const override
+    {
+        ZI_ASSERT(!d.rotate||s[0]==s[1]);
+
+        switch ( type_ )
+        {
+        case chunked::uint8  : gather_as<chunked::uint8  >(from, s, d, out); break;
+        case chunked::uint16 : gather_as<chunked::uint16 >(from, s, d, out); break;
+        case chunked::float16: gather_as<chunked::float16>(from, s, d, out); break;
+        case chunked::float32: gather_as<chunked::float32>(from, s, d, out); break;
+        default              : gather_as<chunked::float64>(from, s, d, out);
+        }
+    }
+
+}; // class chunked_volume
+
+
+// Opens the volume file, either chunked or raw (elements of type D),
+// the size of the volume being s
+
+template<typename T, typename D = T>
+inline std::unique_ptr<volume<T>> open_volume( const std::string& fname,
+                                               const vec3s& s,
+                                               const vec3s& fov = vec3s::one )
+{
+    if ( is_chunked(fname) )
+    {
+        std::unique_ptr<chunked_volume<T>> v(new chunked_volume<T>(fname, fov));
+        if ( v->data_size() != s )
+        {
+            throw std::runtime_error("open_volume: size mismatch in " + fname);
+        }
+        return std::unique_ptr<volume<T>>(v.release());
+    }
+
+    return std::unique_ptr<volume<T>>(new mapped_volume<T,D>(fname, s, fov));
+}
+
+}}} // namespace zi::znn::frontiers
@@ -0,0 +1,295 @@
+// Round trips of lz.hpp and of the chunked volumes: the codec over
+// data of every kind it has to handle (incompressible, runs, lengths
+// spilling over the token, truncated input), then each element type
+// of save_chunked (with chunks of both codecs, the random half of the
+// integer volumes being stored raw), and the regions gathered from the
+// chunked volume, across the chunks and the mirrored boundary and under
+// all the transforms, against the same ones of a mapped_volume of the
+// decoded data.
+//
+// Prints the failures, exits with 1 if there are any.
+//
+// usage: chunked_volume_check [directory]
+
+#include "chunked_volume.hpp"
+#include "mapped_volume.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <sstream>
+
+namespace arma {
+thread_local arma_rng_cxx11 arma_rng_cxx11_instance;
+}
+
+using namespace zi::znn;
+using namespace zi::znn::frontiers;
+
+namespace {
+
+std::size_t failures = 0;
+
+void expect(bool ok, const std::string& what)
+{
+    if ( !ok )
+    {
+        std::cout << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+void check_lz(const std::string& what, const std::vector<char>& in)
+{
+    std::vector<char> z;
+    lz::compress(in.data(), in.size(), z);
+
+    std::vector<char> out(in.size() + 1, 0);
+
+    try
+    {
+        lz::decompress(z.data(), z.size(), out.data(), in.size());
+        expect(std::equal(in.begin(), in.end(), out.begin()),
+               "lz round trip of " + what);
+    }
+    catch ( std::exception& e )
+    {
+        expect(false, "lz round trip of " + what + ": " + e.what());
+    }
+
+    // Asking for more than was compressed, or giving half of the
+    // compressed data, has to throw (rather than read or write out of
+    // bounds)
+
+    bool thrown = false;
+    try
+    {
+        lz::decompress(z.data(), z.size(), out.data(), in.size() + 1);
+    }
+    catch ( std::runtime_error& )
+    {
+        thrown = true;
+    }
+    expect(thrown, "lz size mismatch of " + what);
+
+    if ( z.size() > 1 )
+    {
+        thrown = false;
+        try
+        {
+            lz::decompress(z.data(), z.size() / 2, out.data(), in.size());
+        }
+        catch ( std::runtime_error& )
+        {
+            thrown = true;
+        }
+        expect(thrown, "lz truncated " + what);
+    }
+}
+
+void check_lz()
+{
+    std::mt19937 rng(7);
+
+    auto random = [&](std::size_t n) {
+        std::vector<char> v(n);
+        for ( auto& c: v )
+        {
+            c = static_cast<char>(rng());
+        }
+        return v;
+    };
+
+    check_lz("nothing", std::vector<char>());
+
+    for ( std::size_t n: { 1, 3, 4, 5, 15, 16, 270, 271, 100000 } )
+    {
+        check_lz("random " + std::to_string(n), random(n));
+        check_lz("run " + std::to_string(n), std::vector<char>(n, 'a'));
+    }
+
+    // Matches overlapping their own output, long literals between long
+    // matches
+
+    std::vector<char> v;
+    for ( std::size_t k = 0; k < 20; ++k )
+    {
+        std::vector<char> r = random(k * 37);
+        v.insert(v.end(), r.begin(), r.end());
+        v.insert(v.end(), k * 113, static_cast<char>(k));
+        v.insert(v.end(), r.begin(), r.end());
+    }
+    check_lz("mixed", v);
+}
+
+// The raw file of c (x fastest)
+
+void save_raw(const std::string& fname, const cube<double>& c)
+{
+    std::ofstream out(fname.c_str(), std::ios::binary);
+    out.write(reinterpret_cast<const char*>(c.memptr()),
+              c.n_elem * sizeof(double));
+}
+
+// Number of chunks of each codec in the chunked volume file
+
+std::vector<std::size_t> codecs(const std::string& fname, std::size_t n)
+{
+    std::ifstream in(fname.c_str(), std::ios::binary);
+    in.seekg(8 + 4 + 4 + 6 * 8 + 2 * 8);
+
+    std::vector<std::size_t> r(2);
+    for ( std::size_t i = 0; i < n; ++i )
+    {
+        io::read<uint64_t>(in);
+        io::read<uint32_t>(in);
+        ++r.at(io::read<uint32_t>(in));
+    }
+    return r;
+}
+
+void check_type(const std::string& dir, uint32_t type,
+                const std::string& name, double tolerance)
+{
+    // Half smooth (or runs of labels), half random
+
+    vec3s s(37, 23, 11);
+    vec3s chunk(8, 8, 4);
+    vec3s fov(7, 9, 5);
+
+    std::mt19937 rng(13);
+    std::uniform_real_distribution<double> u(0, 1);
+
+    bool integral = type == chunked::uint8;
+
+    cube<double> c(s[0], s[1], s[2]);
+    for ( std::size_t z = 0; z < s[2]; ++z )
+        for ( std::size_t y = 0; y < s[1]; ++y )
+            for ( std::size_t x = 0; x < s[0]; ++x )
+            {
+                double v = x < s[0] / 2
+                    ? ( integral ? ( x / 5 + y / 7 + z ) % 4
+                        : std::sin(x * 0.1) * std::cos(y * 0.2) + z * 0.01 )
+                    : ( integral ? std::floor(u(rng) * 256) : u(rng) * 3 - 1 );
+                c(x,y,z) = v;
+            }
+
+    std::string cfname = dir + "/chunked_volume_check." + name;
+    std::string rfname = cfname + ".raw";
+
+    save_chunked(cfname, c, type, chunk);
+
+    std::vector<std::size_t> n = codecs(cfname, 5 * 3 * 3);
+    expect(n[chunked::lz] > 0, name + ": no lz chunks");
+
+    // The random bytes don't compress, but the exponents of the random
+    // floats do
+
+    if ( type == chunked::uint8 || type == chunked::uint16 )
+    {
+        expect(n[chunked::raw] > 0, name + ": no raw chunks");
+    }
+
+    chunked_volume<double> cv(cfname, fov);
+
+    expect(cv.data_size() == s, name + ": size");
+    expect(cv.size() == s + fov - vec3s::one, name + ": mirrored size");
+
+    // The stored values, within the precision of the type (for uint16
+    // the range mapped onto the 65536 values)
+
+    vec3s off = fov / vec3s(2,2,2);
+    cube<double> d = cv.gather(off, s);
+
+    double tol = tolerance;
+    if ( type == chunked::uint16 )
+    {
+        tol = ( c.max() - c.min() ) / 65535 / 2 * 1.0001;
+    }
+
+    double err = 0;
+    for ( std::size_t i = 0; i < c.n_elem; ++i )
+    {
+        double e = std::abs(d.memptr()[i] - c.memptr()[i]);
+        if ( type == chunked::float16 || type == chunked::float32 )
+        {
+            e /= std::max(std::abs(c.memptr()[i]), 1e-3);
+        }
+        err = std::max(err, e);
+    }
+    expect(err <= tol, name + ": error " + std::to_string(err));
+
+    // The regions (of the decoded data) against the mapped volume's
+
+    save_raw(rfname, d);
+    mapped_volume<double> mv(rfname, s, fov);
+
+    vec3s vs = cv.size();
+
+    std::vector<std::pair<vec3s,vec3s>> regions = {
+        { vec3s::zero, vs },                       // everything
+        { vec3s::zero, vec3s(9, 9, 3) },           // the lower corner
+        { vs - vec3s(10,10,4), vec3s(10,10,4) },   // the upper corner
+        { vec3s(5, 6, 1), vec3s(12, 12, 6) },      // across chunks
+        { vec3s(30, 2, 7), vec3s(13, 13, 7) },     // to the upper mirror
+        { vec3s(14, 14, 6), vec3s(1, 1, 1) }       // a single voxel
+    };
+
+    for ( auto& r: regions )
+    {
+        for ( std::size_t t = 0; t < 16; ++t )
+        {
+            dihedral dh;
+            dh.flip_x = t & 1;
+            dh.flip_y = t & 2;
+            dh.flip_z = t & 4;
+            dh.rotate = t & 8;
+
+            if ( dh.rotate && r.second[0] != r.second[1] )
+            {
+                continue;
+            }
+
+            cube<double> a = cv.gather(r.first, r.second, dh);
+            cube<double> b = mv.gather(r.first, r.second, dh);
+
+            std::ostringstream what;
+            what << name << ": region " << r.first << " " << r.second
+                 << " transform " << t;
+
+            expect(std::equal(a.memptr(), a.memptr() + a.n_elem, b.memptr()),
+                   what.str());
+        }
+    }
+
+    std::remove(cfname.c_str());
+    std::remove(rfname.c_str());
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    std::string dir = argc > 1 ? argv[1] : "/tmp";
+
+    check_lz();
+
+    check_type(dir, chunked::uint8  , "uint8"  , 0);
+    check_type(dir, chunked::uint16 , "uint16" , 0);
+    check_type(dir, chunked::float16, "float16", 1.0 / 1024);
+    check_type(dir, chunked::float32, "float32", 1e-7);
+    check_type(dir, chunked::float64, "float64", 0);
+
+    if ( failures )
+    {
+        std::cout << failures << " failures" << std::endl;
+        return 1;
+    }
+
+    std::cout << "all passed" << std::endl;
+}
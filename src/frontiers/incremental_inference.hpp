@@ -0,0 +1,335 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+
+#include "../core/types.hpp"
+#include "../core/diskio.hpp"
+#include "../network/layered_network.hpp"
+#include "../network/layered_network_data.hpp"
+#include "../network/parallel_network.hpp"
+#include "../transfer_fn/transfer_fn.hpp"
+#include "mapped_volume.hpp"
+#include "chunked_volume.hpp"
+#include "sliding_window.hpp"
+#include "utility.hpp"
+
+namespace zi {
+namespace znn {
+namespace frontiers {
+
+// Updating an existing output of process_whole_cube after parts of the
+// input changed (e.g. were corrected, or a masked area filled), instead
+// of recomputing the whole volume.
+//
+// The dirty boxes of the input are grown by the fov into the boxes of
+// the output that depend on them (the mirroring at the boundary
+// doesn't add any: the mirrored voxels are read only by the outputs
+// close enough to the boundary to read the original ones as well).
+// Boxes are merged when they overlap or when covering them together
+// takes no more tiles than covering them apart, and all of them are
+// computed together, their tiles shared by the networks. The tiles have
+// the shape of the ones of the whole volume, so the updated voxels are
+// the ones the whole volume would get (up to the rounding), and only
+// those are written over the output file.
+
+struct bounding_box
+{
+    vec3s from;
+    vec3s size;
+
+    bool empty() const
+    {
+        return size[0] == 0 || size[1] == 0 || size[2] == 0;
+    }
+
+    std::size_t volume() const
+    {
+        return size[0] * size[1] * size[2];
+    }
+
+    vec3s to() const
+    {
+        return from + size;
+    }
+};
+
+inline bool overlap( const bounding_box& a, const bounding_box& b )
+{
+    for ( std::size_t k = 0; k < 3; ++k )
+    {
+        if ( a.from[k] >= b.to()[k] || b.from[k] >= a.to()[k] )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bounding_box bounding_union( const bounding_box& a,
+                                    const bounding_box& b )
+{
+    bounding_box r;
+    for ( std::size_t k = 0; k < 3; ++k )
+    {
+        r.from[k] = std::min(a.from[k], b.from[k]);
+        r.size[k] = std::max(a.to()[k], b.to()[k]) - r.from[k];
+    }
+    return r;
+}
+
+// The boxes of the output of size s (the same as the input's) that
+// depend on the dirty boxes of the input, for a network of the given
+// fov
+
+inline std::vector<bounding_box>
+affected_outputs( const std::vector<bounding_box>& dirty,
+                  const vec3s& fov, const vec3s& s )
+{
+    vec3s before = fov - vec3s::one - fov / vec3s(2,2,2);
+    vec3s after  = fov / vec3s(2,2,2);
+
+    std::vector<bounding_box> r;
+
+    for ( auto& d: dirty )
+    {
+        if ( d.empty() )
+        {
+            continue;
+        }
+
+        bounding_box b;
+
+        for ( std::size_t k = 0; k < 3; ++k )
+        {
+            if ( d.from[k] >= s[k] )
+            {
+                b.size = vec3s::zero;
+                break;
+            }
+
+            std::size_t from = d.from[k] > before[k] ? d.from[k] - before[k] : 0;
+            std::size_t to   = std::min(s[k], d.to()[k] + after[k]);
+
+            b.from[k] = from;
+            b.size[k] = to - from;
+        }
+
+        if ( !b.empty() )
+        {
+            r.push_back(b);
+        }
+    }
+
+    return r;
+}
+
+// Number of tiles of size t covering b
+
+inline std::size_t tiles_covering( const bounding_box& b, const vec3s& t )
+{
+    return ( ( b.size[0] + t[0] - 1 ) / t[0] ) *
+        ( ( b.size[1] + t[1] - 1 ) / t[1] ) *
+        ( ( b.size[2] + t[2] - 1 ) / t[2] );
+}
+
+// Merges the boxes that overlap, or that are covered by as few tiles of
+// size t together as apart, until no more can be
+
+inline std::vector<bounding_box> merge_boxes( std::vector<bounding_box> boxes,
+                                              const vec3s& t )
+{
+    for ( bool merged = true; merged; )
+    {
+        merged = false;
+
+        for ( std::size_t i = 0; i < boxes.size() && !merged; ++i )
+        {
+            for ( std::size_t j = i + 1; j < boxes.size() && !merged; ++j )
+            {
+                bounding_box u = bounding_union(boxes[i], boxes[j]);
+
+                if ( overlap(boxes[i], boxes[j]) ||
+                     tiles_covering(u, t) <= tiles_covering(boxes[i], t)
+                     + tiles_covering(boxes[j], t) )
+                {
+                    boxes[i] = u;
+                    boxes.erase(boxes.begin() + j);
+                    merged = true;
+                }
+            }
+        }
+    }
+
+    return boxes;
+}
+
+namespace detail {
+
+// Writes c over the box b of the raw volume of size s in f
+
+inline void write_box( const io::file& f, const vec3s& s,
+                       const bounding_box& b, const cube<double>& c )
+{
+    std::size_t row = b.size[0] * sizeof(double);
+
+    for ( std::size_t z = 0; z < b.size[2]; ++z )
+    {
+        // Whole rows make a contiguous section
+
+        if ( b.size[0] == s[0] )
+        {
+            uint64_t off = ( ( b.from[2] + z ) * s[1] + b.from[1] ) * s[0];
+            f.write(reinterpret_cast<const char*>(c.slice(z).memptr()),
+                    row * b.size[1], off * sizeof(double));
+            continue;
+        }
+
+        for ( std::size_t y = 0; y < b.size[1]; ++y )
+        {
+            uint64_t off = ( ( b.from[2] + z ) * s[1] + b.from[1] + y ) * s[0]
+                + b.from[0];
+            f.write(reinterpret_cast<const char*>(&c(0, y, z)), row,
+                    off * sizeof(double));
+        }
+    }
+}
+
+} // namespace detail
+
+// Updates the output ofname of process_whole_cube over the input ifname
+// after the dirty boxes of the input changed. The boxes are computed a
+// slab (of the depth of a tile) at a time, with at most about a whole
+// slab of the volume worth of the output in memory. Returns the number
+// of output voxels recomputed.
+
+template<typename N>
+std::size_t update_whole_cube( sliding_window<N>& sw,
+                               const std::string& ifname,
+                               const std::string& ofname,
+                               const std::vector<bounding_box>& dirty,
+                               bool cross_entropy = true )
+{
+    vec3s os = volume_size(ifname);
+
+    if ( volume_size(ofname) != os )
+    {
+        throw std::runtime_error("update_whole_cube: size mismatch between "
+                                 + ifname + " and " + ofname);
+    }
+
+    io::file out(ofname + ".image", io::file::read_write);
+
+    if ( out.size() != os[0] * os[1] * os[2] * sizeof(double) )
+    {
+        throw std::runtime_error("update_whole_cube: " + ofname +
+                                 ".image is not a raw volume");
+    }
+
+    vec3s t = sw.tile_shape(os);
+
+    std::vector<bounding_box> boxes =
+        merge_boxes(affected_outputs(dirty, sw.fov(), os), t);
+
+    // Split into slabs
+
+    std::vector<bounding_box> slabs;
+
+    for ( auto& b: boxes )
+    {
+        for ( std::size_t z = 0; z < b.size[2]; z += t[2] )
+        {
+            bounding_box s = b;
+            s.from[2] += z;
+            s.size[2]  = std::min(t[2], b.size[2] - z);
+            slabs.push_back(s);
+        }
+    }
+
+    auto v = open_volume<double>(ifname + ".image", os, sw.fov());
+
+    std::size_t budget = std::max(os[0] * os[1] * t[2], t[0] * t[1] * t[2]);
+    std::size_t done   = 0;
+
+    for ( std::size_t i = 0; i < slabs.size(); )
+    {
+        // As many slabs as fit in the budget (at least one)
+
+        std::vector<cube<double>> outputs;
+        std::vector<typename sliding_window<N>::region> regions;
+
+        std::size_t voxels = 0, j = i;
+
+        for ( ; j < slabs.size() &&
+                  ( j == i || voxels + slabs[j].volume() <= budget ); ++j )
+        {
+            voxels += slabs[j].volume();
+        }
+
+        outputs.resize(j - i);
+
+        for ( std::size_t k = i; k < j; ++k )
+        {
+            regions.push_back(typename sliding_window<N>::region{
+                    v.get(), slabs[k].from, slabs[k].size,
+                    &outputs[k - i] });
+        }
+
+        if ( cross_entropy )
+        {
+            sw.process(regions, cross_entropy_output);
+        }
+        else
+        {
+            sw.process(regions, sw.first_output);
+        }
+
+        for ( std::size_t k = i; k < j; ++k )
+        {
+            detail::write_box(out, os, slabs[k], outputs[k - i]);
+        }
+
+        done += voxels;
+        i = j;
+    }
+
+    return done;
+}
+
+// With up to concurrent_tiles tiles in flight, as the process_whole_cube
+// that made the output (the same tile shape has to be used for the
+// result to be the same)
+
+inline std::size_t update_whole_cube( const std::string& ifname,
+                                      const std::string& ofname,
+                                      const std::vector<bounding_box>& dirty,
+                                      layered_network& net,
+                                      transfer_fn tf,
+                                      const vec3s& tile,
+                                      size_t concurrent_tiles,
+                                      size_t max_bytes = 0,
+                                      bool cross_entropy = true )
+{
+    std::vector<std::unique_ptr<layered_network_data>> data;
+    std::vector<std::unique_ptr<parallel_network>>     nets;
+    std::vector<parallel_network*>                     lanes;
+
+    for ( size_t i = 0; i < std::max<size_t>(concurrent_tiles, 1); ++i )
+    {
+        data.emplace_back(new layered_network_data(net));
+        nets.emplace_back(new parallel_network(*data.back(), tf));
+        nets.back()->set_inference(true);
+        lanes.push_back(nets.back().get());
+    }
+
+    sliding_window<parallel_network> sw(lanes, tile, max_bytes);
+
+    return update_whole_cube(sw, ifname, ofname, dirty, cross_entropy);
+}
+
+}}} // namespace zi::znn::frontiers
@@ -0,0 +1,446 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <cstddef>
+
+#include <zi/time.hpp>
+
+#include "../core/types.hpp"
+#include "../core/diskio.hpp"
+#include "../network/layered_network.hpp"
+#include "../network/layered_network_data.hpp"
+#include "../network/parallel_network.hpp"
+#include "../transfer_fn/transfer_fn.hpp"
+#include "mapped_volume.hpp"
+#include "chunked_volume.hpp"
+#include "sliding_window.hpp"
+#include "utility.hpp"
+
+namespace zi {
+namespace znn {
+namespace frontiers {
+
+// Inference over a list of volumes, streamed slab by slab (as
+// process_whole_cube does for a single volume), with the reading of the
+// next slabs and the saving of the previous ones overlapped with the
+// computing of the current one.
+//
+// Each stage has its own thread: the loader reads the part of the
+// (mirrored) input volume the tiles of the next slab of the output
+// need, the compute stage runs the sliding window over the slab, and
+// the saver appends it to the output file. The stages are connected by
+// queues of at most depth slabs, so at most depth + 2 input slabs
+// (queued, being read and being computed) and depth + 2 output slabs
+// are in memory at any time, whatever the size of the volumes, and a
+// slow stage holds back the ones before it. The slabs of a volume
+// follow the ones of the previous volume without a break.
+
+struct inference_job
+{
+    std::string input ; // <input>.size and <input>.image
+    std::string output;
+};
+
+// What a stage did: the volumes (the last slab of each) and bytes it
+// went through, the time it spent working and the time it waited for
+// the other stages (for its input, or for room for its output)
+
+struct stage_stats
+{
+    std::string name    ;
+    std::size_t volumes = 0;
+    std::size_t bytes   = 0;
+    double      busy    = 0;
+    double      waiting = 0;
+
+    double throughput() const // MB/s while busy
+    {
+        return busy > 0 ? bytes / 1048576.0 / busy : 0;
+    }
+};
+
+namespace detail {
+
+// Blocking queue of at most capacity elements. Once closed, push
+// drops the elements (returning false), and pop returns false when
+// it's empty.
+
+template<typename T>
+class bounded_queue
+{
+private:
+    std::size_t             capacity_;
+    std::deque<T>           queue_   ;
+    bool                    closed_  = false;
+    std::mutex              m_       ;
+    std::condition_variable cv_      ;
+
+public:
+    explicit bounded_queue( std::size_t capacity )
+        : capacity_(std::max<std::size_t>(capacity, 1))
+    {
+    }
+
+    bool push( T v )
+    {
+        std::unique_lock<std::mutex> g(m_);
+
+        while ( !closed_ && queue_.size() >= capacity_ )
+        {
+            cv_.wait(g);
+        }
+
+        if ( closed_ )
+        {
+            return false;
+        }
+
+        queue_.push_back(std::move(v));
+        cv_.notify_all();
+        return true;
+    }
+
+    bool pop( T& v )
+    {
+        std::unique_lock<std::mutex> g(m_);
+
+        while ( !closed_ && queue_.empty() )
+        {
+            cv_.wait(g);
+        }
+
+        if ( queue_.empty() )
+        {
+            return false;
+        }
+
+        v = std::move(queue_.front());
+        queue_.pop_front();
+        cv_.notify_all();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> g(m_);
+        closed_ = true;
+        cv_.notify_all();
+    }
+
+}; // class bounded_queue
+
+} // namespace detail
+
+template<typename N>
+class inference_pipeline
+{
+private:
+    // The slab of the output of size s at from, of the job
+
+    struct slab
+    {
+        std::size_t job ;
+        vec3s       from;
+        vec3s       s   ;
+        bool        last; // of the job
+    };
+
+    struct loaded
+    {
+        slab                                 sl   ;
+        std::unique_ptr<cube_volume<double>> input;
+    };
+
+    struct computed
+    {
+        slab         sl    ;
+        vec3s        size  ; // of the whole output
+        cube<double> output;
+    };
+
+private:
+    sliding_window<N>&       sw_           ;
+    bool                     cross_entropy_;
+    std::size_t              depth_        ;
+    std::size_t              slab_depth_   ;
+    std::vector<stage_stats> stats_        ;
+    double                   elapsed_      = 0;
+
+public:
+    // slab_depth sections per slab, by default the depth of a tile
+
+    inference_pipeline( sliding_window<N>& sw, bool cross_entropy = true,
+                        std::size_t depth = 1, std::size_t slab_depth = 0 )
+        : sw_(sw)
+        , cross_entropy_(cross_entropy)
+        , depth_(depth)
+        , slab_depth_(slab_depth)
+    {
+    }
+
+    // Processes all the jobs, the first error stopping all the stages
+    // and being rethrown
+
+    void run( const std::vector<inference_job>& jobs )
+    {
+        stats_.assign(3, stage_stats());
+        stats_[0].name = "load";
+        stats_[1].name = "compute";
+        stats_[2].name = "save";
+
+        detail::bounded_queue<loaded>   to_compute(depth_);
+        detail::bounded_queue<computed> to_save(depth_);
+
+        std::exception_ptr error;
+        std::mutex         error_mutex;
+
+        auto fail = [&]() {
+            {
+                std::lock_guard<std::mutex> g(error_mutex);
+                if ( !error )
+                {
+                    error = std::current_exception();
+                }
+            }
+            to_compute.close();
+            to_save.close();
+        };
+
+        vec3s fov = sw_.fov();
+
+        zi::wall_timer total;
+
+        std::thread loader([&]() {
+                stage_stats& st = stats_[0];
+                try
+                {
+                    bool open = true;
+
+                    for ( std::size_t i = 0; open && i < jobs.size(); ++i )
+                    {
+                        zi::wall_timer t;
+
+                        vec3s os = volume_size(jobs[i].input);
+                        auto  v  = open_volume<double>(jobs[i].input + ".image",
+                                                       os, fov);
+
+                        std::size_t depth = slab_depth_ ? slab_depth_
+                            : sw_.tile_shape(os)[2];
+
+                        st.busy += t.elapsed<double>();
+
+                        for ( std::size_t z = 0; open && z < os[2]; z += depth )
+                        {
+                            t.reset();
+
+                            slab sl{ i, vec3s(0, 0, z),
+                                    vec3s(os[0], os[1],
+                                          std::min(depth, os[2] - z)),
+                                    z + depth >= os[2] };
+
+                            vec3s from, s;
+                            sw_.input_region(v->size(), sl.from, sl.s,
+                                             from, s);
+
+                            loaded l{ sl, std::unique_ptr<cube_volume<double>>(
+                                    new cube_volume<double>(
+                                        v->gather(from, s), from,
+                                        v->size())) };
+
+                            st.busy  += t.elapsed<double>();
+                            st.bytes += s[0] * s[1] * s[2] * sizeof(double);
+                            st.volumes += sl.last;
+
+                            t.reset();
+                            open = to_compute.push(std::move(l));
+                            st.waiting += t.elapsed<double>();
+                        }
+                    }
+                    to_compute.close();
+                }
+                catch (...)
+                {
+                    fail();
+                }
+            });
+
+        std::thread saver([&]() {
+                stage_stats& st = stats_[2];
+                try
+                {
+                    std::unique_ptr<io::buffered_writer> out;
+
+                    for ( ;; )
+                    {
+                        zi::wall_timer t;
+
+                        computed c;
+                        if ( !to_save.pop(c) )
+                        {
+                            break;
+                        }
+
+                        st.waiting += t.elapsed<double>();
+                        t.reset();
+
+                        const std::string& fname = jobs[c.sl.job].output;
+
+                        if ( c.sl.from[2] == 0 )
+                        {
+                            auto sizefn = fname + ".size";
+                            std::ofstream sizef(sizefn.c_str());
+
+                            zi::vl::vec<int,3> s(c.size[0], c.size[1],
+                                                 c.size[2]);
+                            io::write(sizef, s);
+
+                            out.reset(new io::buffered_writer(fname + ".image"));
+                        }
+
+                        *out << c.output;
+
+                        if ( c.sl.last )
+                        {
+                            out->close();
+                            out.reset();
+                            ++st.volumes;
+                        }
+
+                        st.busy  += t.elapsed<double>();
+                        st.bytes += c.output.n_elem * sizeof(double);
+                    }
+                }
+                catch (...)
+                {
+                    fail();
+                }
+            });
+
+        {
+            stage_stats& st = stats_[1];
+            try
+            {
+                for ( ;; )
+                {
+                    zi::wall_timer t;
+
+                    loaded l;
+                    if ( !to_compute.pop(l) )
+                    {
+                        break;
+                    }
+
+                    st.waiting += t.elapsed<double>();
+                    t.reset();
+
+                    computed c{ l.sl, l.input->size() - fov + vec3s::one,
+                            cross_entropy_
+                            ? sw_.process(*l.input, cross_entropy_output,
+                                          l.sl.from, l.sl.s)
+                            : sw_.process(*l.input, sw_.first_output,
+                                          l.sl.from, l.sl.s) };
+
+                    l.input.reset();
+
+                    st.busy  += t.elapsed<double>();
+                    st.bytes += c.output.n_elem * sizeof(double);
+                    st.volumes += l.sl.last;
+
+                    t.reset();
+                    bool open = to_save.push(std::move(c));
+                    st.waiting += t.elapsed<double>();
+
+                    if ( !open )
+                    {
+                        break;
+                    }
+                }
+                to_save.close();
+            }
+            catch (...)
+            {
+                fail();
+            }
+        }
+
+        loader.join();
+        saver.join();
+
+        elapsed_ = total.elapsed<double>();
+
+        if ( error )
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Of the last run
+
+    const std::vector<stage_stats>& stats() const
+    {
+        return stats_;
+    }
+
+    double elapsed() const
+    {
+        return elapsed_;
+    }
+
+    void report( std::ostream& out = std::cout ) const
+    {
+        for ( auto& s: stats_ )
+        {
+            out << std::setw(8) << s.name << ": " << s.volumes
+                << " volumes, " << s.bytes / 1048576.0 << " MB, busy "
+                << s.busy << " s (" << s.throughput() << " MB/s), waiting "
+                << s.waiting << " s\n";
+        }
+
+        out << "   total: " << elapsed_ << " s" << std::endl;
+    }
+
+}; // class inference_pipeline
+
+// The jobs through an inference_pipeline, with up to concurrent_tiles
+// tiles in flight, as the process_whole_cube for a single volume, the
+// statistics of the stages printed at the end
+
+inline void process_volumes( const std::vector<inference_job>& jobs,
+                             layered_network& net,
+                             transfer_fn tf,
+                             const vec3s& tile,
+                             size_t concurrent_tiles,
+                             size_t max_bytes = 0,
+                             bool cross_entropy = true,
+                             size_t depth = 1 )
+{
+    std::vector<std::unique_ptr<layered_network_data>> data;
+    std::vector<std::unique_ptr<parallel_network>>     nets;
+    std::vector<parallel_network*>                     lanes;
+
+    for ( size_t i = 0; i < std::max<size_t>(concurrent_tiles, 1); ++i )
+    {
+        data.emplace_back(new layered_network_data(net));
+        nets.emplace_back(new parallel_network(*data.back(), tf));
+        nets.back()->set_inference(true);
+        lanes.push_back(nets.back().get());
+    }
+
+    sliding_window<parallel_network> sw(lanes, tile, max_bytes);
+
+    inference_pipeline<parallel_network> p(sw, cross_entropy, depth);
+    p.run(jobs);
+    p.report();
+}
+
+}}} // namespace zi::znn::frontiers
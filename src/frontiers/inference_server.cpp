@@ -0,0 +1,109 @@
+// The inference server: loads the network once, then answers the
+// requests of inference_client over a unix domain socket until
+// interrupted (SIGINT or SIGTERM), which lets the requests in progress
+// finish and removes the socket.
+//
+// usage: inference_server <network> <socket> [concurrent tiles]
+//                         [memory in MB] [cross entropy (0/1)]
+
+#include "inference_server.hpp"
+#include "tile_size.hpp"
+#include "../network/model_file.hpp"
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <signal.h>
+#include <unistd.h>
+
+namespace arma {
+thread_local arma_rng_cxx11 arma_rng_cxx11_instance;
+}
+
+using namespace zi::znn;
+
+namespace {
+
+// stop() can't be called from a signal handler: the handler only wakes
+// up a thread that does
+
+int stop_pipe[2];
+
+extern "C" void on_stop_signal(int)
+{
+    char c = 0;
+    ssize_t r = ::write(stop_pipe[1], &c, 1);
+    (void)r;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    if ( argc < 3 )
+    {
+        std::cerr << "usage: " << argv[0] << " <network> <socket>"
+                  << " [concurrent tiles] [memory in MB]"
+                  << " [cross entropy (0/1)]" << std::endl;
+        return 1;
+    }
+
+    std::string netfname = argv[1];
+    std::string path     = argv[2];
+
+    std::size_t concurrent_tiles = argc > 3 ? std::atoi(argv[3]) : 4;
+    std::size_t max_bytes        = ( argc > 4 ? std::atoll(argv[4]) : 8192 )
+        << 20;
+    bool        cross_entropy    = argc > 5 ? std::atoi(argv[5]) : true;
+
+    concurrent_tiles = std::max<std::size_t>(concurrent_tiles, 1);
+
+    if ( ::pipe(stop_pipe) )
+    {
+        std::cerr << "pipe failed" << std::endl;
+        return 1;
+    }
+
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    ::sigaction(SIGINT , &sa, nullptr);
+    ::sigaction(SIGTERM, &sa, nullptr);
+
+    zi::async::set_memory_budget(max_bytes);
+
+    layered_network net = load_network(netfname, true);
+
+    vec3s tile = frontiers::select_tile(netfname, net,
+                                        make_transfer_fn<sigmoid>(),
+                                        max_bytes / concurrent_tiles);
+
+    frontiers::inference_server server(net, make_transfer_fn<sigmoid>(),
+                                       path, tile, concurrent_tiles,
+                                       max_bytes, cross_entropy);
+    server.warm_up();
+
+    std::cout << "serving " << netfname << " (tile " << tile
+              << ") on " << path << std::endl;
+
+    std::thread waiter([&]() {
+            char c;
+            while ( ::read(stop_pipe[0], &c, 1) < 0 && errno == EINTR );
+            server.stop();
+        });
+
+    server.run();
+
+    // run() also ends on an error of the listening socket, the waiter
+    // still waiting
+
+    on_stop_signal(0);
+    waiter.join();
+
+    std::cout << "stopped" << std::endl;
+}
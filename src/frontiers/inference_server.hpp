@@ -0,0 +1,692 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <iostream>
+#include <set>
+#include <memory>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../core/types.hpp"
+#include "../network/layered_network.hpp"
+#include "../network/layered_network_data.hpp"
+#include "../network/parallel_network.hpp"
+#include "../transfer_fn/transfer_fn.hpp"
+#include "sliding_window.hpp"
+#include "mapped_volume.hpp"
+#include "chunked_volume.hpp"
+#include "utility.hpp"
+
+namespace zi {
+namespace znn {
+namespace frontiers {
+
+// A long running inference process. Loading a network, computing the
+// transforms of its filters and making the FFT plans costs more than
+// the inference of a small region, so the server does it once, and
+// then answers requests over a unix domain socket, each a region of
+// the output of the network over a volume.
+//
+// The volume is either a file (<name>.size and <name>.image, raw or
+// chunked, as for process_whole_cube) or a shared memory object
+// (shm_open name, doubles, x fastest, of the given size); the output
+// region, of the same coordinates as the volume, is sent back.
+//
+// The server works on the requests in batches: all the requests
+// received while the previous batch was computed are processed
+// together, their tiles shared by the networks, so that many small
+// requests fill the networks as one large one would. All the tiles
+// have the server's tile shape, the one the transforms of the filters
+// are kept for: the volumes smaller than a tile are mirrored further
+// (padded_volume) up to its size.
+//
+// Each client has its own thread while connected.
+//
+// The messages are in the native byte order (the socket is local):
+// a request is an inference_request followed by the name, a reply an
+// inference_reply followed by the region (doubles, x fastest) or the
+// error message.
+
+struct inference_request
+{
+    static const uint32_t magic_number = 0x494e4e5a; // ZNNI
+
+    enum source_kind: uint32_t
+    {
+        volume_file   = 1,
+        shared_memory = 2
+    };
+
+    uint32_t magic      ;
+    uint32_t source     ;
+    uint64_t size[3]    ; // of the shared memory volume
+    uint64_t from[3]    ; // of the output region
+    uint64_t extent[3]  ;
+    uint64_t name_length;
+};
+
+struct inference_reply
+{
+    static const uint32_t magic_number = 0x524e4e5a; // ZNNR
+
+    enum status_kind: uint32_t
+    {
+        ok    = 0,
+        error = 1
+    };
+
+    uint32_t magic ;
+    uint32_t status;
+    uint64_t length; // bytes that follow
+};
+
+namespace detail {
+
+inline void socket_check( bool ok, const std::string& what )
+{
+    if ( !ok )
+    {
+        throw std::runtime_error("inference_server: " + what + ": " +
+                                 std::strerror(errno));
+    }
+}
+
+inline sockaddr_un socket_address( const std::string& path )
+{
+    sockaddr_un sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+
+    if ( path.size() >= sizeof(sa.sun_path) )
+    {
+        throw std::invalid_argument("inference_server: socket path too long: "
+                                    + path);
+    }
+
+    std::strcpy(sa.sun_path, path.c_str());
+    return sa;
+}
+
+inline void send_all( int fd, const void* data, std::size_t n )
+{
+    const char* p = static_cast<const char*>(data);
+
+    while ( n )
+    {
+        ssize_t k = ::send(fd, p, n, MSG_NOSIGNAL);
+        if ( k < 0 )
+        {
+            socket_check(errno == EINTR, "send");
+            continue;
+        }
+        p += k;
+        n -= k;
+    }
+}
+
+// Returns false if the connection was closed before the first byte
+
+inline bool recv_all( int fd, void* data, std::size_t n )
+{
+    char* p     = static_cast<char*>(data);
+    bool  first = true;
+
+    while ( n )
+    {
+        ssize_t k = ::recv(fd, p, n, 0);
+        if ( k == 0 )
+        {
+            if ( first )
+            {
+                return false;
+            }
+            throw std::runtime_error("inference_server: connection closed");
+        }
+        if ( k < 0 )
+        {
+            socket_check(errno == EINTR, "recv");
+            continue;
+        }
+        p += k;
+        n -= k;
+        first = false;
+    }
+
+    return true;
+}
+
+} // namespace detail
+
+class inference_server
+{
+private:
+    typedef sliding_window<parallel_network> window_type;
+
+    struct result
+    {
+        std::string  error;
+        cube<double> output;
+    };
+
+    struct job
+    {
+        inference_request    request;
+        std::string          name   ;
+        std::promise<result> done   ;
+    };
+
+private:
+    std::vector<std::unique_ptr<layered_network_data>> data_ ;
+    std::vector<std::unique_ptr<parallel_network>>     nets_ ;
+    std::unique_ptr<window_type>                       sw_   ;
+    vec3s                                              tile_ ;
+    vec3s                                              fov_  ;
+    bool                                               cross_entropy_;
+
+    std::string                       path_      ;
+    int                               listener_  = -1;
+    std::atomic<bool>                 stopping_  {false};
+
+    std::mutex                        m_         ;
+    std::condition_variable           cv_        ;
+    std::deque<std::unique_ptr<job>>  queue_     ;
+    std::set<int>                     clients_   ;
+
+private:
+    std::unique_ptr<volume<double>> open( const job& j ) const
+    {
+        const inference_request& r = j.request;
+
+        if ( r.source == inference_request::volume_file )
+        {
+            if ( ::access((j.name + ".size").c_str(), R_OK) )
+            {
+                throw std::runtime_error("no volume " + j.name);
+            }
+            return open_volume<double>(j.name + ".image",
+                                       volume_size(j.name), fov_);
+        }
+
+        if ( r.source == inference_request::shared_memory )
+        {
+            int fd = ::shm_open(j.name.c_str(), O_RDONLY, 0);
+            if ( fd < 0 )
+            {
+                throw std::runtime_error("shm_open " + j.name + ": " +
+                                         std::strerror(errno));
+            }
+
+            try
+            {
+                vec3s s(r.size[0], r.size[1], r.size[2]);
+                std::unique_ptr<volume<double>>
+                    v(new mapped_volume<double>(fd, j.name, s, fov_));
+                ::close(fd);
+                return v;
+            }
+            catch (...)
+            {
+                ::close(fd);
+                throw;
+            }
+        }
+
+        throw std::invalid_argument("unknown source");
+    }
+
+    // Computes a batch of requests, the ones that can't be opened
+    // failing on their own
+
+    void serve( std::vector<std::unique_ptr<job>>& batch )
+    {
+        std::vector<std::unique_ptr<volume<double>>> volumes;
+        std::vector<window_type::region>             regions;
+        std::vector<result>                          results(batch.size());
+        std::vector<std::size_t>                     which;
+
+        for ( std::size_t i = 0; i < batch.size(); ++i )
+        {
+            try
+            {
+                const inference_request& r = batch[i]->request;
+
+                std::unique_ptr<volume<double>> v = open(*batch[i]);
+
+                vec3s os = v->size() - fov_ + vec3s::one;
+                vec3s is = tile_ + fov_ - vec3s::one;
+                vec3s ro(r.from[0], r.from[1], r.from[2]);
+                vec3s rs(r.extent[0], r.extent[1], r.extent[2]);
+
+                for ( std::size_t k = 0; k < 3; ++k )
+                {
+                    if ( rs[k] == 0 || ro[k] > os[k] || rs[k] > os[k] - ro[k] )
+                    {
+                        throw std::invalid_argument("region out of the volume");
+                    }
+                }
+
+                if ( v->size()[0] < is[0] || v->size()[1] < is[1] ||
+                     v->size()[2] < is[2] )
+                {
+                    v.reset(new padded_volume<double>(std::move(v), is));
+                }
+
+                volumes.push_back(std::move(v));
+                which.push_back(i);
+            }
+            catch ( std::exception& e )
+            {
+                results[i].error = e.what();
+            }
+        }
+
+        for ( std::size_t n = 0; n < which.size(); ++n )
+        {
+            const inference_request& r = batch[which[n]]->request;
+            regions.push_back(window_type::region{
+                    volumes[n].get(),
+                    vec3s(r.from[0], r.from[1], r.from[2]),
+                    vec3s(r.extent[0], r.extent[1], r.extent[2]),
+                    &results[which[n]].output });
+        }
+
+        if ( regions.size() )
+        {
+            try
+            {
+                if ( cross_entropy_ )
+                {
+                    sw_->process(regions, cross_entropy_output);
+                }
+                else
+                {
+                    sw_->process(regions, window_type::first_output);
+                }
+            }
+            catch ( std::exception& e )
+            {
+                for ( auto i: which )
+                {
+                    results[i].error = e.what();
+                }
+            }
+        }
+
+        for ( std::size_t i = 0; i < batch.size(); ++i )
+        {
+            batch[i]->done.set_value(std::move(results[i]));
+        }
+    }
+
+    void compute()
+    {
+        for ( ;; )
+        {
+            std::vector<std::unique_ptr<job>> batch;
+
+            {
+                std::unique_lock<std::mutex> g(m_);
+                cv_.wait(g, [this]() { return stopping_ || !queue_.empty(); });
+
+                if ( queue_.empty() )
+                {
+                    return;
+                }
+
+                while ( queue_.size() )
+                {
+                    batch.push_back(std::move(queue_.front()));
+                    queue_.pop_front();
+                }
+            }
+
+            serve(batch);
+        }
+    }
+
+    void reply( int fd, const result& r )
+    {
+        inference_reply h;
+        h.magic = inference_reply::magic_number;
+
+        if ( r.error.size() )
+        {
+            h.status = inference_reply::error;
+            h.length = r.error.size();
+            detail::send_all(fd, &h, sizeof(h));
+            detail::send_all(fd, r.error.data(), r.error.size());
+        }
+        else
+        {
+            h.status = inference_reply::ok;
+            h.length = r.output.n_elem * sizeof(double);
+            detail::send_all(fd, &h, sizeof(h));
+            detail::send_all(fd, r.output.memptr(), h.length);
+        }
+    }
+
+    // Serves the requests of a single client, one at a time
+
+    void connection( int fd )
+    {
+        try
+        {
+            for ( ;; )
+            {
+                std::unique_ptr<job> j(new job);
+
+                if ( !detail::recv_all(fd, &j->request, sizeof(j->request)) )
+                {
+                    break;
+                }
+
+                if ( j->request.magic != inference_request::magic_number ||
+                     j->request.name_length > 4096 )
+                {
+                    throw std::runtime_error("inference_server: bad request");
+                }
+
+                j->name.resize(j->request.name_length);
+                if ( j->name.size() )
+                {
+                    detail::recv_all(fd, &j->name[0], j->name.size());
+                }
+
+                std::future<result> f = j->done.get_future();
+
+                {
+                    std::lock_guard<std::mutex> g(m_);
+                    if ( stopping_ )
+                    {
+                        break;
+                    }
+                    queue_.push_back(std::move(j));
+                }
+
+                cv_.notify_one();
+                reply(fd, f.get());
+            }
+        }
+        catch ( std::exception& e )
+        {
+            if ( !stopping_ )
+            {
+                std::cerr << e.what() << std::endl;
+            }
+        }
+
+        // The last use of the server: run() can return as soon as
+        // clients_ is empty
+
+        std::lock_guard<std::mutex> g(m_);
+        clients_.erase(fd);
+        ::close(fd);
+        cv_.notify_all();
+    }
+
+public:
+    // Up to concurrent_tiles tiles of the given output shape in flight,
+    // using at most about max_bytes (0 for no limit)
+
+    inference_server( layered_network& net, transfer_fn tf,
+                      const std::string& path, const vec3s& tile,
+                      std::size_t concurrent_tiles, std::size_t max_bytes = 0,
+                      bool cross_entropy = true )
+        : tile_(tile)
+        , fov_(net.fov())
+        , cross_entropy_(cross_entropy)
+        , path_(path)
+    {
+        std::vector<parallel_network*> lanes;
+
+        for ( std::size_t i = 0; i < std::max<std::size_t>(concurrent_tiles, 1);
+              ++i )
+        {
+            data_.emplace_back(new layered_network_data(net));
+            nets_.emplace_back(new parallel_network(*data_.back(), tf));
+            nets_.back()->set_inference(true);
+            lanes.push_back(nets_.back().get());
+        }
+
+        sw_.reset(new window_type(lanes, tile, max_bytes));
+
+        sockaddr_un sa = detail::socket_address(path_);
+
+        ::unlink(path_.c_str());
+
+        listener_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        detail::socket_check(listener_ >= 0, "socket");
+
+        if ( ::bind(listener_, reinterpret_cast<sockaddr*>(&sa), sizeof(sa))
+             || ::listen(listener_, 64) )
+        {
+            int e = errno;
+            ::close(listener_);
+            errno = e;
+            detail::socket_check(false, "bind " + path_);
+        }
+    }
+
+    ~inference_server()
+    {
+        ::close(listener_);
+        ::unlink(path_.c_str());
+    }
+
+    inference_server(const inference_server&) = delete;
+    inference_server& operator=(const inference_server&) = delete;
+
+    // Computes a tile on each network, so that the plans and the
+    // transforms of the filters are ready for the first requests
+
+    void warm_up()
+    {
+        vec3s s = tile_ + fov_ - vec3s::one;
+
+        std::vector<std::thread> threads;
+
+        for ( auto& n: nets_ )
+        {
+            parallel_network* net = n.get();
+            threads.emplace_back([net, s]() {
+                    std::vector<unique_cube<double>> input(1);
+                    input[0] = pool<double>::get_unique(s);
+                    input[0]->randu();
+                    net->forward_async(input).wait();
+                });
+        }
+
+        for ( auto& th: threads )
+        {
+            th.join();
+        }
+    }
+
+    // Serves the clients until stop() is called, then waits for all of
+    // them to be disconnected
+
+    void run()
+    {
+        std::thread worker(&inference_server::compute, this);
+
+        while ( !stopping_ )
+        {
+            int fd = ::accept(listener_, nullptr, nullptr);
+
+            if ( fd < 0 )
+            {
+                if ( errno == EINTR && !stopping_ )
+                {
+                    continue;
+                }
+                break;
+            }
+
+            std::lock_guard<std::mutex> g(m_);
+
+            if ( stopping_ )
+            {
+                ::close(fd);
+                break;
+            }
+
+            clients_.insert(fd);
+            std::thread(&inference_server::connection, this, fd).detach();
+        }
+
+        stop();
+
+        {
+            std::unique_lock<std::mutex> g(m_);
+            cv_.wait(g, [this]() { return clients_.empty(); });
+        }
+
+        worker.join();
+    }
+
+    // Can be called from any thread; the requests being computed are
+    // answered first
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> g(m_);
+            stopping_ = true;
+
+            for ( int fd: clients_ )
+            {
+                ::shutdown(fd, SHUT_RD);
+            }
+        }
+
+        ::shutdown(listener_, SHUT_RDWR);
+        cv_.notify_all();
+    }
+
+}; // class inference_server
+
+// A connection to an inference_server, sending one request at a time
+
+class inference_client
+{
+private:
+    int fd_ = -1;
+
+    cube<double> request( inference_request r, const std::string& name )
+    {
+        r.magic       = inference_request::magic_number;
+        r.name_length = name.size();
+
+        detail::send_all(fd_, &r, sizeof(r));
+        detail::send_all(fd_, name.data(), name.size());
+
+        inference_reply h;
+        if ( !detail::recv_all(fd_, &h, sizeof(h)) ||
+             h.magic != inference_reply::magic_number )
+        {
+            throw std::runtime_error("inference_client: no reply");
+        }
+
+        if ( h.status != inference_reply::ok )
+        {
+            std::string e(h.length, ' ');
+            if ( h.length )
+            {
+                detail::recv_all(fd_, &e[0], h.length);
+            }
+            throw std::runtime_error("inference_client: " + e);
+        }
+
+        cube<double> out(r.extent[0], r.extent[1], r.extent[2]);
+
+        if ( h.length != out.n_elem * sizeof(double) )
+        {
+            throw std::runtime_error("inference_client: bad reply");
+        }
+
+        detail::recv_all(fd_, out.memptr(), h.length);
+        return out;
+    }
+
+    static inference_request make_request( uint32_t source,
+                                           const vec3s& vs,
+                                           const vec3s& from,
+                                           const vec3s& s )
+    {
+        inference_request r;
+        r.source = source;
+
+        for ( std::size_t k = 0; k < 3; ++k )
+        {
+            r.size[k]   = vs[k];
+            r.from[k]   = from[k];
+            r.extent[k] = s[k];
+        }
+
+        return r;
+    }
+
+public:
+    explicit inference_client( const std::string& path )
+    {
+        sockaddr_un sa = detail::socket_address(path);
+
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        detail::socket_check(fd_ >= 0, "socket");
+
+        if ( ::connect(fd_, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) )
+        {
+            int e = errno;
+            ::close(fd_);
+            errno = e;
+            detail::socket_check(false, "connect " + path);
+        }
+    }
+
+    ~inference_client()
+    {
+        ::close(fd_);
+    }
+
+    inference_client(const inference_client&) = delete;
+    inference_client& operator=(const inference_client&) = delete;
+
+    // The region of size s at from of the output over the volume fname
+    // (<fname>.size and <fname>.image, as seen by the server)
+
+    cube<double> infer( const std::string& fname,
+                        const vec3s& from, const vec3s& s )
+    {
+        return request(make_request(inference_request::volume_file,
+                                    vec3s::zero, from, s), fname);
+    }
+
+    // Same, over the volume of size vs in the shared memory object name
+
+    cube<double> infer_shared( const std::string& name, const vec3s& vs,
+                               const vec3s& from, const vec3s& s )
+    {
+        return request(make_request(inference_request::shared_memory,
+                                    vs, from, s), name);
+    }
+
+}; // class inference_client
+
+}}} // namespace zi::znn::frontiers
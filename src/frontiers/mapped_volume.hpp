@@ -0,0 +1,464 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstddef>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../core/types.hpp"
+#include "../core/diskio.hpp"
+
+namespace zi {
+namespace znn {
+namespace frontiers {
+
+// Size of the volume <fname>, as stored in <fname>.size
+
+inline vec3s volume_size( const std::string& fname )
+{
+    auto sizefn = fname + ".size";
+    std::ifstream sizef(sizefn.c_str());
+
+    if ( !sizef )
+    {
+        throw std::runtime_error("volume_size: can't open " + sizefn);
+    }
+
+    zi::vl::vec<int,3> s;
+    io::read(sizef, s);
+
+    return vec3s(s[0], s[1], s[2]);
+}
+
+// An element of the dihedral group of the cube, as used for the
+// augmentation: the flips of x, y and z followed by a rotation in the
+// xy plane (the rotated r of c being r(x,y,z) = c(n-1-y,x,z), n the
+// size of c along x).
+
+struct dihedral
+{
+    bool flip_x = false;
+    bool flip_y = false;
+    bool flip_z = false;
+    bool rotate = false;
+};
+
+// A read only volume, mirrored at the boundary the same way as
+// mirror_cube does: the coordinates are the ones of
+// mirror_cube(volume, fov), without the mirrored copy ever being made.
+// Only regions can be read, which lets the implementations read just
+// the parts of the storage that are needed.
+
+template<typename T>
+class volume
+{
+public:
+    virtual ~volume() {}
+
+    // Of the mirrored volume
+
+    virtual const vec3s& size() const = 0;
+
+    // Writes the region of size s at from, transformed by d, to out
+    // (x fastest), each output voxel being read once. Rotating requires
+    // s[0] == s[1].
+
+    virtual void gather( const vec3s& from, const vec3s& s,
+                         const dihedral& d, T* out ) const = 0;
+
+    cube<T> gather( const vec3s& from, const vec3s& s,
+                    const dihedral& d = dihedral() ) const
+    {
+        cube<T> r(s[0], s[1], s[2]);
+        gather(from, s, d, r.memptr());
+        return r;
+    }
+
+}; // class volume
+
+namespace detail {
+
+// Coordinate within the volume of size n of the coordinate p of the
+// volume mirrored with the offset off
+
+inline std::size_t mirror_coordinate( std::size_t n, std::size_t off,
+                                      std::size_t p )
+{
+    std::ptrdiff_t q = static_cast<std::ptrdiff_t>(p)
+        - static_cast<std::ptrdiff_t>(off);
+    std::ptrdiff_t m = n;
+
+    if ( q < 0  ) q = -q - 1;
+    if ( q >= m ) q = 2 * m - q - 1;
+
+    return q;
+}
+
+// Calls f(out, a, b, c) for each voxel of the output of size s
+// transformed by d, with a,b,c the corresponding coordinates within the
+// region (before the transform), whose x and y sizes are the output's
+// swapped when rotated
+
+template<typename T, typename F>
+inline void for_each_transformed( const vec3s& s, const dihedral& d,
+                                  T* out, F f )
+{
+    std::size_t n0 = d.rotate ? s[1] : s[0]; // of the region
+    std::size_t n1 = d.rotate ? s[0] : s[1];
+
+    for ( std::size_t z = 0; z < s[2]; ++z )
+    {
+        std::size_t c = d.flip_z ? s[2] - 1 - z : z;
+
+        for ( std::size_t y = 0; y < s[1]; ++y )
+        {
+            for ( std::size_t x = 0; x < s[0]; ++x )
+            {
+                std::size_t a = x, b = y;
+
+                if ( d.rotate )
+                {
+                    a = n0 - 1 - y;
+                    b = x;
+                }
+
+                if ( d.flip_x ) a = n0 - 1 - a;
+                if ( d.flip_y ) b = n1 - 1 - b;
+
+                f(out++, a, b, c);
+            }
+        }
+    }
+}
+
+} // namespace detail
+
+// Read only view of a raw volume file (elements of type D, x fastest),
+// memory mapped so that the pages are loaded on demand and shared with
+// all the other processes mapping the same file. The elements are
+// presented as T (e.g. a volume of doubles on disk used as chars).
+
+template<typename T, typename D = T>
+class mapped_volume: public volume<T>
+{
+private:
+    const D*    data_  = nullptr;
+    std::size_t bytes_ = 0;
+
+    vec3s       size_  ; // of the file
+    vec3s       off_   ; // of the file within the mirrored volume
+    vec3s       vsize_ ; // of the mirrored volume
+
+private:
+    static void check( bool ok, const std::string& what )
+    {
+        if ( !ok )
+        {
+            throw std::runtime_error("mapped_volume: " + what + ": " +
+                                     std::strerror(errno));
+        }
+    }
+
+    std::size_t physical( std::size_t k, std::size_t p ) const
+    {
+        return detail::mirror_coordinate(size_[k], off_[k], p);
+    }
+
+    // Maps the first bytes of the open file fd (named name in the
+    // errors)
+
+    void map( int fd, const std::string& name )
+    {
+        struct stat st;
+        check(::fstat(fd, &st) == 0, "stat " + name);
+
+        bytes_ = size_[0] * size_[1] * size_[2] * sizeof(D);
+
+        if ( static_cast<std::size_t>(st.st_size) < bytes_ || bytes_ == 0 )
+        {
+            throw std::runtime_error("mapped_volume: " + name +
+                                     " is too small");
+        }
+
+        void* p = ::mmap(nullptr, bytes_, PROT_READ, MAP_SHARED, fd, 0);
+
+        check(p != MAP_FAILED, "mmap " + name);
+        data_ = static_cast<const D*>(p);
+    }
+
+    void check_fov( const std::string& name ) const
+    {
+        for ( std::size_t k = 0; k < 3; ++k )
+        {
+            if ( off_[k] > size_[k] )
+            {
+                throw std::invalid_argument("mapped_volume: fov too large "
+                                            "for " + name);
+            }
+        }
+    }
+
+public:
+    mapped_volume( const std::string& fname, const vec3s& s,
+                   const vec3s& fov = vec3s::one )
+        : size_(s)
+        , off_(fov / vec3s(2,2,2))
+        , vsize_(s + fov - vec3s::one)
+    {
+        check_fov(fname);
+
+        int fd = ::open(fname.c_str(), O_RDONLY);
+        check(fd >= 0, "open " + fname);
+
+        try
+        {
+            map(fd, fname);
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+
+        ::close(fd);
+    }
+
+    // Of an already open file (e.g. a shared memory object), which can
+    // be closed afterwards
+
+    mapped_volume( int fd, const std::string& name, const vec3s& s,
+                   const vec3s& fov = vec3s::one )
+        : size_(s)
+        , off_(fov / vec3s(2,2,2))
+        , vsize_(s + fov - vec3s::one)
+    {
+        check_fov(name);
+        map(fd, name);
+    }
+
+    ~mapped_volume()
+    {
+        if ( data_ )
+        {
+            ::munmap(const_cast<D*>(data_), bytes_);
+        }
+    }
+
+    mapped_volume(const mapped_volume&) = delete;
+    mapped_volume& operator=(const mapped_volume&) = delete;
+
+    using volume<T>::gather;
+
+    const vec3s& size() const override
+    {
+        return vsize_;
+    }
+
+    T operator()( std::size_t x, std::size_t y, std::size_t z ) const
+    {
+        return static_cast<T>(data_[physical(0,x) + size_[0] *
+                                    ( physical(1,y) + size_[1] *
+                                      physical(2,z) )]);
+    }
+
+    // The mirroring is resolved by a table per dimension
+
+    void gather( const vec3s& from, const vec3s& s,
+                 const dihedral& d, T* out ) const override
+    {
+        ZI_ASSERT(!d.rotate||s[0]==s[1]);
+
+        std::vector<std::size_t> t[3];
+        std::size_t stride = 1;
+
+        for ( std::size_t k = 0; k < 3; ++k )
+        {
+            t[k].resize(s[k]);
+            for ( std::size_t i = 0; i < s[k]; ++i )
+            {
+                t[k][i] = physical(k, from[k] + i) * stride;
+            }
+            stride *= size_[k];
+        }
+
+        const D* data = data_;
+
+        detail::for_each_transformed(
+            s, d, out, [&](T* o, std::size_t a, std::size_t b, std::size_t c) {
+                *o = static_cast<T>(data[t[0][a] + t[1][b] + t[2][c]]);
+            });
+    }
+
+}; // class mapped_volume
+
+// A volume held in memory, already mirrored (e.g. read at once from
+// another volume). Or only the part of one at from (e.g. a slab read
+// ahead), in the coordinates of the whole volume of size s, the regions
+// gathered being within the part.
+
+template<typename T>
+class cube_volume: public volume<T>
+{
+private:
+    cube<T> data_;
+    vec3s   from_;
+    vec3s   size_;
+
+public:
+    explicit cube_volume( cube<T>&& c )
+        : data_(std::move(c))
+        , from_(vec3s::zero)
+        , size_(data_.n_rows, data_.n_cols, data_.n_slices)
+    {
+    }
+
+    cube_volume( cube<T>&& c, const vec3s& from, const vec3s& s )
+        : data_(std::move(c))
+        , from_(from)
+        , size_(s)
+    {
+        ZI_ASSERT(from[0]+data_.n_rows<=s[0]);
+        ZI_ASSERT(from[1]+data_.n_cols<=s[1]);
+        ZI_ASSERT(from[2]+data_.n_slices<=s[2]);
+    }
+
+    using volume<T>::gather;
+
+    const vec3s& size() const override
+    {
+        return size_;
+    }
+
+    const cube<T>& data() const
+    {
+        return data_;
+    }
+
+    void gather( const vec3s& at, const vec3s& s,
+                 const dihedral& d, T* out ) const override
+    {
+        ZI_ASSERT(!d.rotate||s[0]==s[1]);
+        ZI_ASSERT(at[0]>=from_[0]&&at[1]>=from_[1]&&at[2]>=from_[2]);
+
+        vec3s from = at - from_;
+
+        ZI_ASSERT(from[0]+s[0]<=data_.n_rows);
+        ZI_ASSERT(from[1]+s[1]<=data_.n_cols);
+        ZI_ASSERT(from[2]+s[2]<=data_.n_slices);
+
+        const cube<T>& c = data_;
+
+        if ( !d.flip_x && !d.flip_y && !d.flip_z && !d.rotate )
+        {
+            for ( std::size_t z = 0; z < s[2]; ++z )
+            {
+                for ( std::size_t y = 0; y < s[1]; ++y, out += s[0] )
+                {
+                    const T* row = &c(from[0], from[1] + y, from[2] + z);
+                    std::copy(row, row + s[0], out);
+                }
+            }
+            return;
+        }
+
+        detail::for_each_transformed(
+            s, d, out, [&](T* o, std::size_t a, std::size_t b, std::size_t z) {
+                *o = c(from[0] + a, from[1] + b, from[2] + z);
+            });
+    }
+
+}; // class cube_volume
+
+// A volume extended at the upper end of each axis to at least the size
+// s, by mirroring it further (as many times as needed), e.g. so that a
+// volume smaller than a tile can be computed with whole tiles. The
+// output of a network over the region of the original volume is the
+// same, as it doesn't read past the original's end.
+
+template<typename T>
+class padded_volume: public volume<T>
+{
+private:
+    std::unique_ptr<volume<T>> v_   ;
+    vec3s                      size_;
+
+    // Of the coordinate p of the padded volume within the original one
+
+    std::size_t original( std::size_t k, std::size_t p ) const
+    {
+        std::size_t n = v_->size()[k];
+        p %= 2 * n;
+        return p < n ? p : 2 * n - 1 - p;
+    }
+
+public:
+    padded_volume( std::unique_ptr<volume<T>> v, const vec3s& s )
+        : v_(std::move(v))
+        , size_(std::max(v_->size()[0], s[0]),
+                std::max(v_->size()[1], s[1]),
+                std::max(v_->size()[2], s[2]))
+    {
+    }
+
+    using volume<T>::gather;
+
+    const vec3s& size() const override
+    {
+        return size_;
+    }
+
+    void gather( const vec3s& from, const vec3s& s,
+                 const dihedral& d, T* out ) const override
+    {
+        ZI_ASSERT(from[0]+s[0]<=size_[0]);
+        ZI_ASSERT(from[1]+s[1]<=size_[1]);
+        ZI_ASSERT(from[2]+s[2]<=size_[2]);
+        ZI_ASSERT(!d.rotate||s[0]==s[1]);
+
+        const vec3s& n = v_->size();
+
+        if ( from[0] + s[0] <= n[0] && from[1] + s[1] <= n[1] &&
+             from[2] + s[2] <= n[2] )
+        {
+            v_->gather(from, s, d, out);
+            return;
+        }
+
+        // The box of the original volume the region reads, gathered at
+        // once
+
+        std::vector<std::size_t> p[3];
+        vec3s lo, hi;
+
+        for ( std::size_t k = 0; k < 3; ++k )
+        {
+            for ( std::size_t i = 0; i < s[k]; ++i )
+            {
+                p[k].push_back(original(k, from[k] + i));
+            }
+
+            lo[k] = *std::min_element(p[k].begin(), p[k].end());
+            hi[k] = *std::max_element(p[k].begin(), p[k].end());
+        }
+
+        cube<T> c = v_->gather(lo, hi - lo + vec3s::one);
+
+        detail::for_each_transformed(
+            s, d, out, [&](T* o, std::size_t a, std::size_t b, std::size_t z) {
+                *o = c(p[0][a] - lo[0], p[1][b] - lo[1], p[2][z] - lo[2]);
+            });
+    }
+
+}; // class padded_volume
+
+}}} // namespace zi::znn::frontiers
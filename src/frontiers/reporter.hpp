@@ -7,6 +7,8 @@
 #include <fstream>
 #include <iostream>
 #include <vector>
+#include <mutex>
+#include <algorithm>
 
 #include <zi/time.hpp>
 
@@ -29,6 +31,9 @@ private:
     size_t cur_niter_ = 0;
     size_t tot_niter_ = 0;
 
+    // Time spent waiting on the training data (not saved)
+    double cur_wait_  = 0;
+
     zi::wall_timer timer_;
 
 private:
@@ -48,14 +53,24 @@ private:
             double itps = cur_niter_;
             itps /= elapsed;
 
+            double wait = cur_wait_;
+
             cur_error_ = cur_clerr_ = 0;
             cur_niter_ = 0;
+            cur_wait_  = 0;
 
             std::cout << "Iter: " << niter_.back()
                       << " " << itps << " iteration/s"
                       << "\n\tClassification Error: " << clerr_.back()
-                      << "\n\tTraining Error:       " << error_.back()
-                      << std::endl;
+                      << "\n\tTraining Error:       " << error_.back();
+
+            if ( wait > 0 )
+            {
+                std::cout << "\n\tData Starvation:      " << wait << " s ("
+                          << ( 100 * wait / elapsed ) << "%)";
+            }
+
+            std::cout << std::endl;
         }
     }
 
@@ -107,6 +122,14 @@ public:
         return false;
     }
 
+    // Accounts for the time the training waited on the data, reported
+    // along with the rest
+
+    void data_wait( double seconds )
+    {
+        cur_wait_ += seconds;
+    }
+
     void force_save()
     {
         update();
@@ -122,6 +145,7 @@ public:
     {
         cur_error_ = cur_clerr_ = 0;
         cur_niter_ = tot_niter_ = 0;
+        cur_wait_  = 0;
         clerr_.clear();
         error_.clear();
         niter_.clear();
@@ -130,4 +154,81 @@ public:
 
 }; // class reporter
 
+
+// Thread safe reporter for several replicas training concurrently. The
+// iterations of all the replicas are aggregated, and the rate of each
+// replica is printed along with the total.
+
+class concurrent_reporter
+{
+private:
+    std::mutex          mutex_   ;
+    reporter            reporter_;
+    std::vector<size_t> niter_   ;
+
+    zi::wall_timer timer_;
+
+public:
+    concurrent_reporter(const std::string fname, size_t num_replicas,
+                        size_t freq = 1)
+        : reporter_(fname, freq)
+        , niter_(num_replicas)
+    {
+        timer_.reset();
+    }
+
+    bool report( size_t replica, double clerr, double error, size_t iter )
+    {
+        std::lock_guard<std::mutex> g(mutex_);
+
+        ZI_ASSERT(replica<niter_.size());
+        niter_[replica] += iter;
+
+        if ( !reporter_.report(clerr, error, iter) )
+        {
+            return false;
+        }
+
+        double elapsed = timer_.elapsed<double>();
+        timer_.reset();
+
+        std::cout << "\tReplicas (iteration/s):";
+        for ( auto& n: niter_ )
+        {
+            std::cout << ' ' << ( n / elapsed );
+            n = 0;
+        }
+        std::cout << std::endl;
+
+        return true;
+    }
+
+    void data_wait( double seconds )
+    {
+        std::lock_guard<std::mutex> g(mutex_);
+        reporter_.data_wait(seconds);
+    }
+
+    void force_save()
+    {
+        std::lock_guard<std::mutex> g(mutex_);
+        reporter_.force_save();
+    }
+
+    size_t total_iterations()
+    {
+        std::lock_guard<std::mutex> g(mutex_);
+        return reporter_.total_iterations();
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> g(mutex_);
+        reporter_.clear();
+        std::fill(niter_.begin(), niter_.end(), 0);
+        timer_.reset();
+    }
+
+}; // class concurrent_reporter
+
 }}} // namespace zi::znn::frontiers
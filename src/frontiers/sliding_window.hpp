@@ -0,0 +1,461 @@
+#pragma once
+
+#include <vector>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+
+#include "../core/types.hpp"
+#include "../core/cube_utils.hpp"
+#include "../core/cube_pool.hpp"
+#include "../network/layered_network_data.hpp"
+#include "mapped_volume.hpp"
+
+namespace zi {
+namespace znn {
+namespace frontiers {
+
+// The part of inference_bytes() of the transforms of the filters: of
+// all of them when they are kept, of the widest layer's otherwise
+
+inline std::size_t filter_spectra_bytes( layered_network_data& net,
+                                         const vec3s& s,
+                                         bool keep_filters = true )
+{
+    std::size_t vc = ( s[0] / 2 + 1 ) * s[1] * s[2];
+    std::size_t r  = 0;
+
+    for ( std::size_t l = 0; l < net.num_layers(); ++l )
+    {
+        std::size_t n = net.layer(l).num_inputs() * net.layer(l).num_outputs()
+            * vc * sizeof(complex);
+
+        r = keep_filters ? r + n : std::max(r, n);
+    }
+
+    return r;
+}
+
+// Rough upper bound of the memory used by the forward pass of a network
+// over an input of size s: the cached transforms of all the filters
+// (of one layer's worth when they are not kept), the featuremaps kept by
+// all the layers (only the ones of the widest layer in the inference
+// mode), and the transforms of the inputs and outputs of the widest
+// layer (all taken at the input size, the featuremaps only get
+// smaller).
+
+inline std::size_t inference_bytes( layered_network_data& net,
+                                    const vec3s& s,
+                                    bool inference = false,
+                                    bool keep_filters = true )
+{
+    std::size_t v  = s[0] * s[1] * s[2];
+    std::size_t vc = ( s[0] / 2 + 1 ) * s[1] * s[2];
+
+    std::size_t filters = filter_spectra_bytes(net, s, keep_filters);
+    std::size_t maps = v * sizeof(double), widest = 0;
+
+    for ( std::size_t l = 0; l < net.num_layers(); ++l )
+    {
+        std::size_t ni = net.layer(l).num_inputs();
+        std::size_t no = net.layer(l).num_outputs();
+
+        widest = std::max(widest, ( ni + no ) * vc * sizeof(complex));
+
+        if ( inference )
+        {
+            maps = std::max(maps, ( ni + no ) * v * sizeof(double));
+        }
+        else
+        {
+            maps += no * v * sizeof(double);
+        }
+    }
+
+    return filters + maps + widest;
+}
+
+// Memory of the forward pass of the network net over an input of size s
+
+template<typename N>
+inline std::size_t forward_bytes( N& net, const vec3s& s )
+{
+    return inference_bytes(net.data(), s, net.inference(),
+                           net.keep_filter_transforms());
+}
+
+// Dense inference over a whole (mirrored) volume, one tile at a time.
+//
+// All the tiles of a volume have the same shape: the tiles at the far
+// edges are moved back so they end at the edge of the volume, instead
+// of being cut short, overlapping their neighbours (the overlap is the
+// padding, with real data instead of zeros). The network then sees a
+// single input size, so the FFT plans and the transforms of the
+// filters, which the network caches for the last input size, are
+// computed once for the whole volume instead of once per distinct edge
+// tile.
+//
+// Several tiles can be in flight at once, each on its own network (N
+// is a parallel_network, all of them over the same weights), so that
+// the tasks of the narrow first and last layers of one tile fill the
+// thread pool together with the ones of the other tiles. The number of
+// tiles in flight is limited by the number of networks and by the
+// memory cap, if any.
+//
+// Each tile is gathered straight into the input of its network, the
+// halo coming from the volume's storage (the shared page cache of a
+// mapped volume, or the decoded chunks of a chunked one) rather than
+// from a copy of the neighbouring tiles. The input of the next tile is
+// gathered while the network works on the current one, and each tile
+// writes the part of the output it owns straight into the result.
+
+template<typename N>
+class sliding_window
+{
+private:
+    // Along one axis: where the tile starts and the part of the output
+    // it owns (the tiles moved back own only what they add)
+
+    struct span
+    {
+        std::size_t from, begin, end;
+    };
+
+private:
+    std::vector<N*> nets_     ;
+    vec3s           tile_     ; // of the output
+    std::size_t     max_bytes_;
+
+private:
+    // Tiles of size t covering [b,e) of [0,n)
+
+    static std::vector<span> spans( std::size_t n, std::size_t t,
+                                    std::size_t b, std::size_t e )
+    {
+        std::vector<span> r;
+        for ( std::size_t x = b; x < e; x += t )
+        {
+            r.push_back(span{ std::min(x, n - t), x, std::min(x + t, e) });
+        }
+        return r;
+    }
+
+    std::size_t lanes( const vec3s& s, std::size_t n ) const
+    {
+        n = std::min(nets_.size(), n);
+
+        if ( max_bytes_ )
+        {
+            vec3s t = tile_shape(s) + nets_[0]->fov() - vec3s::one;
+            std::size_t per_tile = forward_bytes(*nets_[0], t);
+            n = std::max<std::size_t>(1, std::min(n, max_bytes_ / per_tile));
+        }
+
+        return n;
+    }
+
+    void check_tile() const
+    {
+        if ( tile_[0] == 0 || tile_[1] == 0 || tile_[2] == 0 )
+        {
+            throw std::invalid_argument("sliding_window: empty tile");
+        }
+    }
+
+public:
+    sliding_window( N& net, const vec3s& tile )
+        : nets_(1, &net)
+        , tile_(tile)
+        , max_bytes_(0)
+    {
+        check_tile();
+    }
+
+    // max_bytes = 0 for no memory cap
+
+    sliding_window( const std::vector<N*>& nets, const vec3s& tile,
+                    std::size_t max_bytes = 0 )
+        : nets_(nets)
+        , tile_(tile)
+        , max_bytes_(max_bytes)
+    {
+        ZI_ASSERT(nets.size()>0);
+        check_tile();
+    }
+
+    vec3s fov() const
+    {
+        return nets_[0]->fov();
+    }
+
+    // Output shape of the tiles used for an output of size s
+
+    vec3s tile_shape( const vec3s& s ) const
+    {
+        return vec3s(std::min(tile_[0], s[0]),
+                     std::min(tile_[1], s[1]),
+                     std::min(tile_[2], s[2]));
+    }
+
+    // Output positions of the tiles covering an output of size s
+
+    std::vector<vec3s> tiles( const vec3s& s ) const
+    {
+        vec3s t = tile_shape(s);
+
+        std::vector<vec3s> r;
+
+        for ( auto& z: spans(s[2], t[2], 0, s[2]) )
+            for ( auto& y: spans(s[1], t[1], 0, s[1]) )
+                for ( auto& x: spans(s[0], t[0], 0, s[0]) )
+                {
+                    r.push_back(vec3s(x.from, y.from, z.from));
+                }
+
+        return r;
+    }
+
+    // The part (at from, of size s) of the mirrored volume of size vs
+    // read by the tiles of the region of size rs at ro of the output,
+    // e.g. to read it ahead
+
+    void input_region( const vec3s& vs, const vec3s& ro, const vec3s& rs,
+                       vec3s& from, vec3s& s ) const
+    {
+        vec3s fov = nets_[0]->fov();
+        vec3s os  = vs - fov + vec3s::one;
+        vec3s t   = tile_shape(os);
+
+        for ( std::size_t k = 0; k < 3; ++k )
+        {
+            std::vector<span> sp = spans(os[k], t[k], ro[k], ro[k] + rs[k]);
+
+            from[k] = sp.front().from;
+            s[k]    = sp.back().from + t[k] + fov[k] - 1 - from[k];
+        }
+    }
+
+    // Number of tiles kept in flight for an output of size s
+
+    std::size_t concurrency( const vec3s& s ) const
+    {
+        return lanes(s, tiles(s).size());
+    }
+
+    // A region of size rs at ro of the output of the network over the
+    // volume v, to be stored in out
+
+    struct region
+    {
+        const volume<double>* v  ;
+        vec3s                 ro ;
+        vec3s                 rs ;
+        cube<double>*         out;
+    };
+
+    // Processes several regions (of the same or of different volumes) at
+    // once: the tiles of all of them are claimed by the networks from a
+    // single queue, so the tiles of small regions are computed
+    // concurrently, as if they were of a single large one.
+
+    template<typename F>
+    void process( const std::vector<region>& regions, F f )
+    {
+        vec3s fov = nets_[0]->fov();
+
+        struct batch
+        {
+            const region*     r;
+            vec3s             is;
+            std::vector<span> sp[3];
+            std::size_t       first; // index of the first tile
+        };
+
+        std::vector<batch> bs(regions.size());
+
+        std::size_t n = 0;
+        std::size_t c = nets_.size();
+
+        for ( std::size_t i = 0; i < regions.size(); ++i )
+        {
+            const region& rg = regions[i];
+
+            vec3s os = rg.v->size() - fov + vec3s::one;
+            vec3s t  = tile_shape(os);
+
+            ZI_ASSERT(rg.ro[0]+rg.rs[0]<=os[0]);
+            ZI_ASSERT(rg.ro[1]+rg.rs[1]<=os[1]);
+            ZI_ASSERT(rg.ro[2]+rg.rs[2]<=os[2]);
+
+            rg.out->set_size(rg.rs[0], rg.rs[1], rg.rs[2]);
+
+            bs[i].r  = &rg;
+            bs[i].is = t + fov - vec3s::one;
+
+            for ( std::size_t k = 0; k < 3; ++k )
+            {
+                bs[i].sp[k] = spans(os[k], t[k], rg.ro[k], rg.ro[k] + rg.rs[k]);
+            }
+
+            bs[i].first = n;
+            n += bs[i].sp[0].size() * bs[i].sp[1].size() * bs[i].sp[2].size();
+
+            c = std::min(c, lanes(os, nets_.size()));
+        }
+
+        c = std::max<std::size_t>(1, std::min(c, n));
+
+        // Tile k: its region, where it starts and the part it owns
+
+        auto tile = [&](std::size_t k, vec3s& from, vec3s& b, vec3s& e)
+            -> const batch& {
+            std::size_t i = 0;
+            while ( i + 1 < bs.size() && bs[i+1].first <= k )
+            {
+                ++i;
+            }
+
+            const batch& bt = bs[i];
+            k -= bt.first;
+
+            const span* s[3] = { &bt.sp[0][k % bt.sp[0].size()],
+                                 &bt.sp[1][k / bt.sp[0].size() % bt.sp[1].size()],
+                                 &bt.sp[2][k / bt.sp[0].size() / bt.sp[1].size()] };
+            for ( std::size_t d = 0; d < 3; ++d )
+            {
+                from[d] = s[d]->from;
+                b[d]    = s[d]->begin;
+                e[d]    = s[d]->end;
+            }
+
+            return bt;
+        };
+
+        auto gather = [&](std::size_t k) {
+            vec3s from, b, e;
+            const batch& bt = tile(k, from, b, e);
+            unique_cube<double> in = pool<double>::get_unique(bt.is);
+            bt.r->v->gather(from, bt.is, dihedral(), in->memptr());
+            return in;
+        };
+
+        std::atomic<std::size_t> next(0);
+        std::exception_ptr       error;
+        std::mutex               error_mutex;
+
+        auto lane = [&](N* net) {
+            try
+            {
+                std::vector<unique_cube<double>> input(1);
+
+                std::size_t k = next++;
+                if ( k < n )
+                {
+                    input[0] = gather(k);
+                }
+
+                while ( k < n )
+                {
+                    std::size_t k2 = next++;
+                    std::future<unique_cube<double>> pending;
+
+                    if ( k2 < n )
+                    {
+                        pending = std::async(std::launch::async, gather, k2);
+                    }
+
+                    net->forward_async(input).get();
+
+                    const cube<double>& o = f(net->data());
+
+                    vec3s from, b, e;
+                    const region& rg = *tile(k, from, b, e).r;
+                    const vec3s&  ro = rg.ro;
+
+                    rg.out->subcube(b[0] - ro[0], b[1] - ro[1], b[2] - ro[2],
+                                    e[0] - 1 - ro[0], e[1] - 1 - ro[1],
+                                    e[2] - 1 - ro[2])
+                        = o.subcube(b[0] - from[0], b[1] - from[1],
+                                    b[2] - from[2], e[0] - 1 - from[0],
+                                    e[1] - 1 - from[1], e[2] - 1 - from[2]);
+
+                    if ( pending.valid() )
+                    {
+                        input[0] = pending.get();
+                    }
+
+                    k = k2;
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> g(error_mutex);
+                error = std::current_exception();
+                next  = n;
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for ( std::size_t i = 1; i < c; ++i )
+        {
+            threads.emplace_back(lane, nets_[i]);
+        }
+
+        lane(nets_[0]);
+
+        for ( auto& th: threads )
+        {
+            th.join();
+        }
+
+        if ( error )
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // The region of size rs at ro of the output of the network over the
+    // whole volume v (mirrored by the network's fov). The tiles have
+    // the same shape as for the whole output, the ones at the edges of
+    // the region reaching into the rest of the volume if needed, so
+    // processing the output region by region gives the same result,
+    // with the same transforms, as processing it at once.
+    //
+    // After the forward pass of each tile, f is given the data of the
+    // network, and returns the cube to store (e.g. turning the outputs
+    // into probabilities, in place).
+
+    template<typename F>
+    cube<double> process( const volume<double>& v, F f,
+                          const vec3s& ro, const vec3s& rs )
+    {
+        cube<double> r;
+        process(std::vector<region>{ region{ &v, ro, rs, &r } }, f);
+        return r;
+    }
+
+    template<typename F>
+    cube<double> process( const volume<double>& v, F f )
+    {
+        vec3s os = v.size() - nets_[0]->fov() + vec3s::one;
+        return process(v, f, vec3s::zero, os);
+    }
+
+    cube<double> process( const volume<double>& v )
+    {
+        return process(v, first_output);
+    }
+
+    static cube<double>& first_output( layered_network_data& d )
+    {
+        return *d.output(0);
+    }
+
+}; // class sliding_window
+
+}}} // namespace zi::znn::frontiers
@@ -0,0 +1,378 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <thread>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#include <zi/time.hpp>
+
+#include "../core/types.hpp"
+#include "../core/diskio.hpp"
+#include "../network/layered_network.hpp"
+#include "../network/layered_network_data.hpp"
+#include "../network/parallel_network.hpp"
+#include "sliding_window.hpp"
+
+namespace zi {
+namespace znn {
+namespace frontiers {
+
+// Picking the output tile shape for the whole volume inference.
+//
+// The cost of a forward pass is modelled from the sizes of the
+// transforms of all the layers (n log n, several times slower when a
+// size has a prime factor larger than 7, and a fixed overhead per
+// transform), and the memory from inference_bytes. Among the tiles
+// under the memory budget, the one with the lowest cost per output
+// voxel is picked. Only input sizes with small prime factors are
+// considered.
+//
+// The model can be checked on the actual machine: the best few
+// candidates are timed, and the fastest one is kept, cached in
+// <network file>.tile for the next runs with the same network file
+// and settings.
+
+inline bool is_smooth( std::size_t n )
+{
+    if ( n == 0 )
+    {
+        return false;
+    }
+
+    for ( std::size_t p: { 2, 3, 5, 7 } )
+    {
+        while ( n % p == 0 )
+        {
+            n /= p;
+        }
+    }
+
+    return n == 1;
+}
+
+// Sizes of the input featuremaps of the layers, for an input of size s
+// (as the layers of parallel_network compute them)
+
+inline std::vector<vec3s> layer_sizes( layered_network& net, const vec3s& s )
+{
+    std::vector<vec3s> r;
+
+    vec3s size   = s;
+    vec3s sparse = vec3s::one;
+
+    for ( std::size_t l = 0; l < net.num_layers(); ++l )
+    {
+        r.push_back(size);
+
+        const network_layer& nl = net.layer(l);
+
+        size = size - ( nl.filter_size()  - vec3s::one ) * sparse;
+        size = size - ( nl.pooling_size() - vec3s::one ) * sparse;
+        sparse *= nl.pooling_size();
+    }
+
+    return r;
+}
+
+// Modelled time of a forward pass over an input of size s (arbitrary
+// units), the transforms of the filters being cached
+
+inline double forward_cost( layered_network& net, const vec3s& s )
+{
+    static const double per_transform = 4096;
+    static const double slow_size     = 4;
+
+    std::vector<vec3s> sizes = layer_sizes(net, s);
+
+    double cost = 0;
+
+    for ( std::size_t l = 0; l < sizes.size(); ++l )
+    {
+        const vec3s& fs = sizes[l];
+
+        double n  = static_cast<double>(fs[0]) * fs[1] * fs[2];
+        double nc = static_cast<double>(fs[0] / 2 + 1) * fs[1] * fs[2];
+
+        double fft = n * std::log2(std::max(n, 2.0)) + per_transform;
+
+        for ( std::size_t k = 0; k < 3; ++k )
+        {
+            if ( !is_smooth(fs[k]) )
+            {
+                fft *= slow_size;
+            }
+        }
+
+        double ni = net.layer(l).num_inputs();
+        double no = net.layer(l).num_outputs();
+
+        cost += ( ni + no ) * fft + ni * no * nc;
+    }
+
+    return cost;
+}
+
+class tile_selector
+{
+public:
+    struct choice
+    {
+        vec3s       tile ; // of the output
+        double      cost ; // per output voxel
+        std::size_t bytes;
+    };
+
+    struct timing
+    {
+        vec3s  tile     ;
+        double per_voxel; // seconds per output voxel
+    };
+
+private:
+    layered_network& net_      ;
+    std::size_t      budget_   ; // bytes per tile
+    vec3s            max_tile_ ;
+    bool             inference_;
+
+private:
+    // Output widths along an axis whose input size is smooth
+
+    std::vector<std::size_t> widths( std::size_t k ) const
+    {
+        std::vector<std::size_t> r;
+        std::size_t fov = net_.fov()[k];
+
+        for ( std::size_t t = 1; t <= max_tile_[k]; ++t )
+        {
+            if ( is_smooth(t + fov - 1) )
+            {
+                r.push_back(t);
+            }
+        }
+
+        if ( r.empty() )
+        {
+            r.push_back(max_tile_[k]);
+        }
+
+        return r;
+    }
+
+public:
+    // budget is the memory per tile in flight
+
+    tile_selector( layered_network& net, std::size_t budget,
+                   const vec3s& max_tile = vec3s(256,256,256),
+                   bool inference = true )
+        : net_(net)
+        , budget_(budget)
+        , max_tile_(max_tile)
+        , inference_(inference)
+    {
+    }
+
+    // All the tiles under the budget, best first
+
+    std::vector<choice> candidates() const
+    {
+        layered_network_data data(net_);
+
+        vec3s fov = net_.fov();
+
+        std::vector<choice> r;
+
+        for ( std::size_t z: widths(2) )
+            for ( std::size_t y: widths(1) )
+                for ( std::size_t x: widths(0) )
+                {
+                    vec3s t(x,y,z);
+                    vec3s s = t + fov - vec3s::one;
+
+                    std::size_t bytes = inference_bytes(data, s, inference_);
+
+                    if ( bytes <= budget_ )
+                    {
+                        r.push_back(choice{ t, forward_cost(net_, s)
+                                    / ( x * y * z ), bytes });
+                    }
+                }
+
+        if ( r.empty() )
+        {
+            throw std::runtime_error("tile_selector: no tile fits in "
+                                     + std::to_string(budget_) + " bytes");
+        }
+
+        std::sort(r.begin(), r.end(), [](const choice& a, const choice& b) {
+                return a.cost < b.cost;
+            });
+
+        return r;
+    }
+
+    vec3s select() const
+    {
+        return candidates().front().tile;
+    }
+
+    // Times the forward pass of the best k candidates on net (a
+    // parallel_network over the same weights), fastest per output voxel
+    // first
+
+    std::vector<timing> time_candidates( parallel_network& net,
+                                         std::size_t k = 4 ) const
+    {
+        std::vector<choice> c = candidates();
+        c.resize(std::min(k, c.size()));
+
+        std::vector<timing> r;
+
+        for ( auto& x: c )
+        {
+            vec3s s = x.tile + net_.fov() - vec3s::one;
+
+            std::vector<cube<double>> input(1);
+            input[0].randu(s[0], s[1], s[2]);
+
+            // The first pass makes the plans and the filter transforms
+
+            net.forward(input);
+
+            zi::wall_timer timer;
+            net.forward(input);
+
+            r.push_back(timing{ x.tile, timer.elapsed<double>()
+                        / ( x.tile[0] * x.tile[1] * x.tile[2] ) });
+        }
+
+        std::sort(r.begin(), r.end(), [](const timing& a, const timing& b) {
+                return a.per_voxel < b.per_voxel;
+            });
+
+        return r;
+    }
+
+    // The fastest of the best k candidates
+
+    vec3s calibrate( parallel_network& net, std::size_t k = 4 ) const
+    {
+        return time_candidates(net, k).front().tile;
+    }
+
+}; // class tile_selector
+
+namespace detail {
+
+inline uint64_t tile_cache_magic()
+{
+    return 0x31454c49544e4e5aULL; // ZNNTILE1
+}
+
+inline std::vector<int64_t> tile_cache_key( const std::string& net_fname,
+                                            std::size_t budget,
+                                            const vec3s& max_tile )
+{
+    struct stat st;
+    if ( ::stat(net_fname.c_str(), &st) )
+    {
+        return std::vector<int64_t>();
+    }
+
+    std::vector<int64_t> key;
+
+    key.push_back(static_cast<int64_t>(st.st_size));
+    key.push_back(static_cast<int64_t>(st.st_mtime));
+    key.push_back(static_cast<int64_t>(budget));
+    key.push_back(static_cast<int64_t>(std::thread::hardware_concurrency()));
+
+    for ( std::size_t k = 0; k < 3; ++k )
+    {
+        key.push_back(static_cast<int64_t>(max_tile[k]));
+    }
+
+    return key;
+}
+
+} // namespace detail
+
+// The output tile for the network saved in net_fname (loaded as net),
+// under the memory budget per tile: calibrated on this machine the
+// first time, then read from <net_fname>.tile, or just modelled when
+// calibrate is false. The tile is at most max_tile, which should be
+// the size of the (smallest) volume, as the tiles of a volume are
+// clamped to its size.
+
+inline vec3s select_tile( const std::string& net_fname,
+                          layered_network& net, transfer_fn tf,
+                          std::size_t budget, bool calibrate = true,
+                          const vec3s& max_tile = vec3s(256,256,256) )
+{
+    tile_selector ts(net, budget, max_tile);
+
+    if ( !calibrate )
+    {
+        return ts.select();
+    }
+
+    std::vector<int64_t> key =
+        detail::tile_cache_key(net_fname, budget, max_tile);
+
+    std::string cache = net_fname + ".tile";
+
+    if ( !key.empty() )
+    {
+        std::ifstream in(cache.c_str(), std::ios::binary);
+
+        try
+        {
+            std::vector<int64_t> k;
+            if ( in && io::read<uint64_t>(in) == detail::tile_cache_magic() )
+            {
+                io::read(in, k);
+                if ( k == key )
+                {
+                    std::vector<int64_t> t;
+                    io::read(in, t);
+                    if ( t.size() == 3 )
+                    {
+                        return vec3s(t[0], t[1], t[2]);
+                    }
+                }
+            }
+        }
+        catch ( std::runtime_error& )
+        {
+        }
+    }
+
+    layered_network_data data(net);
+    parallel_network     pn(data, tf);
+    pn.set_inference(true);
+
+    vec3s tile = ts.calibrate(pn);
+
+    if ( !key.empty() )
+    {
+        std::ofstream out(cache.c_str(), std::ios::binary);
+
+        std::vector<int64_t> t{ static_cast<int64_t>(tile[0]),
+                                static_cast<int64_t>(tile[1]),
+                                static_cast<int64_t>(tile[2]) };
+
+        io::write(out, detail::tile_cache_magic());
+        io::write(out, key);
+        io::write(out, t);
+    }
+
+    return tile;
+}
+
+}}} // namespace zi::znn::frontiers
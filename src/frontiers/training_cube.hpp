@@ -5,17 +5,25 @@
 #include <functional>
 #include <memory>
 #include <vector>
+#include <deque>
 #include <mutex>
+#include <thread>
 #include <condition_variable>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
 
-#include <zi/async.hpp>
+#include <sys/stat.h>
+
+#include <zi/time.hpp>
 
 #include "../core/types.hpp"
 #include "../core/cube_utils.hpp"
 #include "../core/diskio.hpp"
-#include "../core/waiter.hpp"
 
 #include "utility.hpp"
+#include "chunked_volume.hpp"
 
 namespace zi {
 namespace znn {
@@ -36,6 +44,50 @@ inline cube<T> crop(const cube<T>& c, const vec3s& s, const vec3s& l)
     return c.subcube(s[0],s[1],s[2],s[0]+l[0]-1,s[1]+l[1]-1,s[2]+l[2]-1);
 }
 
+// r(x,y,z) is 1 when any voxel of v in the window of size w at
+// from + (x,y,z) is at least 1. Separable, one pass per dimension.
+
+inline cube<char> window_any(const volume<char>& v, const vec3s& from,
+                             const vec3s& n, const vec3s& w)
+{
+    cube<char> c = v.gather(from, n + w - vec3s::one);
+
+    cube<char> a(n[0], n[1]+w[1]-1, n[2]+w[2]-1);
+    for ( size_t z = 0; z < a.n_slices; ++z )
+        for ( size_t y = 0; y < a.n_cols; ++y )
+            for ( size_t x = 0; x < a.n_rows; ++x )
+            {
+                char v = 0;
+                for ( size_t k = 0; k < w[0] && !v; ++k )
+                    v = c(x+k, y, z) >= 1;
+                a(x,y,z) = v;
+            }
+
+    cube<char> b(n[0], n[1], n[2]+w[2]-1);
+    for ( size_t z = 0; z < b.n_slices; ++z )
+        for ( size_t y = 0; y < b.n_cols; ++y )
+            for ( size_t x = 0; x < b.n_rows; ++x )
+            {
+                char v = 0;
+                for ( size_t k = 0; k < w[1] && !v; ++k )
+                    v = a(x,y+k,z);
+                b(x,y,z) = v;
+            }
+
+    cube<char> r(n[0], n[1], n[2]);
+    for ( size_t z = 0; z < r.n_slices; ++z )
+        for ( size_t y = 0; y < r.n_cols; ++y )
+            for ( size_t x = 0; x < r.n_rows; ++x )
+            {
+                char v = 0;
+                for ( size_t k = 0; k < w[2] && !v; ++k )
+                    v = b(x,y,z+k);
+                r(x,y,z) = v;
+            }
+
+    return r;
+}
+
 struct sample
 {
     cube<double> image;
@@ -49,9 +101,12 @@ struct sample
 class training_cube
 {
 private:
-    cube<float> image;
-    cube<char>  label;
-    cube<char>  mask ;
+    // Mirrored virtually, either chunked files or raw ones mapped to
+    // memory (the image and the label stored as doubles)
+
+    std::unique_ptr<volume<double>> image_;
+    std::unique_ptr<volume<char>>   label_;
+    std::unique_ptr<volume<char>>   mask_ ;
 
     vec3s       size_       ;
     vec3s       in_sz_      ;
@@ -61,86 +116,238 @@ private:
     vec3s       margin_sz_  ;
     vec3s       set_sz_     ;
 
-private:
-    sample                  next_sample_    ;
-    bool                    has_next_sample_ = false;
-    std::mutex              mutex_          ;
-    std::condition_variable cv_             ;
+    // Locations (linear indices within the set) whose output patch
+    // has a masked voxel, and a positive label (pos_), or that are
+    // valid negatives (neg_)
 
-    bool                    next_sample_pos_ = false;
+    std::vector<uint32_t> pos_;
+    std::vector<uint32_t> neg_;
 
-    void prepare_sample()
-    {
-        guard g(mutex_);
+private:
+    // Also counts the masked positive and negative voxels (npos, nneg)
 
-        ZI_ASSERT(!has_next_sample_);
+    void index_slab(size_t z0, size_t z1,
+                    std::vector<uint32_t>& pos,
+                    std::vector<uint32_t>& neg,
+                    size_t& npos, size_t& nneg) const
+    {
+        vec3s from = half_in_sz_ - half_out_sz_;
+        from[2] += z0;
 
-        while (1)
-        {
-            vec3s loc = vec3s(half_in_sz_[0] + (rand() % set_sz_[0]),
-                              half_in_sz_[1] + (rand() % set_sz_[1]),
-                              half_in_sz_[2] + (rand() % set_sz_[2]));
+        vec3s n(set_sz_[0], set_sz_[1], z1 - z0);
 
-            cube<char>  cmask  = crop(mask , loc - half_out_sz_, out_sz_ );
+        cube<char> m = window_any(*mask_ , from, n, out_sz_);
+        cube<char> l = window_any(*label_, from, n, out_sz_);
 
-            if ( cmask.max() < 1 ) continue;
+        vec3s center = half_in_sz_;
+        center[2] += z0;
 
-            cube<char>  clabel = crop(label, loc - half_out_sz_, out_sz_ );
+        cube<char> cm = mask_ ->gather(center, n);
+        cube<char> cl = label_->gather(center, n);
 
-            if ( next_sample_pos_ )
+        for ( size_t i = 0; i < cm.n_elem; ++i )
+        {
+            if ( cm.memptr()[i] )
             {
-                if ( clabel.max() < 1 ) continue;
+                if ( cl.memptr()[i] )
+                    ++npos;
+                else
+                    ++nneg;
             }
-            else
-            {
-                if ( out_sz_ == vec3s::one )
+        }
+
+        // With a single output voxel a negative has to have a negative
+        // label, otherwise any location with a masked voxel will do
+
+        bool single = out_sz_ == vec3s::one;
+
+        for ( size_t z = 0; z < n[2]; ++z )
+            for ( size_t y = 0; y < n[1]; ++y )
+                for ( size_t x = 0; x < n[0]; ++x )
                 {
-                    if ( clabel(0,0,0) > 0.5 ) continue;
+                    if ( !m(x,y,z) ) continue;
+
+                    uint32_t i = static_cast<uint32_t>
+                        (x + set_sz_[0] * ( y + set_sz_[1] * ( z + z0 )));
+
+                    if ( l(x,y,z) )
+                    {
+                        pos.push_back(i);
+                    }
+
+                    if ( !single || !l(x,y,z) )
+                    {
+                        neg.push_back(i);
+                    }
                 }
-            }
+    }
 
-            next_sample_pos_ = !next_sample_pos_;
+    // The slabs of z are indexed in parallel, and concatenated in order
+    // so that the index doesn't depend on the number of threads
 
-            cube<float> fimage = crop(image, loc - half_in_sz_ , in_sz_ );
+    void build_index()
+    {
+        size_t nz = set_sz_[2];
+        size_t nt = std::max<size_t>(1, std::thread::hardware_concurrency());
+        nt = std::min(nt, nz);
 
-            // TEMP
-            //cmask.fill(1);
+        std::vector<std::vector<uint32_t>> pos(nt), neg(nt);
+        std::vector<size_t> npos(nt), nneg(nt);
+        std::vector<std::thread> threads;
 
-            if ( rand() % 2 )
-            {
-                flip_x_dim(clabel); flip_x_dim(cmask); flip_x_dim(fimage);
-            }
+        for ( size_t t = 0; t < nt; ++t )
+        {
+            threads.emplace_back([&,t]() {
+                    index_slab(nz * t / nt, nz * ( t + 1 ) / nt,
+                               pos[t], neg[t], npos[t], nneg[t]);
+                });
+        }
 
-            if ( rand() % 2 )
+        for ( auto& t: threads )
+        {
+            t.join();
+        }
+
+        pos_.clear();
+        neg_.clear();
+        n_pos = n_neg = 0;
+
+        for ( size_t t = 0; t < nt; ++t )
+        {
+            pos_.insert(pos_.end(), pos[t].begin(), pos[t].end());
+            neg_.insert(neg_.end(), neg[t].begin(), neg[t].end());
+            n_pos += npos[t];
+            n_neg += nneg[t];
+        }
+    }
+
+    // The index is cached in <fname>.index, valid as long as the
+    // patch sizes and the label and mask files are the same
+
+    static uint64_t index_magic()
+    {
+        return 0x32584449564e4e5aULL; // ZNNVIDX2
+    }
+
+    static std::vector<int64_t> index_key(const std::string& fname,
+                                          const vec3s& in_sz,
+                                          const vec3s& out_sz)
+    {
+        std::vector<int64_t> key;
+
+        for ( size_t i = 0; i < 3; ++i )
+        {
+            key.push_back(static_cast<int64_t>(in_sz[i]));
+            key.push_back(static_cast<int64_t>(out_sz[i]));
+        }
+
+        for ( auto ext: { ".label", ".mask" } )
+        {
+            struct stat st;
+            if ( ::stat((fname + ext).c_str(), &st) )
             {
-                flip_y_dim(clabel); flip_y_dim(cmask); flip_y_dim(fimage);
+                return std::vector<int64_t>();
             }
+            key.push_back(static_cast<int64_t>(st.st_size));
+            key.push_back(static_cast<int64_t>(st.st_mtime));
+        }
+
+        return key;
+    }
+
+    bool read_index(const std::string& fname,
+                    const std::vector<int64_t>& key)
+    {
+        std::ifstream in((fname + ".index").c_str(), std::ios::binary);
+
+        if ( !in || key.empty() )
+        {
+            return false;
+        }
 
-            if ( rand() % 2 )
+        try
+        {
+            std::vector<int64_t> k;
+            if ( io::read<uint64_t>(in) != index_magic() )
             {
-                flip_z_dim(clabel); flip_z_dim(cmask); flip_z_dim(fimage);
+                return false;
             }
 
-            if ( cmask.n_rows == cmask.n_cols )
+            io::read(in, k);
+            if ( k != key )
             {
-                if ( rand() % 2 )
-                {
-                    rotate_xy(clabel); rotate_xy(cmask); rotate_xy(fimage);
-                }
+                return false;
             }
 
-            next_sample_= { cube_cast<double>(fimage),
-                            cube_cast<double>(clabel),
-                            std::move(cmask),
-                            w_pos,
-                            w_neg };
+            io::read(in, pos_);
+            io::read(in, neg_);
+            io::read(in, n_pos);
+            io::read(in, n_neg);
+        }
+        catch ( std::runtime_error& )
+        {
+            pos_.clear();
+            neg_.clear();
+            return false;
+        }
 
-            has_next_sample_ = true;
-            cv_.notify_one();
+        return true;
+    }
+
+    void write_index(const std::string& fname,
+                     const std::vector<int64_t>& key) const
+    {
+        if ( key.empty() )
+        {
             return;
         }
+
+        std::ofstream out((fname + ".index").c_str(), std::ios::binary);
+
+        io::write(out, index_magic());
+        io::write(out, key);
+        io::write(out, pos_);
+        io::write(out, neg_);
+        io::write(out, n_pos);
+        io::write(out, n_neg);
     }
 
+public:
+    // Picks a location uniformly among the ones of the requested class
+    // (or the other one, if there are none), and a random flip/rotation.
+    // Only reads the volumes, so any number of threads can sample
+    // concurrently, each with its own random number generator.
+
+    sample get_sample(std::mt19937& rng, bool positive) const
+    {
+        const std::vector<uint32_t>& idx =
+            ( positive && pos_.size() ) || neg_.empty() ? pos_ : neg_;
+
+        size_t i = idx[rng() % idx.size()];
+
+        vec3s loc = vec3s(half_in_sz_[0] + i % set_sz_[0],
+                          half_in_sz_[1] + i / set_sz_[0] % set_sz_[1],
+                          half_in_sz_[2] + i / set_sz_[0] / set_sz_[1]);
+
+        // Augmentation, applied while gathering the patches
+
+        dihedral d;
+        d.flip_x = rng() % 2;
+        d.flip_y = rng() % 2;
+        d.flip_z = rng() % 2;
+
+        if ( out_sz_[0] == out_sz_[1] && in_sz_[0] == in_sz_[1] )
+        {
+            d.rotate = rng() % 2;
+        }
+
+        return { image_->gather(loc - half_in_sz_ , in_sz_ , d),
+                 cube_cast<double>(label_->gather(loc - half_out_sz_,
+                                                  out_sz_, d)),
+                 mask_ ->gather(loc - half_out_sz_, out_sz_, d),
+                 w_pos,
+                 w_neg };
+    }
 
 public:
     double      w_pos = 0;
@@ -160,39 +367,15 @@ public:
 
         std::cout << "Loading: " << fname << " ... " << std::flush;
 
-        auto sizefn = fname + ".size";
-        std::ifstream sizef(sizefn.c_str());
-
-        zi::vl::vec<int,3> s;
-        io::read(sizef, s);
+        vec3s s = volume_size(fname);
 
         std::cout << s;
 
-        cube<double> tmp(s[0],s[1],s[2]);
-
-        auto imagefn = fname + ".image";
-        std::ifstream imagef(imagefn.c_str());
-        io::read(imagef, tmp);
-
-        image = cube_cast<float>(tmp);
-        image = mirror_cube(image, fov);
-
-        auto labelfn = fname + ".label";
-        std::ifstream labelf(labelfn.c_str());
-        io::read(labelf, tmp);
+        image_ = open_volume<double,double>(fname + ".image", s, fov);
+        label_ = open_volume<char  ,double>(fname + ".label", s, fov);
+        mask_  = open_volume<char  ,char  >(fname + ".mask" , s, fov);
 
-        label = cube_cast<char>(tmp);
-        label = mirror_cube(label, fov);
-
-        mask.resize(s[0], s[1], s[2]);
-
-        auto maskfn = fname + ".mask";
-        std::ifstream maskf(maskfn.c_str());
-        io::read(maskf, mask);
-
-        mask = mirror_cube(mask, fov);
-
-        size_ = size(image);
+        size_ = image_->size();
 
         half_in_sz_  = in_sz_/vec3i(2,2,2);
         half_out_sz_ = out_sz_/vec3i(2,2,2);
@@ -205,50 +388,61 @@ public:
 
         set_sz_ = size_ - margin_sz_ - half_in_sz_;
 
-        for ( size_t z = half_in_sz_[2]; z < half_in_sz_[2]+set_sz_[2]; ++z )
-            for ( size_t y = half_in_sz_[1]; y < half_in_sz_[1]+set_sz_[1]; ++y )
-                for ( size_t x = half_in_sz_[0]; x < half_in_sz_[0]+set_sz_[0]; ++x )
-                {
-                    if ( mask(x,y,z) )
-                    {
-                        if ( label(x,y,z) )
-                            ++n_pos;
-                        else
-                            ++n_neg;
-                    }
-                }
-
-        w_pos = w_neg = n_pos + n_neg;
-
-        w_pos /= 2 * n_pos;
-        w_neg /= 2 * n_neg;
+        if ( set_sz_[0] * set_sz_[1] * set_sz_[2] > UINT32_MAX )
+        {
+            throw std::runtime_error("training_cube: volume too large");
+        }
 
-        zi::async::async(&training_cube::prepare_sample, this);
+        std::vector<int64_t> key = index_key(fname, in_sz, out_sz);
 
-        std::cout << " DONE" << std::endl;
-    }
-
-    sample get_sample()
-    {
-        guard g(mutex_);
+        if ( read_index(fname, key) )
+        {
+            std::cout << " (cached index)";
+        }
+        else
+        {
+            build_index();
+            write_index(fname, key);
+        }
 
-        while (!has_next_sample_)
+        if ( pos_.empty() && neg_.empty() )
         {
-            cv_.wait(g);
+            throw std::runtime_error("training_cube: no valid samples in "
+                                     + fname);
         }
 
-        has_next_sample_ = false;
-        zi::async::async(&training_cube::prepare_sample, this);
+        w_pos = w_neg = n_pos + n_neg;
+
+        w_pos /= 2 * n_pos;
+        w_neg /= 2 * n_neg;
 
-        return std::move(next_sample_);
+        std::cout << " DONE" << std::endl;
     }
 };
 
+// The samples are prepared ahead of time by a number of producer
+// threads, each drawing from random cubes with its own random number
+// generator (alternating between positive and negative samples), into a
+// bounded queue. The time the consumer spends waiting on an empty queue
+// is accumulated, so that data loading showing up on the critical path
+// can be noticed (see reporter::data_wait).
+
 class training_cubes
 {
 private:
     std::vector<std::unique_ptr<training_cube>> cubes_;
 
+    std::deque<sample>       queue_    ;
+    size_t                   depth_    ;
+    bool                     done_     = false;
+    std::mutex               mutex_    ;
+    std::condition_variable  not_empty_;
+    std::condition_variable  not_full_ ;
+    std::vector<std::thread> threads_  ;
+
+    double                   starved_  = 0;
+    size_t                   stalls_   = 0;
+
 // private:
 //     void load_training_cube( std::unique_ptr<training_cube>& tc,
 //                              std::string fname,
@@ -261,22 +455,112 @@ private:
 //         w.one_done();
 //     }
 
+private:
+    void produce(unsigned seed)
+    {
+        std::mt19937 rng(seed);
+        bool positive = false;
+
+        while (1)
+        {
+            sample s = cubes_[rng() % cubes_.size()]->get_sample(rng, positive);
+            positive = !positive;
+
+            std::unique_lock<std::mutex> g(mutex_);
+            while ( queue_.size() >= depth_ && !done_ )
+            {
+                not_full_.wait(g);
+            }
+
+            if ( done_ )
+            {
+                return;
+            }
+
+            queue_.push_back(std::move(s));
+            not_empty_.notify_one();
+        }
+    }
+
 public:
     training_cubes(const std::string& fname,
                    const std::vector<size_t> nums,
                    const vec3s& in_sz,
-                   const vec3s& out_sz)
+                   const vec3s& out_sz,
+                   size_t depth = 16,
+                   size_t num_threads = 2)
+        : depth_(depth)
     {
+        ZI_ASSERT(depth>0);
+        ZI_ASSERT(num_threads>0);
+
         for ( auto a: nums )
         {
             cubes_.emplace_back(
                 new training_cube(fname + std::to_string(a), in_sz, out_sz));
         }
+
+        std::random_device rd;
+        for ( size_t i = 0; i < num_threads; ++i )
+        {
+            threads_.emplace_back(&training_cubes::produce, this, rd());
+        }
+    }
+
+    ~training_cubes()
+    {
+        {
+            std::unique_lock<std::mutex> g(mutex_);
+            done_ = true;
+            not_full_.notify_all();
+        }
+
+        for ( auto& t: threads_ )
+        {
+            t.join();
+        }
     }
 
+    training_cubes(const training_cubes&) = delete;
+    training_cubes& operator=(const training_cubes&) = delete;
+
     sample get_sample()
     {
-        return cubes_[rand()%cubes_.size()]->get_sample();
+        std::unique_lock<std::mutex> g(mutex_);
+
+        if ( queue_.empty() )
+        {
+            zi::wall_timer timer;
+            while ( queue_.empty() )
+            {
+                not_empty_.wait(g);
+            }
+            starved_ += timer.elapsed<double>();
+            ++stalls_;
+        }
+
+        sample s = std::move(queue_.front());
+        queue_.pop_front();
+        not_full_.notify_one();
+
+        return s;
+    }
+
+    // Seconds get_sample() spent waiting on an empty queue since the
+    // last call, and the number of times it had to wait
+
+    double take_starved_time()
+    {
+        std::unique_lock<std::mutex> g(mutex_);
+        double r = starved_;
+        starved_ = 0;
+        return r;
+    }
+
+    size_t stalls()
+    {
+        std::unique_lock<std::mutex> g(mutex_);
+        return stalls_;
     }
 };
 
@@ -2,65 +2,24 @@
 
 #include <string>
 #include <fstream>
+#include <cstddef>
+#include <memory>
+#include <vector>
 
 #include "../core/cube_utils.hpp"
 #include "../core/types.hpp"
 #include "../core/diskio.hpp"
 
+#include "chunked_volume.hpp"
+#include "sliding_window.hpp"
+
+#include "../network/parallel_network.hpp"
+
 namespace zi {
 namespace znn {
 namespace frontiers {
 
 
-template<typename T>
-inline void flip_x_dim( cube<T>& c )
-{
-    cube<T> r = c;
-    for ( size_t x = 0; x < c.n_rows; ++x )
-    {
-        r(arma::span(x), arma::span::all, arma::span::all) =
-            c(arma::span(c.n_rows-1-x), arma::span::all, arma::span::all);
-    }
-    c = std::move(r);
-}
-
-template<typename T>
-inline void flip_y_dim( cube<T>& c )
-{
-    cube<T> r = c;
-    for ( size_t y = 0; y < c.n_cols; ++y )
-    {
-        r(arma::span::all, arma::span(y), arma::span::all) =
-            c(arma::span::all, arma::span(c.n_cols-1-y), arma::span::all);
-    }
-    c = std::move(r);
-}
-
-template<typename T>
-inline void flip_z_dim( cube<T>& c )
-{
-    cube<T> r = c;
-    for ( size_t z = 0; z < c.n_slices; ++z )
-    {
-        r.slice(z) = c.slice(c.n_slices-1-z);
-    }
-    c = std::move(r);
-}
-
-template<typename T>
-inline void rotate_xy( cube<T>& c )
-{
-    cube<T> r = c;
-    for ( size_t z = 0; z < c.n_slices; ++z )
-        for ( size_t y = 0; y < c.n_cols; ++y )
-            for ( size_t x = 0; x < c.n_rows; ++x )
-                r(x,y,z) = c(c.n_rows-1-y,x,z);
-
-    c = std::move(r);
-}
-
-
-
 template<typename T>
 cube<T> mirror_cube( const cube<T>& c, const vec3s& fov)
 {
@@ -121,9 +80,8 @@ cube<T> load_cube( const std::string& fname )
 
     cube<double> ret(s[0],s[1],s[2]);
 
-    auto imagefn = fname + ".image";
-    std::ifstream imagef(imagefn.c_str());
-    io::read(imagef, ret);
+    io::buffered_reader imagef(fname + ".image");
+    imagef >> ret;
 
     return ret;
 }
@@ -137,56 +95,113 @@ void save_cube( const std::string& fname, const cube<T>& c )
     zi::vl::vec<int,3> s(c.n_rows, c.n_cols, c.n_slices);
     io::write(sizef, s);
 
-    auto imagefn = fname + ".image";
-    std::ofstream imagef(imagefn.c_str());
-    io::write(imagef, c);
+    io::buffered_writer imagef(fname + ".image");
+    imagef << c;
+    imagef.close();
+}
+
+
+// The probabilities (softmax) of the two outputs of a cross entropy
+// network, in place of the first one
+
+inline cube<double>& cross_entropy_output( layered_network_data& d )
+{
+    cube<double>& a = *d.output(0);
+    cube<double>& b = *d.output(1);
+
+    a = exp(a);
+    b = exp(b);
+    b += a;
+    pairwise_div(a, b);
+
+    return a;
 }
 
+// The output is computed and saved slab by slab, slab_depth sections
+// at a time (by default the depth of a tile), so that only one slab of
+// the output is ever in memory. The input is read as the tiles need
+// it, each slab's tiles reaching fov / 2 into the neighbouring slabs,
+// and mirrored only at the boundary of the volume.
 
 template<typename N>
-void process_whole_cube( const std::string& ifname,
+void process_whole_cube( sliding_window<N>& sw,
+                         const std::string& ifname,
                          const std::string& ofname,
-                         N& net,
-                         size_t cube_width = 32,
-                         bool cross_entropy = true)
+                         bool cross_entropy = true,
+                         size_t slab_depth = 0)
 {
-    auto c = load_cube<double>(ifname);
-    auto r = c;
+    vec3s os = volume_size(ifname);
 
-    c = mirror_cube(c, net.fov());
+    auto c = open_volume<double>(ifname + ".image", os, sw.fov());
 
-    vec3s os = size(r);
-    vec3s fov = net.fov();
+    if ( slab_depth == 0 )
+    {
+        slab_depth = sw.tile_shape(os)[2];
+    }
 
-    std::vector<cube<double>> input(1);
+    {
+        auto sizefn = ofname + ".size";
+        std::ofstream sizef(sizefn.c_str());
 
-    for ( std::size_t z = 0; z < os[2]; z += cube_width )
-        for ( std::size_t y = 0; y < os[1]; y += cube_width )
-            for ( std::size_t x = 0; x < os[0]; x += cube_width )
-            {
-                size_t zi = std::min(z + cube_width, os[2]);
-                size_t yi = std::min(y + cube_width, os[1]);
-                size_t xi = std::min(x + cube_width, os[0]);
+        zi::vl::vec<int,3> s(os[0], os[1], os[2]);
+        io::write(sizef, s);
+    }
 
-                input[0] = c.subcube(x,y,z,xi+fov[0]-2,yi+fov[1]-2,zi+fov[2]-1);
+    io::buffered_writer imagef(ofname + ".image");
 
-                auto output = net.forward(input);
+    for ( size_t z = 0; z < os[2]; z += slab_depth )
+    {
+        vec3s from(0, 0, z);
+        vec3s s(os[0], os[1], std::min(slab_depth, os[2] - z));
 
-                if ( cross_entropy )
-                {
-                    output[0] = exp(output[0]);
-                    output[1] = exp(output[1]);
-                    output[1] += output[0];
-                    pairwise_div( output[0], output[1] );
-                }
+        imagef << ( cross_entropy
+                    ? sw.process(*c, cross_entropy_output, from, s)
+                    : sw.process(*c, sw.first_output, from, s) );
+    }
 
-                r.subcube(x,y,z,xi-1,yi-1,zi-1) = output[0];
+    imagef.close();
+}
+
+template<typename N>
+void process_whole_cube( const std::string& ifname,
+                         const std::string& ofname,
+                         N& net,
+                         size_t cube_width = 32,
+                         bool cross_entropy = true)
+{
+    sliding_window<N> sw(net, vec3s(cube_width, cube_width, cube_width));
+    process_whole_cube(sw, ifname, ofname, cross_entropy);
+}
 
-                std::cout << vec3s(x,y,z) << std::endl;
-            }
+// With up to concurrent_tiles tiles in flight, each on its own
+// parallel_network (in the inference mode) over the weights of net,
+// using at most about max_bytes (0 for no limit)
+
+inline void process_whole_cube( const std::string& ifname,
+                                const std::string& ofname,
+                                layered_network& net,
+                                transfer_fn tf,
+                                const vec3s& tile,
+                                size_t concurrent_tiles,
+                                size_t max_bytes = 0,
+                                bool cross_entropy = true)
+{
+    std::vector<std::unique_ptr<layered_network_data>> data;
+    std::vector<std::unique_ptr<parallel_network>>     nets;
+    std::vector<parallel_network*>                     lanes;
+
+    for ( size_t i = 0; i < std::max<size_t>(concurrent_tiles, 1); ++i )
+    {
+        data.emplace_back(new layered_network_data(net));
+        nets.emplace_back(new parallel_network(*data.back(), tf));
+        nets.back()->set_inference(true);
+        lanes.push_back(nets.back().get());
+    }
 
-    save_cube( ofname, r );
+    sliding_window<parallel_network>
+        sw(lanes, tile, max_bytes);
 
+    process_whole_cube(sw, ifname, ofname, cross_entropy);
 }
 
 
@@ -19,6 +19,8 @@
 #include "frontiers/cross_entropy_loss.hpp"
 #include "frontiers/utility.hpp"
 #include "frontiers/reporter.hpp"
+#include "frontiers/tile_size.hpp"
+#include "frontiers/inference_pipeline.hpp"
 
 #include "pooling/pooling_filter_2.hpp"
 #include "core/tube_iterator.hpp"
@@ -32,6 +34,7 @@
 #include "network/simple_network.hpp"
 #include "network/simple_network_two.hpp"
 #include "network/parallel_network.hpp"
+#include "network/model_file.hpp"
 #include "transfer_fn/transfer_fn.hpp"
 
 #include "convolution/sparse_convolve.hpp"
@@ -63,11 +66,24 @@ int main()
 
     if (1)
     {
-        std::ifstream netf("frontiers_sigmoid_3_hidden_layers_data_09Jun2");
+        std::string netfname = "frontiers_sigmoid_3_hidden_layers_data_09Jun2";
 
-        layered_network net1(netf); // 28
-        layered_network_data nld(net1);
-        parallel_network snet(nld, make_transfer_fn<sigmoid>());
+        layered_network net1 = load_network(netfname); // 28
+
+        // 8GB for 4 tiles in flight
+
+        size_t concurrent_tiles = 4;
+        size_t max_bytes        = std::size_t(8) << 30;
+
+        // The tasks of the tiles in flight are admitted within the same
+        // memory
+
+        zi::async::set_memory_budget(max_bytes);
+
+        // The volumes are read, computed and saved slab by slab, by
+        // separate stages, overlapped
+
+        std::vector<frontiers::inference_job> jobs;
 
         for ( int i = 13; i <= 40; ++i )
         {
@@ -76,9 +92,33 @@ int main()
 
             std::string ofname = "./test/" + std::to_string(i);
 
-            frontiers::process_whole_cube(ifname, ofname, snet, 100, false);
+            jobs.push_back({ ifname, ofname });
+        }
+
+        // No larger than the smallest volume, which would clamp it to
+        // a shape that wasn't scored
+
+        vec3s max_tile(256,256,256);
+
+        for ( auto& j: jobs )
+        {
+            vec3s s = frontiers::volume_size(j.input);
+            for ( std::size_t k = 0; k < 3; ++k )
+            {
+                max_tile[k] = std::min(max_tile[k], s[k]);
+            }
         }
 
+        vec3s tile = frontiers::select_tile(netfname, net1,
+                                            make_transfer_fn<sigmoid>(),
+                                            max_bytes / concurrent_tiles,
+                                            true, max_tile);
+
+        std::cout << "tile " << tile << std::endl;
+
+        frontiers::process_volumes(jobs, net1, make_transfer_fn<sigmoid>(),
+                                   tile, concurrent_tiles, max_bytes, false);
+
         return 0;
     }
 
@@ -88,10 +128,9 @@ int main()
 
         layered_network net1(1); // 28
 
-        std::ifstream sn("frontiers_sigmoid_3_hidden_layers_data_09Jun2");
-        if ( sn )
+        if ( std::ifstream("frontiers_sigmoid_3_hidden_layers_data_09Jun2") )
         {
-            net1.read(sn);
+            net1 = load_network("frontiers_sigmoid_3_hidden_layers_data_09Jun2");
             // net1.layer(0).learning_rate() = 0.05;
             // net1.layer(1).learning_rate() = 0.05;
             net1.pop_layer();
@@ -118,6 +157,11 @@ int main()
         layered_network_data nld(net1);
         parallel_network snet(nld, make_transfer_fn<sigmoid>());
 
+        // The tasks of a pass are held back past 8GB of (estimated)
+        // allocations
+
+        zi::async::set_memory_budget(std::size_t(8) << 30);
+
 
         frontiers::reporter reporter
             ("frontiers_sigmoid_4_hidden_layers_data_09Jun.report", 10000);
@@ -128,9 +172,10 @@ int main()
         while (niter < 10000000 )
         {
             frontiers::sample s = tc.get_sample();
+            reporter.data_wait(tc.take_starved_time());
 
             std::vector<cube<double>> input;
-            input.push_back(s.image);
+            input.push_back(std::move(s.image));
 
             std::vector<cube<double>> guess = snet.forward(input);
 
@@ -143,8 +188,7 @@ int main()
             if ( reporter.report(std::get<2>(x), std::get<1>(x),
                                  std::get<0>(x)) )
             {
-                std::ofstream sn("frontiers_sigmoid_4_hidden_layers_data_09Jun");
-                net1.write(sn);
+                save_model("frontiers_sigmoid_4_hidden_layers_data_09Jun", net1);
             }
 
             snet.backward(grad);
@@ -154,8 +198,7 @@ int main()
         }
 
         {
-            std::ofstream sn("frontiers_sigmoid_4_hidden_layers_data_09Jun");
-            net1.write(sn);
+            save_model("frontiers_sigmoid_4_hidden_layers_data_09Jun", net1);
             reporter.force_save();
         }
 
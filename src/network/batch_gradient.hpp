@@ -0,0 +1,166 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+
+#include "layered_network.hpp"
+#include "layered_network_data.hpp"
+#include "../core/cube_pool.hpp"
+#include "../core/trace.hpp"
+
+
+namespace zi {
+namespace znn {
+
+// Accumulates the gradients of a minibatch. Each sample of the batch is
+// processed by its own network (with its own featuremaps), and all of
+// them add their contributions here. The filter gradients are summed in
+// the frequency domain, so that only a single inverse transform per
+// filter is needed per batch. The averaged gradients end up in a
+// layered_network_data of their own, which is used for the weight update.
+
+class batch_gradient
+{
+private:
+    struct filter_sum
+    {
+        std::mutex            mutex   ;
+        size_t                received = 0;
+        unique_cube<complex>  spectrum;
+        unique_cube<double>   spatial ;
+    };
+
+    struct bias_sum
+    {
+        std::mutex            mutex   ;
+        size_t                received = 0;
+        double                sum      = 0;
+    };
+
+    struct layer_sums
+    {
+        std::vector<bias_sum>                dEdB;
+        std::vector<std::vector<filter_sum>> dEdW;
+    };
+
+private:
+    layered_network_data     data_  ;
+    std::vector<layer_sums>  layers_;
+    size_t                   size_ = 1;
+
+private:
+    // Same lock-swap accumulation as in the network layers, the
+    // additions are performed outside of the critical section. Returns
+    // the sum once all the samples of the batch have contributed.
+
+    template<typename T>
+    unique_cube<T> add(filter_sum& s, unique_cube<T>& sum, unique_cube<T> x)
+    {
+        {
+            trace::scope ts(trace::accumulate);
+
+            while (1)
+            {
+                unique_cube<T> old;
+                {
+                    guard g(s.mutex);
+                    if ( sum )
+                    {
+                        old = std::move(sum);
+                    }
+                    else
+                    {
+                        sum = std::move(x);
+                        ++s.received;
+                        break;
+                    }
+                }
+                *x += *old;
+            }
+        }
+
+        guard g(s.mutex);
+        if ( s.received == size_ )
+        {
+            s.received = 0;
+            return std::move(sum);
+        }
+
+        return unique_cube<T>();
+    }
+
+public:
+    batch_gradient( layered_network& net )
+        : data_(net)
+        , layers_(net.num_layers())
+    {
+        for ( size_t l = 0; l < layers_.size(); ++l )
+        {
+            layers_[l].dEdB = std::vector<bias_sum>(net.layer(l).num_outputs());
+            layers_[l].dEdW.resize(net.layer(l).num_inputs());
+
+            for ( auto& i: layers_[l].dEdW )
+            {
+                i = std::vector<filter_sum>(net.layer(l).num_outputs());
+            }
+        }
+    }
+
+    // Has to be called before each batch with the number of samples
+    // that will contribute (the last batch of an epoch can be smaller)
+
+    void reset( size_t n )
+    {
+        ZI_ASSERT(n>0);
+        size_ = n;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    unique_cube<complex> add_dEdW_fft(size_t l, size_t i, size_t j,
+                                      unique_cube<complex> x)
+    {
+        filter_sum& s = layers_[l].dEdW[i][j];
+        return add(s, s.spectrum, std::move(x));
+    }
+
+    unique_cube<double> add_dEdW(size_t l, size_t i, size_t j,
+                                 unique_cube<double> x)
+    {
+        filter_sum& s = layers_[l].dEdW[i][j];
+        return add(s, s.spatial, std::move(x));
+    }
+
+    void add_dEdB(size_t l, size_t p, double x)
+    {
+        bias_sum& s = layers_[l].dEdB[p];
+
+        guard g(s.mutex);
+        s.sum += x;
+
+        if ( ++s.received == size_ )
+        {
+            data_.dEdB(l,p) = s.sum / size_;
+            s.sum = 0;
+            s.received = 0;
+        }
+    }
+
+    // Where the (averaged) filter gradients are to be stored
+
+    unique_cube<double>& dEdW(size_t l, size_t i, size_t j)
+    {
+        return data_.dEdW(l,i,j);
+    }
+
+    void apply()
+    {
+        data_.apply_grads();
+    }
+
+}; // class batch_gradient
+
+}} // namespace zi::znn
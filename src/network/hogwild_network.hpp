@@ -0,0 +1,125 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <functional>
+
+#include <zi/async.hpp>
+
+#include "layered_network.hpp"
+#include "layered_network_data.hpp"
+#include "parallel_network.hpp"
+#include "../core/striped_locks.hpp"
+#include "../transfer_fn/transfer_fn.hpp"
+
+
+namespace zi {
+namespace znn {
+
+// Hogwild style training. Each replica is a parallel_network with its
+// own featuremaps, running on its own thread pool, and all of them
+// train the same layered_network. The replicas read the weights without
+// any synchronization while others update them. With update locks
+// enabled, the updates of each filter are serialized (striped locks);
+// otherwise the updates are lock-free as well.
+//
+// Each replica caches the transforms of the filters until its own
+// update, so it sees the updates of the others with a delay of up to
+// one iteration.
+
+class hogwild_network
+{
+public:
+    // Performs a single training iteration on the given replica,
+    // returning false when the replica should stop
+
+    typedef std::function<bool(parallel_network&, size_t)> iteration_fn;
+
+private:
+    struct replica
+    {
+        std::unique_ptr<zi::async::async_thread_pool> pool;
+        std::unique_ptr<layered_network_data>         data;
+        std::unique_ptr<parallel_network>             net ;
+    };
+
+private:
+    layered_network&               net_     ;
+    std::unique_ptr<striped_locks> locks_   ;
+    std::vector<replica>           replicas_;
+
+    void run_replica(size_t r, const iteration_fn& fn)
+    {
+        zi::async::pool_scope ps(*replicas_[r].pool);
+        while ( fn(*replicas_[r].net, r) );
+    }
+
+public:
+    // num_locks = 0 makes the updates lock-free
+
+    hogwild_network(layered_network& net, transfer_fn tf,
+                    size_t num_replicas, size_t threads_per_replica,
+                    size_t num_locks = 0)
+        : net_(net)
+        , replicas_(num_replicas)
+    {
+        ZI_ASSERT(num_replicas>0);
+        ZI_ASSERT(threads_per_replica>0);
+
+        if ( num_locks )
+        {
+            locks_ = std::unique_ptr<striped_locks>(
+                new striped_locks(num_locks));
+        }
+
+        for ( auto& r: replicas_ )
+        {
+            r.pool = std::unique_ptr<zi::async::async_thread_pool>(
+                new zi::async::async_thread_pool(threads_per_replica));
+            r.data = std::unique_ptr<layered_network_data>(
+                new layered_network_data(net));
+            r.data->set_update_locks(locks_.get());
+            r.net  = std::unique_ptr<parallel_network>(
+                new parallel_network(*r.data, tf));
+        }
+    }
+
+    size_t num_replicas() const
+    {
+        return replicas_.size();
+    }
+
+    parallel_network& replica_network(size_t r)
+    {
+        ZI_ASSERT(r<replicas_.size());
+        return *replicas_[r].net;
+    }
+
+    // Runs fn on all the replicas concurrently, each on its own thread,
+    // until it returns false for all of them
+
+    void run(const iteration_fn& fn)
+    {
+        std::vector<std::thread> threads;
+
+        for ( size_t r = 0; r < replicas_.size(); ++r )
+        {
+            threads.emplace_back(&hogwild_network::run_replica, this,
+                                 r, std::cref(fn));
+        }
+
+        for ( auto& t: threads )
+        {
+            t.join();
+        }
+    }
+
+    vec3s fov()
+    {
+        return net_.fov();
+    }
+
+}; // class hogwild_network
+
+}} // namespace zi::znn
@@ -0,0 +1,111 @@
+// Peak memory of the forward pass of parallel_network in the training
+// and in the inference mode, on a network shaped like the ones we train
+// (a single input, a few wide hidden layers with max pooling, a single
+// output), over a cubic input tile.
+//
+// The memory is the one of the cubes taken from the pools (featuremaps,
+// transforms, pooling indices), including the transforms of the
+// filters, cached between the passes (the same in both modes). The
+// first pass of each mode only fills that cache; the second one is
+// measured, both its peak and what is held after it. In the inference
+// mode the filter transforms can also be dropped after use, which is
+// measured as well.
+//
+// usage: inference_benchmark [tile width] [tile depth] [width]
+
+// The pools count the memory of their cubes only when asked to
+
+#define ZNN_POOL_STATS
+
+#include "parallel_network.hpp"
+#include "../transfer_fn/transfer_fn.hpp"
+
+#include <iostream>
+#include <cstdlib>
+
+namespace arma {
+thread_local arma_rng_cxx11 arma_rng_cxx11_instance;
+}
+
+using namespace zi::znn;
+
+namespace {
+
+double mb(std::size_t bytes)
+{
+    return bytes / 1048576.0;
+}
+
+struct usage
+{
+    std::size_t peak; // during a pass
+    std::size_t held; // after it
+};
+
+usage measure(layered_network& net, const cube<double>& in, bool inference,
+              bool keep_filters, cube<double>& out)
+{
+    pool_memory& pm = pool_memory::instance();
+
+    std::size_t base = pm.in_use();
+
+    layered_network_data nld(net);
+    parallel_network     pn(nld, make_transfer_fn<sigmoid>());
+    pn.set_inference(inference);
+    pn.set_keep_filter_transforms(keep_filters);
+
+    std::vector<cube<double>> input{in};
+    pn.forward(input);
+
+    pm.reset_peak();
+    out = pn.forward(input)[0];
+
+    return { pm.peak() - base, pm.in_use() - base };
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    std::size_t w     = argc > 1 ? std::atoi(argv[1]) : 64;
+    std::size_t d     = argc > 2 ? std::atoi(argv[2]) : 16;
+    std::size_t width = argc > 3 ? std::atoi(argv[3]) : 16;
+
+    layered_network net(1);
+    net.add_layer(width, vec3s(4,4,1), vec3s(2,2,1), 0.1);
+    net.add_layer(width, vec3s(4,4,1), vec3s(2,2,1), 0.1);
+    net.add_layer(width, vec3s(4,4,2), 0.1);
+    net.add_layer(1, vec3s(1,1,1), 0.1);
+
+    vec3s s = vec3s(w,w,d) + net.fov() - vec3s::one;
+
+    cube<double> in(s[0], s[1], s[2]);
+    in.randu();
+
+    cube<double> a, b, c;
+
+    usage t = measure(net, in, false, true,  a);
+    usage i = measure(net, in, true,  true,  b);
+    usage f = measure(net, in, true,  false, c);
+
+    // Held after an inference pass: the output and the filter transforms
+
+    std::size_t filters = i.held - b.n_elem * sizeof(double);
+
+    std::cout << "input " << s << ", fov " << net.fov() << "\n"
+              << "filter transforms: " << mb(filters) << " MB\n"
+              << "training mode:  peak " << mb(t.peak) << " MB, held "
+              << mb(t.held) << " MB\n"
+              << "inference mode: peak " << mb(i.peak) << " MB, held "
+              << mb(i.held) << " MB\n"
+              << "peak reduction: "
+              << static_cast<double>(t.peak) / i.peak << "x, "
+              << static_cast<double>(t.peak - filters) / ( i.peak - filters )
+              << "x without the filter transforms\n"
+              << "inference mode, filter transforms not kept: peak "
+              << mb(f.peak) << " MB (" << static_cast<double>(t.peak) / f.peak
+              << "x)\n"
+              << "max difference: "
+              << std::max(cube<double>(arma::abs(a - b)).max(),
+                          cube<double>(arma::abs(a - c)).max()) << std::endl;
+}
@@ -151,6 +151,13 @@ public:
         n_outputs_ = n_out;
     }
 
+    void add_layer( network_layer&& l )
+    {
+        ZI_ASSERT(l.num_inputs()==n_outputs_);
+        n_outputs_ = l.num_outputs();
+        layers_.push_back(std::move(l));
+    }
+
     void add_layer( std::size_t n_out,
                     const vec3s& filter_size,
                     double learning_rate)
@@ -179,6 +186,14 @@ public:
         return layers_[l].filter(i,j);
     }
 
+    void set_optimizer(const optimizer& o)
+    {
+        for ( auto& l: layers_ )
+        {
+            l.set_optimizer(o);
+        }
+    }
+
     vec3s fov( size_t at_layer = 0 ) const
     {
         if ( at_layer >= layers_.size() )
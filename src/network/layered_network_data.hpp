@@ -3,8 +3,9 @@
 #include <zi/async.hpp>
 
 #include "layered_network.hpp"
-#include "../core/waiter.hpp"
 #include "../core/cube_pool.hpp" // for unuque_cube
+#include "../core/trace.hpp"
+#include "../core/striped_locks.hpp"
 
 
 namespace zi {
@@ -31,6 +32,11 @@ private:
     size_t num_filters_     = 0;
     size_t num_layers_      = 0;
 
+    // When several networks update the same weights concurrently, the
+    // updates of each filter (and bias) are serialized by these
+
+    striped_locks* update_locks_ = nullptr;
+
     void init()
     {
         num_perceptrons_ = 0;
@@ -56,27 +62,20 @@ private:
         }
     }
 
-    void apply_grad(size_t layer, size_t j, waiter& w)
+    void apply_grad(size_t layer, size_t j)
     {
-        bias(layer,j) -= learning_rate(layer) * dEdB(layer,j);
+        apply_bias_grad(layer, j);
 
         for ( size_t i = 0; i < layer_data_[layer].dEdW.size(); ++i )
         {
-            ZI_ASSERT(layer_data_[layer].dEdW[i][j]);
-
-            *dEdW(layer,i,j) *= learning_rate(layer);
-            filter(layer,i,j) -= *dEdW(layer,i,j);
+            apply_filter_grad(layer, i, j);
         }
-
-        w.one_done();
     }
 
     void apply_grad_serial(size_t layer, size_t i, size_t j)
     {
         ZI_ASSERT(layer_data_[layer].dEdW[i][j]);
-
-        *dEdW(layer,i,j) *= learning_rate(layer);
-        filter(layer,i,j) -= *dEdW(layer,i,j);
+        network_.layer(layer).update_filter(i, j, *dEdW(layer,i,j));
     }
 
 public:
@@ -86,6 +85,19 @@ public:
         init();
     }
 
+    void set_update_locks(striped_locks* l)
+    {
+        update_locks_ = l;
+    }
+
+    // Locks the filter (l,i,j) against concurrent updates, if needed.
+    // The bias j of the layer l is locked with i = number of inputs.
+
+    guard lock_weights(size_t l, size_t i, size_t j)
+    {
+        return update_locks_ ? guard(update_locks_->get(l,i,j)) : guard();
+    }
+
     void clear()
     {
         layer_data_.clear();
@@ -173,29 +185,72 @@ public:
         return network_.layer(l).bias(i);
     }
 
+    // The updates of the individual weights of a layer, which have to
+    // be preceded by begin_layer_update()
+
+    void begin_layer_update(size_t l)
+    {
+        guard g = lock_weights(l, network_.layer(l).num_inputs(),
+                               network_.layer(l).num_outputs());
+        network_.layer(l).begin_update();
+    }
+
+    void apply_bias_grad(size_t l, size_t j)
+    {
+        guard g = lock_weights(l, network_.layer(l).num_inputs(), j);
+        network_.layer(l).update_bias(j, dEdB(l,j));
+    }
+
+    void apply_filter_grad(size_t l, size_t i, size_t j)
+    {
+        ZI_ASSERT(layer_data_[l].dEdW[i][j]);
+
+        guard g = lock_weights(l, i, j);
+        network_.layer(l).update_filter(i, j, *dEdW(l,i,j));
+    }
+
+    // Updates the weights of a single layer, one task per perceptron
+
+    zi::async::future<void> apply_layer_grads(size_t l)
+    {
+        begin_layer_update(l);
+
+        std::vector<zi::async::future<void>> done;
+        done.reserve(layer_data_[l].dEdB.size());
+
+        for ( size_t j = 0; j < layer_data_[l].dEdB.size(); ++j )
+        {
+            done.push_back(
+                trace::async_future(trace::update_task, l, j,
+                                    &layered_network_data::apply_grad,
+                                    this, l, j));
+        }
+
+        return zi::async::when_all(done);
+    }
+
     void apply_grads()
     {
-        waiter w(num_perceptrons_);
+        std::vector<zi::async::future<void>> done;
+        done.reserve(num_layers_);
 
         for ( size_t l = 0; l < num_layers_; ++l )
         {
-            for ( size_t j = 0; j < layer_data_[l].dEdB.size(); ++j )
-            {
-                zi::async::async(&layered_network_data::apply_grad,
-                                     this, l, j, std::ref(w));
-            }
+            done.push_back(apply_layer_grads(l));
         }
 
-        w.wait();
+        zi::async::when_all(done).get();
     }
 
     void apply_grads_serial()
     {
         for ( size_t l = 0; l < num_layers_; ++l )
         {
+            network_.layer(l).begin_update();
+
             for ( size_t j = 0; j < layer_data_[l].dEdB.size(); ++j )
             {
-                bias(l,j) -= learning_rate(l) * dEdB(l,j);
+                network_.layer(l).update_bias(j, dEdB(l,j));
                 for ( size_t i = 0; i < layer_data_[l].dEdW.size(); ++i )
                 {
                     apply_grad_serial(l, i, j);
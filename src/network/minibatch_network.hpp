@@ -0,0 +1,121 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+
+#include <zi/async.hpp>
+
+#include "layered_network.hpp"
+#include "layered_network_data.hpp"
+#include "batch_gradient.hpp"
+#include "parallel_network.hpp"
+#include "../transfer_fn/transfer_fn.hpp"
+
+
+namespace zi {
+namespace znn {
+
+// Trains on minibatches. Each sample of the batch gets its own
+// parallel_network (and featuremaps), all sharing the filters of the
+// layered_network, so the tasks of all the samples are in flight at
+// the same time. The gradients are averaged over the batch, followed
+// by a single weight update.
+
+class minibatch_network
+{
+private:
+    typedef std::vector<cube<double>>                   cubes_type;
+    typedef std::unique_ptr<layered_network_data>       data_ptr  ;
+    typedef std::unique_ptr<parallel_network>           net_ptr   ;
+
+private:
+    layered_network&      net_   ;
+    batch_gradient        batch_ ;
+    std::vector<data_ptr> data_  ;
+    std::vector<net_ptr>  nets_  ;
+    size_t                active_ = 0;
+
+public:
+    minibatch_network(layered_network& net, transfer_fn tf, size_t batch_size)
+        : net_(net)
+        , batch_(net)
+        , data_(batch_size)
+        , nets_(batch_size)
+    {
+        ZI_ASSERT(batch_size>0);
+
+        for ( size_t i = 0; i < batch_size; ++i )
+        {
+            data_[i] = data_ptr(new layered_network_data(net));
+            nets_[i] = net_ptr(new parallel_network(*data_[i], tf));
+            nets_[i]->set_batch(&batch_);
+        }
+    }
+
+    size_t batch_size() const
+    {
+        return nets_.size();
+    }
+
+    // Forward passes of up to batch_size() samples, done concurrently
+
+    std::vector<cubes_type> forward(const std::vector<cubes_type>& inputs)
+    {
+        ZI_ASSERT(inputs.size()>0);
+        ZI_ASSERT(inputs.size()<=nets_.size());
+
+        active_ = inputs.size();
+
+        std::vector<zi::async::future<void>> done;
+        for ( size_t i = 0; i < active_; ++i )
+        {
+            done.push_back(nets_[i]->forward_async(inputs[i]));
+        }
+
+        zi::async::when_all(done).get();
+
+        std::vector<cubes_type> ret;
+        for ( size_t i = 0; i < active_; ++i )
+        {
+            ret.push_back(nets_[i]->outputs());
+        }
+
+        return ret;
+    }
+
+    // Backward passes of the samples of the last forward call, the
+    // gradients are accumulated over the batch
+
+    void backward(const std::vector<cubes_type>& grads)
+    {
+        ZI_ASSERT(grads.size()==active_);
+
+        batch_.reset(active_);
+
+        std::vector<zi::async::future<void>> done;
+        for ( size_t i = 0; i < active_; ++i )
+        {
+            done.push_back(nets_[i]->backward_async(grads[i]));
+        }
+
+        zi::async::when_all(done).get();
+    }
+
+    void grad_update()
+    {
+        batch_.apply();
+
+        for ( auto& n: nets_ )
+        {
+            n->init();
+        }
+    }
+
+    vec3s fov()
+    {
+        return net_.fov();
+    }
+
+}; // class minibatch_network
+
+}} // namespace zi::znn
@@ -0,0 +1,647 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../core/types.hpp"
+#include "../core/diskio.hpp"
+#include "layered_network.hpp"
+#include "optimizer.hpp"
+
+namespace zi {
+namespace znn {
+
+// Model container. Unlike the stream format of layered_network::write
+// (still read by load_network), everything is found through tables at
+// the head of the file, and every tensor is stored contiguously at an
+// aligned offset, so the file can be mapped and the filters used in
+// place.
+//
+//    header
+//    layer table       one model_layer_entry per layer
+//    section table     one model_section_entry per section
+//    sections          each at a multiple of the alignment
+//
+// The sections hold the biases and the filters of each layer (input
+// major, each filter x fastest), and optionally the optimizer state and
+// any extra data (e.g. precomputed filter spectra), identified by kind,
+// layer and a key of three numbers (e.g. the transform size). Readers
+// skip the kinds they don't know. Each section has its own checksum
+// (64 bit FNV-1a), the tables have one as well.
+
+namespace model {
+
+static const uint64_t magic     = 0x314c444f4d4e4e5aULL; // ZNNMODL1
+static const uint32_t version   = 1;
+static const uint64_t alignment = 64;
+
+enum section_kind : uint32_t
+{
+    biases         = 1,
+    filters        = 2,
+    bias_state0    = 3, // optimizer state, see optimizer::num_states()
+    filter_state0  = 4,
+    bias_state1    = 5,
+    filter_state1  = 6,
+    filter_spectra = 16 // complex<double>, key is the transform size
+};
+
+struct header
+{
+    uint64_t magic         ;
+    uint32_t version       ;
+    uint32_t alignment     ;
+    uint64_t n_inputs      ;
+    uint64_t n_layers      ;
+    uint64_t n_sections    ;
+    uint64_t layer_table   ; // offsets in the file
+    uint64_t section_table ;
+    uint64_t file_size     ;
+    uint64_t table_checksum;
+};
+
+struct layer_entry
+{
+    uint64_t n_inputs      ;
+    uint64_t n_outputs     ;
+    uint64_t filter_size[3];
+    uint64_t pooling_size[3];
+    double   learning_rate ;
+    uint32_t optimizer_type;
+    uint32_t reserved      ;
+    double   mu            ;
+    double   beta1         ;
+    double   beta2         ;
+    double   epsilon       ;
+    uint64_t step          ;
+};
+
+struct section_entry
+{
+    uint32_t kind    ;
+    uint32_t layer   ;
+    uint64_t key[3]  ;
+    uint64_t offset  ;
+    uint64_t bytes   ;
+    uint64_t checksum;
+};
+
+inline uint64_t checksum( const void* p, std::size_t n,
+                          uint64_t h = 0xcbf29ce484222325ULL )
+{
+    const unsigned char* c = static_cast<const unsigned char*>(p);
+    for ( std::size_t i = 0; i < n; ++i )
+    {
+        h ^= c[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// An extra section to be saved with the model
+
+struct extra_section
+{
+    uint32_t          kind ;
+    uint32_t          layer;
+    vec3s             key  ;
+    std::vector<char> data ;
+};
+
+} // namespace model
+
+
+// Saves the network (with the optimizer state, if any) and the extra
+// sections. Written to fname.tmp, synced and renamed over fname, so the
+// old file stays whole until the new one is on the disk (a crash leaves
+// one of the two), and the processes that have it mapped (model_file)
+// keep reading the old version.
+
+inline void save_model( const std::string& fname, layered_network& net,
+                        const std::vector<model::extra_section>& extra =
+                        std::vector<model::extra_section>() )
+{
+    struct blob
+    {
+        model::section_entry e;
+        const char*          p;
+    };
+
+    std::vector<model::layer_entry> layers(net.num_layers());
+    std::vector<blob>               blobs;
+
+    // Gathered, as the filters are separate cubes
+
+    std::vector<std::vector<double>> packed;
+    packed.reserve(net.num_layers() * 6);
+
+    auto add = [&](uint32_t kind, uint32_t l, const vec3s& key,
+                   const char* p, std::size_t n) {
+        blob b;
+        std::memset(&b.e, 0, sizeof(b.e));
+        b.e.kind  = kind;
+        b.e.layer = l;
+        b.e.bytes = n;
+        for ( std::size_t k = 0; k < 3; ++k )
+        {
+            b.e.key[k] = key[k];
+        }
+        b.e.checksum = model::checksum(p, n);
+        b.p = p;
+        blobs.push_back(b);
+    };
+
+    for ( std::size_t l = 0; l < net.num_layers(); ++l )
+    {
+        network_layer&     nl = net.layer(l);
+        const optimizer&   o  = nl.get_optimizer();
+        model::layer_entry& e = layers[l];
+
+        std::memset(&e, 0, sizeof(e));
+        e.n_inputs  = nl.num_inputs();
+        e.n_outputs = nl.num_outputs();
+        for ( std::size_t k = 0; k < 3; ++k )
+        {
+            e.filter_size[k]  = nl.filter_size()[k];
+            e.pooling_size[k] = nl.pooling_size()[k];
+        }
+        e.learning_rate  = nl.learning_rate();
+        e.optimizer_type = o.type;
+        e.mu             = o.mu;
+        e.beta1          = o.beta1;
+        e.beta2          = o.beta2;
+        e.epsilon        = o.epsilon;
+        e.step           = o.step;
+
+        auto pack = [&](uint32_t bkind, uint32_t fkind,
+                        std::function<double(std::size_t)> b,
+                        std::function<const cube<double>&(std::size_t,
+                                                          std::size_t)> f) {
+            packed.emplace_back();
+            std::vector<double>& pb = packed.back();
+            for ( std::size_t j = 0; j < nl.num_outputs(); ++j )
+            {
+                pb.push_back(b(j));
+            }
+
+            packed.emplace_back();
+            std::vector<double>& pf = packed.back();
+            for ( std::size_t i = 0; i < nl.num_inputs(); ++i )
+            {
+                for ( std::size_t j = 0; j < nl.num_outputs(); ++j )
+                {
+                    const cube<double>& c = f(i,j);
+                    pf.insert(pf.end(), c.memptr(), c.memptr() + c.n_elem);
+                }
+            }
+
+            add(bkind, l, vec3s::zero, reinterpret_cast<const char*>(pb.data()),
+                pb.size() * sizeof(double));
+            add(fkind, l, vec3s::zero, reinterpret_cast<const char*>(pf.data()),
+                pf.size() * sizeof(double));
+        };
+
+        pack(model::biases, model::filters,
+             [&](std::size_t j) { return nl.bias(j); },
+             [&](std::size_t i, std::size_t j) -> const cube<double>& {
+                 return nl.filter(i,j); });
+
+        for ( std::size_t k = 0; k < o.num_states(); ++k )
+        {
+            pack(k ? model::bias_state1   : model::bias_state0,
+                 k ? model::filter_state1 : model::filter_state0,
+                 [&](std::size_t j) { return nl.bias_state(k,j); },
+                 [&](std::size_t i, std::size_t j) -> const cube<double>& {
+                     return nl.filter_state(k,i,j); });
+        }
+    }
+
+    for ( auto& x: extra )
+    {
+        add(x.kind, x.layer, x.key, x.data.data(), x.data.size());
+    }
+
+    auto align = [](uint64_t x) {
+        return ( x + model::alignment - 1 ) / model::alignment
+            * model::alignment;
+    };
+
+    model::header h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic         = model::magic;
+    h.version       = model::version;
+    h.alignment     = model::alignment;
+    h.n_inputs      = net.num_inputs();
+    h.n_layers      = layers.size();
+    h.n_sections    = blobs.size();
+    h.layer_table   = sizeof(h);
+    h.section_table = h.layer_table + layers.size() * sizeof(model::layer_entry);
+
+    uint64_t pos = h.section_table + blobs.size() * sizeof(model::section_entry);
+
+    for ( auto& b: blobs )
+    {
+        pos = align(pos);
+        b.e.offset = pos;
+        pos += b.e.bytes;
+    }
+
+    h.file_size = pos;
+
+    h.table_checksum = model::checksum(layers.data(),
+                                       layers.size() * sizeof(model::layer_entry));
+    for ( auto& b: blobs )
+    {
+        h.table_checksum = model::checksum(&b.e, sizeof(b.e), h.table_checksum);
+    }
+
+    std::string tmp = fname + ".tmp";
+
+    try
+    {
+        io::buffered_writer out(tmp);
+
+        out << h;
+        for ( auto& e: layers )
+        {
+            out << e;
+        }
+        for ( auto& b: blobs )
+        {
+            out << b.e;
+        }
+
+        static const char zeros[model::alignment] = {};
+
+        for ( auto& b: blobs )
+        {
+            if ( out.tell() < b.e.offset )
+            {
+                out.write(zeros, b.e.offset - out.tell());
+            }
+            if ( b.e.bytes )
+            {
+                out.write(b.p, b.e.bytes);
+            }
+        }
+
+        out.sync();
+        out.close();
+    }
+    catch ( ... )
+    {
+        std::remove(tmp.c_str());
+        throw;
+    }
+
+    if ( std::rename(tmp.c_str(), fname.c_str()) )
+    {
+        std::string e = std::strerror(errno);
+        std::remove(tmp.c_str());
+        throw std::runtime_error("save_model: can't rename " + tmp +
+                                 " to " + fname + ": " + e);
+    }
+
+    // The rename itself is on the disk once the directory is
+
+    std::size_t slash = fname.rfind('/');
+    std::string dir   = slash == std::string::npos ? "."
+        : fname.substr(0, std::max<std::size_t>(slash, 1));
+
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if ( fd >= 0 )
+    {
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
+
+
+// A model file mapped to memory. Only the tables are read when opened
+// (and their checksum verified); the sections are accessed in place,
+// and their checksums verified on demand.
+//
+// The mapping is private and writable: the networks created from it can
+// use (and even train) the filters in place, the pages being shared
+// with the page cache (and all the other processes mapping the file)
+// until written to.
+
+class model_file
+{
+private:
+    struct mapping
+    {
+        void*       p = MAP_FAILED;
+        std::size_t n = 0;
+
+        ~mapping()
+        {
+            if ( p != MAP_FAILED )
+            {
+                ::munmap(p, n);
+            }
+        }
+    };
+
+private:
+    std::string                         fname_   ;
+    std::shared_ptr<mapping>            map_     ;
+    char*                               data_    = nullptr;
+    model::header                       header_  ;
+    std::vector<model::layer_entry>     layers_  ;
+    std::vector<model::section_entry>   sections_;
+
+private:
+    void fail( const std::string& what ) const
+    {
+        throw std::runtime_error("model_file: " + fname_ + ": " + what);
+    }
+
+    // Whether the n bytes at off are within the file (without the sum
+    // overflowing on corrupt tables)
+
+    bool fits( uint64_t off, uint64_t n ) const
+    {
+        return off <= map_->n && n <= map_->n - off;
+    }
+
+public:
+    static bool is_model( const std::string& fname )
+    {
+        std::ifstream in(fname.c_str(), std::ios::binary);
+        uint64_t m = 0;
+        in.read(reinterpret_cast<char*>(&m), sizeof(m));
+        return in && m == model::magic;
+    }
+
+    explicit model_file( const std::string& fname )
+        : fname_(fname)
+        , map_(std::make_shared<mapping>())
+    {
+        int fd = ::open(fname.c_str(), O_RDONLY);
+        if ( fd < 0 )
+        {
+            fail(std::strerror(errno));
+        }
+
+        struct stat st;
+        if ( ::fstat(fd, &st) || st.st_size < static_cast<off_t>(sizeof(header_)) )
+        {
+            ::close(fd);
+            fail("too small");
+        }
+
+        map_->n = st.st_size;
+        map_->p = ::mmap(nullptr, map_->n, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+        ::close(fd);
+
+        if ( map_->p == MAP_FAILED )
+        {
+            fail(std::strerror(errno));
+        }
+
+        data_ = static_cast<char*>(map_->p);
+
+        std::memcpy(&header_, data_, sizeof(header_));
+
+        if ( header_.magic != model::magic )
+        {
+            fail("not a model file");
+        }
+
+        if ( header_.version > model::version )
+        {
+            fail("unsupported version " + std::to_string(header_.version));
+        }
+
+        if ( header_.file_size != map_->n )
+        {
+            fail("truncated");
+        }
+
+        if ( header_.n_layers   > map_->n / sizeof(model::layer_entry) ||
+             header_.n_sections > map_->n / sizeof(model::section_entry) )
+        {
+            fail("corrupt tables");
+        }
+
+        uint64_t lsize = header_.n_layers   * sizeof(model::layer_entry);
+        uint64_t ssize = header_.n_sections * sizeof(model::section_entry);
+
+        if ( !fits(header_.layer_table, lsize) ||
+             !fits(header_.section_table, ssize) )
+        {
+            fail("corrupt tables");
+        }
+
+        layers_.resize(header_.n_layers);
+        sections_.resize(header_.n_sections);
+
+        if ( lsize )
+        {
+            std::memcpy(layers_.data(), data_ + header_.layer_table, lsize);
+        }
+        if ( ssize )
+        {
+            std::memcpy(sections_.data(), data_ + header_.section_table, ssize);
+        }
+
+        uint64_t c = model::checksum(layers_.data(), lsize);
+        for ( auto& s: sections_ )
+        {
+            c = model::checksum(&s, sizeof(s), c);
+
+            if ( !fits(s.offset, s.bytes) )
+            {
+                fail("section out of bounds");
+            }
+        }
+
+        if ( c != header_.table_checksum )
+        {
+            fail("table checksum mismatch");
+        }
+    }
+
+    model_file(const model_file&) = delete;
+    model_file& operator=(const model_file&) = delete;
+
+    std::size_t num_inputs() const
+    {
+        return header_.n_inputs;
+    }
+
+    std::size_t num_layers() const
+    {
+        return layers_.size();
+    }
+
+    const model::layer_entry& layer( std::size_t l ) const
+    {
+        ZI_ASSERT(l<layers_.size());
+        return layers_[l];
+    }
+
+    const std::vector<model::section_entry>& sections() const
+    {
+        return sections_;
+    }
+
+    // Null if there is no such section
+
+    const model::section_entry* find( uint32_t kind, std::size_t l,
+                                      const vec3s& key = vec3s::zero ) const
+    {
+        for ( auto& s: sections_ )
+        {
+            if ( s.kind == kind && s.layer == l && s.key[0] == key[0] &&
+                 s.key[1] == key[1] && s.key[2] == key[2] )
+            {
+                return &s;
+            }
+        }
+        return nullptr;
+    }
+
+    char* data( const model::section_entry& s ) const
+    {
+        return data_ + s.offset;
+    }
+
+    bool verify( const model::section_entry& s ) const
+    {
+        return model::checksum(data(s), s.bytes) == s.checksum;
+    }
+
+    // Verifies all the sections
+
+    void verify() const
+    {
+        for ( auto& s: sections_ )
+        {
+            if ( !verify(s) )
+            {
+                fail("checksum mismatch in a section of layer " +
+                     std::to_string(s.layer));
+            }
+        }
+    }
+
+    // The network stored in the file. With in_place, the filters of the
+    // network are the ones of the mapping, which is kept alive by the
+    // network. Only the sections used are verified, unless verify is
+    // false.
+
+    layered_network network( bool in_place = true, bool verify = true ) const
+    {
+        layered_network net(header_.n_inputs);
+
+        for ( std::size_t l = 0; l < layers_.size(); ++l )
+        {
+            const model::layer_entry& e = layers_[l];
+
+            vec3s fs(e.filter_size[0], e.filter_size[1], e.filter_size[2]);
+            vec3s ps(e.pooling_size[0], e.pooling_size[1], e.pooling_size[2]);
+
+            uint64_t nf = e.n_inputs * e.n_outputs * fs[0] * fs[1] * fs[2];
+
+            auto get = [&](uint32_t kind, uint64_t n) {
+                const model::section_entry* s = find(kind, l);
+                if ( !s || s->bytes != n * sizeof(double) )
+                {
+                    fail("missing section of layer " + std::to_string(l));
+                }
+                if ( verify && !this->verify(*s) )
+                {
+                    fail("checksum mismatch in layer " + std::to_string(l));
+                }
+                return reinterpret_cast<double*>(data(*s));
+            };
+
+            if ( e.n_inputs != net.num_outputs() )
+            {
+                fail("inconsistent layers");
+            }
+
+            optimizer o;
+            o.type    = e.optimizer_type;
+            o.mu      = e.mu;
+            o.beta1   = e.beta1;
+            o.beta2   = e.beta2;
+            o.epsilon = e.epsilon;
+            o.step    = e.step;
+
+            network_layer nl(e.n_inputs, e.n_outputs, fs, ps, e.learning_rate,
+                             o, get(model::biases, e.n_outputs),
+                             get(model::filters, nf),
+                             in_place ? std::shared_ptr<const void>(map_)
+                                      : std::shared_ptr<const void>());
+
+            for ( std::size_t k = 0; k < o.num_states(); ++k )
+            {
+                const double* b = get(k ? model::bias_state1
+                                        : model::bias_state0, e.n_outputs);
+                const double* f = get(k ? model::filter_state1
+                                        : model::filter_state0, nf);
+
+                for ( std::size_t j = 0; j < e.n_outputs; ++j )
+                {
+                    nl.bias_state(k,j) = b[j];
+                }
+
+                for ( std::size_t i = 0; i < e.n_inputs; ++i )
+                {
+                    for ( std::size_t j = 0; j < e.n_outputs; ++j )
+                    {
+                        cube<double>& c = nl.filter_state(k,i,j);
+                        std::memcpy(c.memptr(), f, c.n_elem * sizeof(double));
+                        f += c.n_elem;
+                    }
+                }
+            }
+
+            net.add_layer(std::move(nl));
+        }
+
+        return net;
+    }
+
+}; // class model_file
+
+
+// Loads a network saved either with save_model or (the old format) with
+// layered_network::write
+
+inline layered_network load_network( const std::string& fname,
+                                     bool in_place = false )
+{
+    if ( model_file::is_model(fname) )
+    {
+        return model_file(fname).network(in_place);
+    }
+
+    std::ifstream in(fname.c_str(), std::ios::binary);
+    if ( !in )
+    {
+        throw std::runtime_error("load_network: can't open " + fname);
+    }
+
+    return layered_network(in);
+}
+
+}} // namespace zi::znn
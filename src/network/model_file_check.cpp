@@ -0,0 +1,311 @@
+// Round trips of save_model and model_file: a network with every kind
+// of optimizer state and an extra section is saved and read back (the
+// filters in place and copied), a file mapped by a model_file is saved
+// over while its network is in use, and corrupt files (a flipped byte,
+// a section offset near 2^64, a truncated file) have to be rejected.
+// The networks of the old stream format are still loaded.
+//
+// Prints the failures, exits with 1 if there are any.
+//
+// usage: model_file_check [directory]
+
+#include "model_file.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <limits>
+#include <cstdlib>
+#include <cstdio>
+
+namespace arma {
+thread_local arma_rng_cxx11 arma_rng_cxx11_instance;
+}
+
+using namespace zi::znn;
+
+namespace {
+
+std::size_t failures = 0;
+
+void expect(bool ok, const std::string& what)
+{
+    if ( !ok )
+    {
+        std::cout << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+bool same(const cube<double>& a, const cube<double>& b)
+{
+    return size(a) == size(b) &&
+        std::equal(a.memptr(), a.memptr() + a.n_elem, b.memptr());
+}
+
+// Everything saved by save_model
+
+bool same(layered_network& a, layered_network& b, bool states = true)
+{
+    if ( a.num_inputs() != b.num_inputs() ||
+         a.num_layers() != b.num_layers() )
+    {
+        return false;
+    }
+
+    for ( std::size_t l = 0; l < a.num_layers(); ++l )
+    {
+        network_layer& x = a.layer(l);
+        network_layer& y = b.layer(l);
+
+        const optimizer& o = x.get_optimizer();
+        const optimizer& p = y.get_optimizer();
+
+        if ( x.num_outputs() != y.num_outputs() ||
+             x.filter_size() != y.filter_size() ||
+             x.pooling_size() != y.pooling_size() ||
+             x.learning_rate() != y.learning_rate() )
+        {
+            return false;
+        }
+
+        if ( states && ( o.type != p.type || o.mu != p.mu ||
+                         o.beta1 != p.beta1 || o.beta2 != p.beta2 ||
+                         o.epsilon != p.epsilon || o.step != p.step ) )
+        {
+            return false;
+        }
+
+        for ( std::size_t j = 0; j < x.num_outputs(); ++j )
+        {
+            if ( x.bias(j) != y.bias(j) )
+            {
+                return false;
+            }
+
+            for ( std::size_t k = 0; states && k < o.num_states(); ++k )
+            {
+                if ( x.bias_state(k,j) != y.bias_state(k,j) )
+                {
+                    return false;
+                }
+            }
+        }
+
+        for ( std::size_t i = 0; i < x.num_inputs(); ++i )
+        {
+            for ( std::size_t j = 0; j < x.num_outputs(); ++j )
+            {
+                if ( !same(x.filter(i,j), y.filter(i,j)) )
+                {
+                    return false;
+                }
+
+                for ( std::size_t k = 0; states && k < o.num_states(); ++k )
+                {
+                    if ( !same(x.filter_state(k,i,j), y.filter_state(k,i,j)) )
+                    {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+// Fails if opening the file, or loading its network, doesn't throw
+
+void expect_rejected(const std::string& fname, const std::string& what)
+{
+    bool thrown = false;
+    try
+    {
+        model_file(fname).network(false);
+    }
+    catch ( std::runtime_error& )
+    {
+        thrown = true;
+    }
+    expect(thrown, what + " not rejected");
+}
+
+std::vector<char> read_file(const std::string& fname)
+{
+    std::ifstream in(fname.c_str(), std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(in),
+                             std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string& fname, const std::vector<char>& d,
+                std::size_t n)
+{
+    std::ofstream out(fname.c_str(), std::ios::binary);
+    out.write(d.data(), n);
+}
+
+bool exists(const std::string& fname)
+{
+    return std::ifstream(fname.c_str()).good();
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    std::string dir   = argc > 1 ? argv[1] : "/tmp";
+    std::string fname = dir + "/model_file_check.znn";
+
+    layered_network net(2);
+    net.add_layer(3, vec3s(3,3,2), vec3s(2,2,1), 0.01);
+    net.add_layer(4, vec3s(2,1,1), vec3s::one, 0.02);
+    net.add_layer(1, vec3s(1,2,3), vec3s::one, 0.03);
+
+    // sgd, momentum and adam, the states made up
+
+    for ( std::size_t l = 1; l < 3; ++l )
+    {
+        network_layer& nl = net.layer(l);
+
+        optimizer o;
+        o.type = l == 1 ? optimizer::momentum : optimizer::adam;
+        o.mu   = 0.5 + l;
+        o.step = 10 * l;
+        nl.set_optimizer(o);
+
+        for ( std::size_t k = 0; k < o.num_states(); ++k )
+        {
+            for ( std::size_t j = 0; j < nl.num_outputs(); ++j )
+            {
+                nl.bias_state(k,j) = k + j * 0.25;
+            }
+            for ( std::size_t i = 0; i < nl.num_inputs(); ++i )
+            {
+                for ( std::size_t j = 0; j < nl.num_outputs(); ++j )
+                {
+                    nl.filter_state(k,i,j).randu();
+                }
+            }
+        }
+    }
+
+    model::extra_section x;
+    x.kind  = model::filter_spectra;
+    x.layer = 1;
+    x.key   = vec3s(5,6,7);
+    x.data  = std::vector<char>(1000);
+    for ( std::size_t i = 0; i < x.data.size(); ++i )
+    {
+        x.data[i] = static_cast<char>(i * 7);
+    }
+
+    save_model(fname, net, { x });
+
+    expect(!exists(fname + ".tmp"), "the temporary file is left");
+
+    {
+        model_file f(fname);
+        f.verify();
+
+        layered_network copied   = f.network(false);
+        layered_network in_place = f.network(true);
+
+        expect(same(net, copied), "copied network");
+        expect(same(net, in_place), "in place network");
+        layered_network loaded = load_network(fname);
+        expect(same(net, loaded), "load_network");
+
+        const model::section_entry* s =
+            f.find(model::filter_spectra, 1, vec3s(5,6,7));
+
+        expect(s && s->bytes == x.data.size() && f.verify(*s) &&
+               std::equal(x.data.begin(), x.data.end(), f.data(*s)),
+               "extra section");
+        expect(!f.find(model::filter_spectra, 1, vec3s(5,6,8)),
+               "extra section of another key");
+        expect(s && s->offset % model::alignment == 0, "alignment");
+    }
+
+    // Saved over while the old version is mapped and in use: the
+    // network keeps the old filters, the file has the new ones
+
+    {
+        model_file      f(fname);
+        layered_network old = f.network(true);
+        layered_network was = f.network(false);
+
+        net.filter(0,1,2) += 1;
+        net.layer(2).bias(0) += 1;
+
+        save_model(fname, net);
+
+        expect(same(old, was), "mapped network after saving over it");
+        expect(!same(old, net), "saved over");
+        layered_network reloaded = load_network(fname);
+        expect(same(net, reloaded), "saved over, reloaded");
+    }
+
+    // Corrupt files
+
+    std::vector<char> d = read_file(fname);
+    std::string bad = dir + "/model_file_check.bad";
+
+    model::header h;
+    std::memcpy(&h, d.data(), sizeof(h));
+
+    model::section_entry e;
+    std::size_t at = h.section_table;
+    std::memcpy(&e, d.data() + at, sizeof(e));
+
+    {
+        std::vector<char> c = d;
+        c[e.offset + 3] ^= 1;
+        write_file(bad, c, c.size());
+        expect_rejected(bad, "flipped byte");
+    }
+
+    {
+        // Past the end only once added to the size
+
+        std::vector<char> c = d;
+        model::section_entry f = e;
+        f.offset = std::numeric_limits<uint64_t>::max() - f.bytes / 2;
+        std::memcpy(c.data() + at, &f, sizeof(f));
+        write_file(bad, c, c.size());
+        expect_rejected(bad, "section offset near 2^64");
+    }
+
+    {
+        std::vector<char> c = d;
+        model::header g = h;
+        g.n_sections = std::numeric_limits<uint64_t>::max() / 8;
+        std::memcpy(c.data(), &g, sizeof(g));
+        write_file(bad, c, c.size());
+        expect_rejected(bad, "huge section table");
+    }
+
+    write_file(bad, d, d.size() - 1);
+    expect_rejected(bad, "truncated file");
+
+    // The old format
+
+    {
+        std::ofstream out(bad.c_str(), std::ios::binary);
+        net.write(out);
+    }
+    layered_network old = load_network(bad);
+    expect(same(net, old, false), "old format");
+
+    std::remove(bad.c_str());
+    std::remove(fname.c_str());
+
+    if ( failures )
+    {
+        std::cout << failures << " failures" << std::endl;
+        return 1;
+    }
+
+    std::cout << "all passed" << std::endl;
+}
@@ -3,10 +3,12 @@
 #include <cstddef>
 #include <cstdlib>
 #include <vector>
+#include <memory>
 
 #include "../core/types.hpp"
 #include "../core/cube_utils.hpp"
 #include "../core/diskio.hpp"
+#include "optimizer.hpp"
 
 namespace zi {
 namespace znn {
@@ -26,11 +28,102 @@ private:
     std::vector<std::vector<cube<double>>> filters_;
     std::vector<double>                    biases_;
 
+    // Optimizer settings and state. filter_m_ and bias_m_ hold the
+    // velocity (or the first moment), filter_v_ and bias_v_ the second
+    // moment. Only the ones used by the optimizer are allocated.
+
+    optimizer                              optimizer_;
+    std::vector<std::vector<cube<double>>> filter_m_;
+    std::vector<std::vector<cube<double>>> filter_v_;
+    std::vector<double>                    bias_m_;
+    std::vector<double>                    bias_v_;
+
+    // Layers with optimizer state are serialized with this bit set in
+    // the number of inputs, followed by the state after the filters.
+    // Plain SGD layers keep the old format.
+
+    static constexpr std::size_t optimizer_flag =
+        static_cast<std::size_t>(1) << (sizeof(std::size_t) * 8 - 1);
+
+    // Keeps alive the memory the filters live in, when they are not
+    // owned by the cubes (e.g. a mapped model file)
+
+    std::shared_ptr<const void>            storage_;
+
 private:
+    void alloc_state(std::vector<std::vector<cube<double>>>& f,
+                     std::vector<double>& b, bool needed)
+    {
+        f.clear();
+        b.clear();
+
+        if ( !needed )
+        {
+            return;
+        }
+
+        b.resize(n_outputs_, 0);
+        f.resize(n_inputs_);
+
+        for ( auto& fi: f )
+        {
+            fi.reserve(n_outputs_);
+            for ( std::size_t j = 0; j < n_outputs_; ++j )
+            {
+                fi.emplace_back(filter_size_[0],
+                                filter_size_[1],
+                                filter_size_[2]);
+                fi.back().zeros();
+            }
+        }
+    }
+
+    template<typename Char, typename CharT>
+    void read_state(std::basic_istream<Char,CharT>& in,
+                    std::vector<std::vector<cube<double>>>& f,
+                    std::vector<double>& b)
+    {
+        for ( auto& x: b )
+        {
+            io::read(in, x);
+        }
+
+        for ( auto& fi: f )
+        {
+            for ( auto& x: fi )
+            {
+                io::read(in, x);
+            }
+        }
+    }
+
+    template<typename Char, typename CharT>
+    void write_state(std::basic_ostream<Char,CharT>& out,
+                     const std::vector<std::vector<cube<double>>>& f,
+                     const std::vector<double>& b)
+    {
+        for ( auto& x: b )
+        {
+            io::write(out, x);
+        }
+
+        for ( auto& fi: f )
+        {
+            for ( auto& x: fi )
+            {
+                io::write(out, x);
+            }
+        }
+    }
+
     template<typename Char, typename CharT>
     void read(std::basic_istream<Char,CharT>& in)
     {
         io::read(in, n_inputs_);
+
+        bool has_optimizer = n_inputs_ & optimizer_flag;
+        n_inputs_ &= ~optimizer_flag;
+
         io::read(in, n_outputs_);
         io::read(in, filter_size_);
         io::read(in, pooling_size_);
@@ -56,13 +149,34 @@ private:
                 io::read(in, filters_[i][j]);
             }
         }
+
+        optimizer_ = optimizer();
+
+        if ( has_optimizer )
+        {
+            io::read(in, optimizer_.type);
+            io::read(in, optimizer_.mu);
+            io::read(in, optimizer_.beta1);
+            io::read(in, optimizer_.beta2);
+            io::read(in, optimizer_.epsilon);
+            optimizer_.step = io::read<uint64_t>(in);
+        }
+
+        alloc_state(filter_m_, bias_m_, optimizer_.num_states() > 0);
+        alloc_state(filter_v_, bias_v_, optimizer_.num_states() > 1);
+
+        read_state(in, filter_m_, bias_m_);
+        read_state(in, filter_v_, bias_v_);
     }
 
 public:
     template<typename Char, typename CharT>
     void write(std::basic_ostream<Char,CharT>& out)
     {
-        io::write(out, n_inputs_);
+        bool has_optimizer = optimizer_.type != optimizer::sgd;
+
+        io::write(out, has_optimizer ? (n_inputs_ | optimizer_flag)
+                                     : n_inputs_);
         io::write(out, n_outputs_);
         io::write(out, filter_size_);
         io::write(out, pooling_size_);
@@ -80,6 +194,19 @@ public:
                 io::write(out, filters_[i][j]);
             }
         }
+
+        if ( has_optimizer )
+        {
+            io::write(out, optimizer_.type);
+            io::write(out, optimizer_.mu);
+            io::write(out, optimizer_.beta1);
+            io::write(out, optimizer_.beta2);
+            io::write(out, optimizer_.epsilon);
+            io::write(out, optimizer_.step.load());
+
+            write_state(out, filter_m_, bias_m_);
+            write_state(out, filter_v_, bias_v_);
+        }
     }
 
 
@@ -176,6 +303,45 @@ public:
         read(in);
     }
 
+    // The filters are the consecutive blocks of filters (input major)
+    // of the size of a filter each. With storage given, the cubes use
+    // that memory directly, which storage keeps alive, otherwise the
+    // filters are copied.
+
+    network_layer(std::size_t n_in, std::size_t n_out,
+                  const vec3s& filter_size,
+                  const vec3s& pooling_size,
+                  double learning_rate,
+                  const optimizer& o,
+                  const double* biases,
+                  double* filters,
+                  std::shared_ptr<const void> storage = nullptr)
+        : n_inputs_(n_in)
+        , n_outputs_(n_out)
+        , filter_size_(filter_size)
+        , pooling_size_(pooling_size)
+        , learning_rate_(learning_rate)
+        , biases_(biases, biases + n_out)
+        , storage_(storage)
+    {
+        std::size_t n = filter_size[0] * filter_size[1] * filter_size[2];
+
+        filters_.resize(n_inputs_);
+
+        for ( std::size_t i = 0; i < n_inputs_; ++i )
+        {
+            filters_[i].reserve(n_outputs_);
+            for ( std::size_t j = 0; j < n_outputs_; ++j, filters += n )
+            {
+                filters_[i].emplace_back(filters, filter_size_[0],
+                                         filter_size_[1], filter_size_[2],
+                                         !storage_, true);
+            }
+        }
+
+        set_optimizer(o);
+    }
+
 
     network_layer(const network_layer&) = delete;
     network_layer& operator=(const network_layer&) = delete;
@@ -202,6 +368,12 @@ public:
             std::swap(learning_rate_, oth.learning_rate_);
             std::swap(filters_, oth.filters_);
             std::swap(biases_, oth.biases_);
+            std::swap(optimizer_, oth.optimizer_);
+            std::swap(filter_m_, oth.filter_m_);
+            std::swap(filter_v_, oth.filter_v_);
+            std::swap(bias_m_, oth.bias_m_);
+            std::swap(bias_v_, oth.bias_v_);
+            std::swap(storage_, oth.storage_);
         }
     }
 
@@ -242,12 +414,86 @@ public:
         return filters_[i][j];
     }
 
+    const cube<double>& filter(std::size_t i, std::size_t j) const
+    {
+        ZI_ASSERT(i<n_inputs_);
+        ZI_ASSERT(j<n_outputs_);
+        return filters_[i][j];
+    }
+
     double& bias(std::size_t i)
     {
         ZI_ASSERT(i<n_outputs_);
         return biases_[i];
     }
 
+    double bias(std::size_t i) const
+    {
+        ZI_ASSERT(i<n_outputs_);
+        return biases_[i];
+    }
+
+    // The k-th optimizer state value (0 or 1) of the filters and the
+    // biases, see optimizer::num_states()
+
+    cube<double>& filter_state(std::size_t k, std::size_t i, std::size_t j)
+    {
+        ZI_ASSERT(k<optimizer_.num_states());
+        return k ? filter_v_[i][j] : filter_m_[i][j];
+    }
+
+    double& bias_state(std::size_t k, std::size_t j)
+    {
+        ZI_ASSERT(k<optimizer_.num_states());
+        return k ? bias_v_[j] : bias_m_[j];
+    }
+
+    const optimizer& get_optimizer() const
+    {
+        return optimizer_;
+    }
+
+    // Changing the optimizer resets its state
+
+    void set_optimizer(const optimizer& o)
+    {
+        optimizer_ = o;
+        alloc_state(filter_m_, bias_m_, optimizer_.num_states() > 0);
+        alloc_state(filter_v_, bias_v_, optimizer_.num_states() > 1);
+    }
+
+    // Has to be called once before the updates of each iteration
+
+    void begin_update()
+    {
+        ++optimizer_.step;
+    }
+
+    // The updates of different biases and filters can be done
+    // concurrently
+
+    void update_bias(std::size_t j, double dEdB)
+    {
+        ZI_ASSERT(j<n_outputs_);
+
+        optimizer_.update(learning_rate_, &biases_[j], &dEdB,
+                          bias_m_.size() ? &bias_m_[j] : nullptr,
+                          bias_v_.size() ? &bias_v_[j] : nullptr, 1);
+    }
+
+    void update_filter(std::size_t i, std::size_t j, const cube<double>& dEdW)
+    {
+        ZI_ASSERT(i<n_inputs_);
+        ZI_ASSERT(j<n_outputs_);
+        ZI_ASSERT(dEdW.n_elem==filters_[i][j].n_elem);
+
+        optimizer_.update(learning_rate_, filters_[i][j].memptr(),
+                          dEdW.memptr(),
+                          filter_m_.size() ? filter_m_[i][j].memptr() : nullptr,
+                          filter_v_.size() ? filter_v_[i][j].memptr() : nullptr,
+                          dEdW.n_elem);
+    }
+
 }; // class network_layer
 
 }} // namespace zi::znn
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <atomic>
+
+namespace zi {
+namespace znn {
+
+// Settings of the weight update rule. The state (the velocity or the
+// first and second moments) is kept by the network_layer next to the
+// filters, here we only implement the update of a contiguous block of
+// weights. No memory is allocated, and the loops are simple enough for
+// the compiler to vectorize.
+
+struct optimizer
+{
+    enum type_t : uint32_t
+    {
+        sgd      = 0,
+        momentum = 1,
+        nesterov = 2,
+        adam     = 3
+    };
+
+    uint32_t type    = sgd;
+    double   mu      = 0.9;   // momentum (momentum, nesterov)
+    double   beta1   = 0.9;   // decay of the first moment (adam)
+    double   beta2   = 0.999; // decay of the second moment (adam)
+    double   epsilon = 1e-8;  // (adam)
+
+    // Number of updates so far: counted by network_layer::begin_update
+    // while the updates of the other networks over the same layer
+    // (hogwild, the slots of a pipelined network) read it
+
+    std::atomic<uint64_t> step{0};
+
+    optimizer() = default;
+
+    optimizer( const optimizer& o )
+        : type(o.type)
+        , mu(o.mu)
+        , beta1(o.beta1)
+        , beta2(o.beta2)
+        , epsilon(o.epsilon)
+        , step(o.step.load())
+    {
+    }
+
+    optimizer& operator=( const optimizer& o )
+    {
+        type    = o.type;
+        mu      = o.mu;
+        beta1   = o.beta1;
+        beta2   = o.beta2;
+        epsilon = o.epsilon;
+        step    = o.step.load();
+        return *this;
+    }
+
+    // Number of state values per weight
+
+    std::size_t num_states() const
+    {
+        return (type == adam) ? 2 : ((type == sgd) ? 0 : 1);
+    }
+
+    // Updates n weights w with the gradients g, given the learning rate
+    // eta. m and v are the first and second state values of the weights
+    // (unused ones can be null).
+
+    void update( double eta, double* w, const double* g,
+                 double* m, double* v, std::size_t n ) const
+    {
+        switch ( type )
+        {
+        case momentum:
+            for ( std::size_t i = 0; i < n; ++i )
+            {
+                m[i] = mu * m[i] - eta * g[i];
+                w[i] += m[i];
+            }
+            break;
+
+        case nesterov:
+            // Sutskever's formulation, the gradient being evaluated at
+            // the current weights
+            for ( std::size_t i = 0; i < n; ++i )
+            {
+                double old = m[i];
+                m[i] = mu * m[i] - eta * g[i];
+                w[i] += (1 + mu) * m[i] - mu * old;
+            }
+            break;
+
+        case adam:
+            {
+                uint64_t k  = step.load();
+                double   t  = static_cast<double>(k ? k : 1);
+                double   lr = eta * std::sqrt(1 - std::pow(beta2, t))
+                    / (1 - std::pow(beta1, t));
+
+                for ( std::size_t i = 0; i < n; ++i )
+                {
+                    m[i] = beta1 * m[i] + (1 - beta1) * g[i];
+                    v[i] = beta2 * v[i] + (1 - beta2) * g[i] * g[i];
+                    w[i] -= lr * m[i] / (std::sqrt(v[i]) + epsilon);
+                }
+            }
+            break;
+
+        default:
+            for ( std::size_t i = 0; i < n; ++i )
+            {
+                w[i] -= eta * g[i];
+            }
+        }
+    }
+
+}; // struct optimizer
+
+}} // namespace zi::znn
@@ -6,17 +6,21 @@
 #include <stdexcept>
 #include <functional>
 #include <atomic>
+#include <exception>
 
 #include <zi/async.hpp>
 
 #include "layered_network.hpp"
 #include "layered_network_data.hpp"
+#include "batch_gradient.hpp"
+#include "shared_filter_spectra.hpp"
 #include "../transfer_fn/transfer_fn.hpp"
 #include "../core/cube_utils.hpp"
 #include "../core/fft.hpp"
 #include "../core/carrier.hpp"
 #include "../convolution/sparse_convolve.hpp"
 #include "../core/cube_pool.hpp"
+#include "../core/trace.hpp"
 #include "../pooling/pooling_filter_2.hpp"
 
 
@@ -33,6 +37,9 @@ public:
     virtual void init(const vec3s&) = 0;
     virtual void run_forward(size_t) = 0;
     virtual void run_backward(size_t, unique_cube<double>&) = 0;
+
+    // Forgets the partial results of a failed pass
+    virtual void reset() = 0;
 };
 
 template< class Net >
@@ -45,6 +52,7 @@ private:
         unique_cube<double>   grad           ;
         std::mutex            mutex          ;
         size_t                received = 0   ;
+        std::atomic<size_t>   consumers{0}   ; // inference only
     };
 
     struct output_perceptron_data
@@ -85,6 +93,18 @@ public:
     }
 
 private:
+    // The tasks: an error fails the pass, see parallel_network::run_task
+
+    void forward_filter_task(size_t i, size_t o)
+    {
+        network_.run_task([&]() { forward_filter(i, o); });
+    }
+
+    void backward_filter_task(size_t l, size_t r, unique_cube<double>& g)
+    {
+        network_.run_task([&]() { backward_filter(l, r, g); });
+    }
+
     void forward_filter(size_t i, size_t o)
     {
         const unique_cube<double>& f = data_.input_featuremap(layer_no_, i);
@@ -96,49 +116,95 @@ private:
 
         // Convolve the featuremap with the appropriate filter
 
-        unique_cube<double> convolved =
-            sparse_convolve(*f, data_.filter(layer_no_,i,o), sparsness);
+        unique_cube<double> convolved;
+
+        {
+            trace::scope ts(trace::convolve);
+            guard g = data_.lock_weights(layer_no_, i, o);
+            convolved = sparse_convolve(*f, data_.filter(layer_no_,i,o),
+                                        sparsness);
+        }
+
+        // Without a backward pass, the input is not needed once all the
+        // filters have seen it
+
+        if ( network_.inference() && --inputs_[i].consumers == 0 )
+        {
+            data_.input_featuremap(layer_no_, i).reset();
+        }
 
         unique_cube<double>&    fout = data_.featuremap(layer_no_, o);
         output_perceptron_data& perc = outputs_[o];
 
-        while (1)
         {
-            unique_cube<double> old;
+            trace::scope ts(trace::accumulate);
+
+            while (1)
             {
-                guard g(perc.mutex);
-                if ( perc.received == 0 )
-                {
-                    ++perc.received;
-                    fout = std::move(convolved);
-                    break;
-                }
-                else
+                unique_cube<double> old;
                 {
-                    if ( fout )
-                    {
-                        old = std::move(fout);
-                    }
-                    else
+                    guard g(perc.mutex);
+                    if ( perc.received == 0 )
                     {
                         ++perc.received;
                         fout = std::move(convolved);
                         break;
                     }
+                    else
+                    {
+                        if ( fout )
+                        {
+                            old = std::move(fout);
+                        }
+                        else
+                        {
+                            ++perc.received;
+                            fout = std::move(convolved);
+                            break;
+                        }
+                    }
                 }
+                *convolved += *old;
             }
-            *convolved += *old;
         }
 
+        bool done = false;
+
         {
             guard g(perc.mutex);
             if ( perc.received == inputs_.size() )
             {
                 perc.received = 0;
+                done = true;
+            }
+        }
+
+        if ( done )
+        {
+            {
+                trace::scope ts(trace::epilogue);
 
-                transfer_fn_.add_apply(data_.bias(layer_no_,o), *fout);
+                double bias;
+                {
+                    guard g = data_.lock_weights(layer_no_, inputs_.size(), o);
+                    bias = data_.bias(layer_no_,o);
+                }
+
+                transfer_fn_.add_apply(bias, *fout);
+            }
 
-                if ( data_.pooling_size(layer_no_) != vec3s::one )
+            if ( data_.pooling_size(layer_no_) != vec3s::one )
+            {
+                trace::scope ts(trace::pooling);
+
+                if ( network_.inference() )
+                {
+                    fout = pooling_filter_2_destructive(*fout,
+                                                        std::greater<double>(),
+                                                        data_.pooling_size(layer_no_),
+                                                        sparsness);
+                }
+                else
                 {
                     auto pooled =
                         pooling_filter_2(*fout, std::greater<double>(),
@@ -148,9 +214,9 @@ private:
                     fout = std::move(pooled.first);
                     perc.pooling_indices = std::move(pooled.second);
                 }
-
-                zi::async::async(&Net::forward_done, &network_, layer_no_, o);
             }
+
+            network_.forward_done(layer_no_, o);
         }
     }
 
@@ -165,55 +231,100 @@ private:
 
         input_perceptron_data& perceptron = inputs_[l];
 
-        // This is where we would implement momentum
-        dEdW = sparse_convolve_flipped(*ifmap, *g, sparsness);
+        {
+            trace::scope ts(trace::convolve);
+            dEdW = sparse_convolve_flipped(*ifmap, *g, sparsness);
+        }
+
+        // Within a minibatch, the last sample to contribute stores the
+        // averaged gradient
+
+        if ( batch_gradient* batch = network_.batch() )
+        {
+            unique_cube<double> sum =
+                batch->add_dEdW(layer_no_, l, r, std::move(dEdW));
+
+            if ( sum )
+            {
+                *sum /= batch->size();
+                batch->dEdW(layer_no_, l, r) = std::move(sum);
+            }
+        }
+
+        // The filter is still needed for the gradient of the hidden
+        // layers, so the fused update is only done after that
+
+        if ( network_.fused_update() && layer_no_ == 0 )
+        {
+            data_.apply_filter_grad(layer_no_, l, r);
+        }
 
         if ( layer_no_ > 0 )
         {
-            unique_cube<double> gadd =
-                sparse_convolve_inverse(*g, data_.filter(layer_no_,l,r),
-                                        sparsness);
+            unique_cube<double> gadd;
 
-            while (1)
             {
-                unique_cube<double> old;
+                trace::scope ts(trace::convolve);
+                guard gd = data_.lock_weights(layer_no_, l, r);
+                gadd = sparse_convolve_inverse(*g, data_.filter(layer_no_,l,r),
+                                               sparsness);
+            }
+
+            if ( network_.fused_update() )
+            {
+                data_.apply_filter_grad(layer_no_, l, r);
+            }
+
+            {
+                trace::scope ts(trace::accumulate);
 
+                while (1)
                 {
-                    guard gd(perceptron.mutex);
+                    unique_cube<double> old;
 
-                    if ( perceptron.received == 0 )
-                    {
-                        ++perceptron.received;
-                        perceptron.grad = std::move(gadd);
-                        break;
-                    }
-                    else
                     {
-                        if ( perceptron.grad )
+                        guard gd(perceptron.mutex);
+
+                        if ( perceptron.received == 0 )
                         {
-                            old = std::move(perceptron.grad);
+                            ++perceptron.received;
+                            perceptron.grad = std::move(gadd);
+                            break;
                         }
                         else
                         {
-                            perceptron.grad = std::move(gadd);
-                            ++perceptron.received;
-                            break;
+                            if ( perceptron.grad )
+                            {
+                                old = std::move(perceptron.grad);
+                            }
+                            else
+                            {
+                                perceptron.grad = std::move(gadd);
+                                ++perceptron.received;
+                                break;
+                            }
                         }
                     }
-                }
 
-                *gadd += *old;
+                    *gadd += *old;
+                }
             }
 
+            bool done = false;
+
             {
                 guard g(perceptron.mutex);
                 if ( perceptron.received == outputs_.size() )
                 {
                     perceptron.received = 0;
-                    zi::async::async( &Net::backward_done, &network_,layer_no_,
-                                      l, std::ref(perceptron.grad));
+                    done = true;
                 }
             }
+
+            if ( done )
+            {
+                network_.backward_done(layer_no_, l, perceptron.grad);
+            }
         }
         else
         {
@@ -222,13 +333,29 @@ private:
             if ( perceptron.received == outputs_.size() )
             {
                 perceptron.received = 0;
-                zi::async::async( &Net::backward_done, &network_,layer_no_, l,
-                                  std::ref(perceptron.grad));
+                network_.backward_done(layer_no_, l, perceptron.grad);
             }
         }
     }
 
 
+    void store_dEdB(size_t p, double dEdB)
+    {
+        if ( batch_gradient* batch = network_.batch() )
+        {
+            batch->add_dEdB(layer_no_, p, dEdB);
+        }
+        else
+        {
+            data_.dEdB(layer_no_, p) = dEdB;
+
+            if ( network_.fused_update() )
+            {
+                data_.apply_bias_grad(layer_no_, p);
+            }
+        }
+    }
+
 public:
 
     void init( const vec3s& sparse )
@@ -239,42 +366,95 @@ public:
 
     void run_forward(size_t pno)
     {
+        trace::attribute_to ta(layer_no_, pno);
+
         // shouldn't have to lock here
         ZI_ASSERT(pno<inputs_.size());
         ZI_ASSERT(inputs_[pno].received==0);
 
-        for ( size_t i = 0; i < outputs_.size(); ++i )
+        // Memory estimate of a filter task: the convolved featuremap
+
+        vec3s out_size = size(*data_.input_featuremap(layer_no_, pno))
+            + vec3s::one
+            - (data_.filter_size(layer_no_) - vec3s::one) * sparsness;
+
+        size_t bytes = sizeof(double) * out_size[0] * out_size[1] * out_size[2];
+
+        // The last task can complete the whole pass (after which the
+        // network may be gone) before we exit the loop, so the members
+        // are not to be touched after the last submission
+
+        size_t n = outputs_.size();
+
+        inputs_[pno].consumers = n;
+
+        network_.add_tasks(n);
+
+        for ( size_t i = 0; i < n; ++i )
         {
-            zi::async::async_priority(layer_no_ * 1000 + pno,
-                                      &this_type::forward_filter, this,
+            trace::async_priority_mem(layer_no_ * 1000 + pno, bytes,
+                                      trace::forward_task, layer_no_, i,
+                                      &this_type::forward_filter_task, this,
                                       pno, i);
         }
     }
 
     void run_backward(size_t perceptron_no, unique_cube<double>& g)
     {
+        trace::attribute_to ta(layer_no_, perceptron_no);
+
         ZI_ASSERT(perceptron_no<outputs_.size());
         ZI_ASSERT(outputs_[perceptron_no].received==0);
 
-        transfer_fn_.apply_grad(*g, *data_.featuremap(layer_no_,
-                                                      perceptron_no));
+        {
+            trace::scope ts(trace::epilogue);
 
+            transfer_fn_.apply_grad(*g, *data_.featuremap(layer_no_,
+                                                          perceptron_no));
 
-        data_.dEdB(layer_no_, perceptron_no) = arma::accu(*g);
+            store_dEdB(perceptron_no, arma::accu(*g));
+        }
 
         if ( data_.pooling_size(layer_no_) != vec3s::one )
         {
+            trace::scope ts(trace::pooling);
             g = pooling_filter_2_bprop(
                 *g, *outputs_[perceptron_no].pooling_indices,
                 data_.pooling_size(layer_no_),
                 sparsness);
         }
 
-        for ( size_t i = 0; i < inputs_.size(); ++i )
+        // Memory estimate of a filter task: dEdW and the gradient
+        // propagated to the input featuremap
+
+        size_t bytes = sizeof(double) *
+            ( data_.input_featuremap(layer_no_, 0)->n_elem +
+              data_.filter(layer_no_, 0, perceptron_no).n_elem );
+
+        size_t n = inputs_.size();
+
+        network_.add_tasks(n);
+
+        for ( size_t i = 0; i < n; ++i )
+        {
+            trace::async_priority_mem(2000000 - layer_no_*1000 - perceptron_no,
+                                      bytes, trace::backward_task, layer_no_,
+                                      i, &this_type::backward_filter_task, this,
+                                      i, perceptron_no, std::ref(g));
+        }
+    }
+
+    void reset()
+    {
+        for ( auto& p: inputs_ )
+        {
+            p.received = 0;
+            p.grad.reset();
+        }
+
+        for ( auto& p: outputs_ )
         {
-            zi::async::async_priority(2000000 - layer_no_*1000 - perceptron_no,
-                                      &this_type::backward_filter, this, i,
-                                      perceptron_no, std::ref(g));
+            p.received = 0;
         }
     }
 
@@ -294,8 +474,16 @@ private:
         unique_cube<complex>  featuremap_fft ;
         unique_cube<complex>  grad_fft       ;
 
+        // The transform of the input, when given to the forward pass
+        // instead of featuremap_fft (inference only)
+
+        std::shared_ptr<const cube<complex>> shared_fft;
+
         std::vector<unique_cube<complex>> w_fft      ;
         std::vector<vec3s>                w_fft_sizes;
+
+        vec3s                 size           ; // of the featuremap
+        std::atomic<size_t>   consumers{0}   ; // inference only
     };
 
     struct output_perceptron_data
@@ -340,97 +528,180 @@ public:
     }
 
 private:
-    void forward_filter(size_t i, size_t o)
+    // The tasks: an error fails the pass, see parallel_network::run_task
+
+    void forward_filter_task(size_t i, size_t o)
     {
-        // f is the reference to the input featuremap, we mostly need it
-        // to get the size of the featuremap for the fft calls
+        network_.run_task([&]() { forward_filter(i, o); });
+    }
 
-        const unique_cube<double>& f = data_.input_featuremap(layer_no_, i);
+    void backward_filter_task(size_t l, size_t r)
+    {
+        network_.run_task([&]() { backward_filter(l, r); });
+    }
 
-        ZI_ASSERT(inputs_[i].featuremap_fft);
+    void forward_filter(size_t i, size_t o)
+    {
+        ZI_ASSERT(inputs_[i].featuremap_fft||inputs_[i].shared_fft);
         ZI_ASSERT(inputs_[i].received==0);
         ZI_ASSERT(i<inputs_.size());
         ZI_ASSERT(o<outputs_.size());
-        ZI_ASSERT(f);
 
         input_perceptron_data&  iperc = inputs_[i];
         output_perceptron_data& operc = outputs_[o];
 
+        // The size of the input featuremap, for the fft calls (the
+        // featuremap itself is gone in the inference mode)
+
+        const vec3s fsize = iperc.size;
 
         // Compute the filter's transform, in the case it's not already there
         // Or if the input size had changed.
 
-        if ( (!iperc.w_fft[o]) ||
-             (size(*f) != iperc.w_fft_sizes[o] ) )
+        // Or, given the transforms of the filters of another network,
+        // the transform of this filter being one of them flipped, that
+        // one (see shared_filter_spectra)
+
+        std::shared_ptr<const cube<complex>> shared_w;
+
+        if ( network_.filter_spectra() )
+        {
+            shared_w = network_.filter_spectra()->get(
+                layer_no_, i, o, sparsness, fsize,
+                network_.keep_filter_transforms());
+        }
+        else if ( (!iperc.w_fft[o]) ||
+                  (fsize != iperc.w_fft_sizes[o] ) )
         {
+            guard g = data_.lock_weights(layer_no_, i, o);
             iperc.w_fft[o] =
                 fftw::forward_pad( data_.filter(layer_no_,i,o),
-                                   sparsness, size(*f) );
-            iperc.w_fft_sizes[o] = size(*f);
+                                   sparsness, fsize );
+            iperc.w_fft_sizes[o] = fsize;
         }
 
         // Convolve (pairwise multiplication of the fft transforms)
         // the featuremap with the appropriate filter
 
-        unique_cube<complex> to_add =
-            pool<complex>::get_unique_copy(*iperc.featuremap_fft);
+        unique_cube<complex> to_add;
+
+        {
+            trace::scope ts(trace::mult);
+            to_add = pool<complex>::get_unique_copy(
+                iperc.shared_fft ? *iperc.shared_fft : *iperc.featuremap_fft);
+
+            if ( shared_w )
+            {
+                pairwise_mult_flipped(*to_add, *shared_w, fsize,
+                                      real_filter_size,
+                                      network_.filter_flips());
+            }
+            else
+            {
+                pairwise_mult(*to_add, *inputs_[i].w_fft[o]);
+            }
+        }
+
+        // Without a backward pass, the transform of the input is not
+        // needed once all the filters have seen it
+
+        if ( network_.inference() && --iperc.consumers == 0 )
+        {
+            iperc.featuremap_fft.reset();
+            iperc.shared_fft.reset();
+        }
 
-        pairwise_mult(*to_add, *inputs_[i].w_fft[o]);
+        if ( network_.inference() && !network_.keep_filter_transforms() )
+        {
+            iperc.w_fft[o].reset();
+        }
 
         // Update the output perceptron
 
-        while (1)
         {
-            unique_cube<complex> old;
+            trace::scope ts(trace::accumulate);
+
+            while (1)
             {
-                guard g(operc.mutex);
-                if ( operc.received == 0 )
-                {
-                    ++operc.received;
-                    operc.featuremap_fft = std::move(to_add);
-                    break;
-                }
-                else
+                unique_cube<complex> old;
                 {
-                    if ( operc.featuremap_fft )
-                    {
-                        old = std::move(operc.featuremap_fft);
-                    }
-                    else
+                    guard g(operc.mutex);
+                    if ( operc.received == 0 )
                     {
                         ++operc.received;
                         operc.featuremap_fft = std::move(to_add);
                         break;
                     }
+                    else
+                    {
+                        if ( operc.featuremap_fft )
+                        {
+                            old = std::move(operc.featuremap_fft);
+                        }
+                        else
+                        {
+                            ++operc.received;
+                            operc.featuremap_fft = std::move(to_add);
+                            break;
+                        }
+                    }
                 }
+                *to_add += *old;
             }
-            *to_add += *old;
         }
 
         // Check if this is the last perceptron to send values to the outgoing
         // perceptron. In which case we are ready to process the target
         // perceptron
 
+        bool done = false;
+
         {
             guard g(operc.mutex);
             if ( operc.received == inputs_.size() )
             {
                 operc.received = 0;
+                done = true;
+            }
+        }
+
+        if ( done )
+        {
+            unique_cube<double>& fout = data_.featuremap(layer_no_, o);
 
-                unique_cube<double>& fout = data_.featuremap(layer_no_, o);
+            auto x = fftw::backward( *operc.featuremap_fft, fsize );
+            operc.featuremap_fft.reset();
 
-                auto x = fftw::backward( *operc.featuremap_fft, size(*f) );
-                operc.featuremap_fft.reset();
+            vec3s out_f_size = fsize + vec3s::one - real_filter_size;
 
-                vec3s out_f_size = size(*f) + vec3s::one - real_filter_size;
+            {
+                trace::scope ts(trace::epilogue);
 
                 fout = crop_right(*x, out_f_size);
 
                 *fout /= x->n_elem;
 
-                transfer_fn_.add_apply(data_.bias(layer_no_,o), *fout);
+                double bias;
+                {
+                    guard g = data_.lock_weights(layer_no_, inputs_.size(), o);
+                    bias = data_.bias(layer_no_,o);
+                }
+
+                transfer_fn_.add_apply(bias, *fout);
+            }
+
+            if ( data_.pooling_size(layer_no_) != vec3s::one )
+            {
+                trace::scope ts(trace::pooling);
 
-                if ( data_.pooling_size(layer_no_) != vec3s::one )
+                if ( network_.inference() )
+                {
+                    fout = pooling_filter_2_destructive(*fout,
+                                                        std::greater<double>(),
+                                                        data_.pooling_size(layer_no_),
+                                                        sparsness);
+                }
+                else
                 {
                     auto pooled =
                         pooling_filter_2(*fout, std::greater<double>(),
@@ -440,9 +711,9 @@ private:
                     fout = std::move(pooled.first);
                     operc.pooling_indices = std::move(pooled.second);
                 }
-
-                zi::async::async(&Net::forward_done, &network_, layer_no_, o);
             }
+
+            network_.forward_done(layer_no_, o);
         }
     }
 
@@ -459,28 +730,69 @@ private:
 
         vec3s s = size(*f);
 
-        auto dEdW_fft = pool<complex>::get_unique_copy(*operc.grad_fft);
+        unique_cube<complex> dEdW_fft;
 
-        pairwise_mult(*dEdW_fft, *iperc.featuremap_fft);
+        {
+            trace::scope ts(trace::mult);
+            dEdW_fft = pool<complex>::get_unique_copy(*operc.grad_fft);
+            pairwise_mult(*dEdW_fft, *iperc.featuremap_fft);
+        }
+
+        // Within a minibatch the spectra of all the samples are summed
+        // first, and only the last sample to contribute performs the
+        // inverse transform
+
+        batch_gradient* batch = network_.batch();
+
+        if ( batch )
+        {
+            dEdW_fft = batch->add_dEdW_fft(layer_no_, l, r,
+                                           std::move(dEdW_fft));
+        }
+
+        if ( dEdW_fft )
+        {
+            unique_cube<double>& dEdW = batch
+                ? batch->dEdW(layer_no_,l,r)
+                : data_.dEdW(layer_no_,l,r);
+
+            dEdW = fftw::backward(*dEdW_fft, s);
+            dEdW_fft.reset();
 
-        unique_cube<double>& dEdW = data_.dEdW(layer_no_,l,r);
+            trace::scope ts(trace::epilogue);
 
-        dEdW = fftw::backward(*dEdW_fft, s);
+            dEdW = sparse_implode_flip( *dEdW,
+                                        size(data_.filter(layer_no_,l,r)),
+                                        sparsness );
+
+            *dEdW /= s[0]*s[1]*s[2] * ( batch ? batch->size() : 1 );
+        }
 
-        dEdW = sparse_implode_flip( *dEdW, size(data_.filter(layer_no_,l,r)),
-                                    sparsness );
+        // The fused update can be applied right away, as the gradient
+        // below only needs the transform of the filter. The transform
+        // is then out of date, and recomputed on the next forward pass.
 
+        bool fused = network_.fused_update();
 
-        *dEdW /= s[0]*s[1]*s[2];
+        if ( fused )
+        {
+            data_.apply_filter_grad(layer_no_, l, r);
+        }
 
         unique_cube<complex> to_add;
 
         if ( layer_no_ > 0 )
         {
+            trace::scope ts(trace::mult);
             to_add = pool<complex>::get_unique_copy(*operc.grad_fft);
             pairwise_mult(*to_add, *inputs_[l].w_fft[r]);
         }
 
+        if ( fused )
+        {
+            iperc.w_fft[r].reset();
+        }
+
         if ( --operc.grad_fft_to_send == 0 )
         {
             operc.grad_fft.reset();
@@ -488,53 +800,64 @@ private:
 
         if ( layer_no_ > 0 )
         {
-            while (1)
             {
-                unique_cube<complex> old;
+                trace::scope ts(trace::accumulate);
 
+                while (1)
                 {
-                    guard gd(iperc.mutex);
+                    unique_cube<complex> old;
 
-                    if ( iperc.received == 0 )
-                    {
-                        ++iperc.received;
-                        iperc.grad_fft = std::move(to_add);
-                        break;
-                    }
-                    else
                     {
-                        if ( iperc.grad_fft )
+                        guard gd(iperc.mutex);
+
+                        if ( iperc.received == 0 )
                         {
-                            old = std::move(iperc.grad_fft);
+                            ++iperc.received;
+                            iperc.grad_fft = std::move(to_add);
+                            break;
                         }
                         else
                         {
-                            iperc.grad_fft = std::move(to_add);
-                            ++iperc.received;
-                            break;
+                            if ( iperc.grad_fft )
+                            {
+                                old = std::move(iperc.grad_fft);
+                            }
+                            else
+                            {
+                                iperc.grad_fft = std::move(to_add);
+                                ++iperc.received;
+                                break;
+                            }
                         }
                     }
-                }
 
-                *to_add += *old;
+                    *to_add += *old;
+                }
             }
 
+            bool done = false;
+
             {
                 guard g(iperc.mutex);
                 if ( iperc.received == outputs_.size() )
                 {
                     iperc.received = 0;
+                    done = true;
+                }
+            }
 
-                    iperc.grad = fftw::backward(*iperc.grad_fft, size(*f));
-                    iperc.grad_fft.reset();
+            if ( done )
+            {
+                iperc.grad = fftw::backward(*iperc.grad_fft, size(*f));
+                iperc.grad_fft.reset();
 
+                {
+                    trace::scope ts(trace::epilogue);
                     flip_dims(*iperc.grad);
                     *iperc.grad /= iperc.grad->n_elem;
-
-
-                    zi::async::async( &Net::backward_done, &network_,layer_no_,
-                                      l, std::ref(iperc.grad));
                 }
+
+                network_.backward_done(layer_no_, l, iperc.grad);
             }
         }
         else
@@ -544,13 +867,29 @@ private:
             if ( iperc.received == outputs_.size() )
             {
                 iperc.received = 0;
-                zi::async::async( &Net::backward_done, &network_,layer_no_, l,
-                                  std::ref(iperc.grad));
+                network_.backward_done(layer_no_, l, iperc.grad);
             }
         }
     }
 
 
+    void store_dEdB(size_t p, double dEdB)
+    {
+        if ( batch_gradient* batch = network_.batch() )
+        {
+            batch->add_dEdB(layer_no_, p, dEdB);
+        }
+        else
+        {
+            data_.dEdB(layer_no_, p) = dEdB;
+
+            if ( network_.fused_update() )
+            {
+                data_.apply_bias_grad(layer_no_, p);
+            }
+        }
+    }
+
 public:
 
     void init( const vec3s& sparse )
@@ -568,17 +907,28 @@ public:
         network_.init_done(layer_no_, sparse * data_.pooling_size(layer_no_));
     }
 
-    void run_forward(size_t pno)
+    // The transform of the input featuremap, as a task of its own, so
+    // the transforms of a wide layer's inputs are admitted under the
+    // scheduler's memory budget like the filter tasks
+
+    void transform_input_task(size_t pno)
     {
-        // shouldn't have to lock here
-        ZI_ASSERT(pno<inputs_.size());
-        ZI_ASSERT(inputs_[pno].received==0);
+        network_.run_task([&]() {
+                trace::attribute_to ta(layer_no_, pno);
 
+                inputs_[pno].featuremap_fft =
+                    fftw::forward_copy(*data_.input_featuremap(layer_no_, pno));
+                inputs_[pno].size =
+                    size(*data_.input_featuremap(layer_no_, pno));
 
-        // The input featuremap tranforms are saved in order to calculate dEdW.
+                run_filters(pno);
+            });
+    }
 
-        inputs_[pno].featuremap_fft =
-            fftw::forward_copy(*data_.input_featuremap(layer_no_, pno));
+    void run_filters(size_t pno)
+    {
+        const cube<complex>& in_fft = inputs_[pno].shared_fft
+            ? *inputs_[pno].shared_fft : *inputs_[pno].featuremap_fft;
 
         // Check the filter transforms. We want to cache them, but we
         // clear them on the gradient update by clearing the whole vector.
@@ -587,18 +937,89 @@ public:
         inputs_[pno].w_fft.resize(outputs_.size());
         inputs_[pno].w_fft_sizes.resize(outputs_.size());
 
-        // Envoke a task for each of the perceptron' filters
+        // Memory estimate of a filter task (for the scheduler's budget):
+        // the product of the transforms, plus the padded filter and its
+        // transform when the filter's transform is not cached
+
+        const vec3s& is = inputs_[pno].size;
+
+        size_t spectrum_bytes = in_fft.n_elem * sizeof(complex);
+        size_t filter_bytes   = spectrum_bytes + sizeof(double) *
+            is[0] * is[1] * is[2];
+
+        // Without a backward pass, only the transform of the input is
+        // needed from now on
 
-        for ( size_t i = 0; i < outputs_.size(); ++i )
+        if ( network_.inference() )
         {
-            zi::async::async_priority(layer_no_ * 1000 + pno,
-                                      &this_type::forward_filter, this,
+            data_.input_featuremap(layer_no_, pno).reset();
+        }
+
+        // Envoke a task for each of the perceptron' filters
+
+        size_t n = outputs_.size();
+
+        inputs_[pno].consumers = n;
+
+        network_.add_tasks(n);
+
+        for ( size_t i = 0; i < n; ++i )
+        {
+            bool cached = network_.filter_spectra()
+                ? network_.filter_spectra()->cached(layer_no_, pno, i, is)
+                : static_cast<bool>(inputs_[pno].w_fft[i]);
+
+            size_t bytes = spectrum_bytes;
+            if ( !cached )
+            {
+                bytes += filter_bytes;
+            }
+
+            trace::async_priority_mem(layer_no_ * 1000 + pno, bytes,
+                                      trace::forward_task, layer_no_, i,
+                                      &this_type::forward_filter_task, this,
                                       pno, i);
         }
     }
 
+    void run_forward(size_t pno)
+    {
+        trace::attribute_to ta(layer_no_, pno);
+
+        // shouldn't have to lock here
+        ZI_ASSERT(pno<inputs_.size());
+        ZI_ASSERT(inputs_[pno].received==0);
+
+        // The input featuremap tranforms are saved in order to calculate dEdW.
+        // The transforms of the network's inputs may be given instead.
+
+        if ( layer_no_ == 0 && network_.input_spectrum(pno) )
+        {
+            inputs_[pno].shared_fft = std::move(network_.input_spectrum(pno));
+            inputs_[pno].size       = network_.input_spectrum_size();
+            run_filters(pno);
+            return;
+        }
+
+        // Memory estimate of the transform: the spectrum and the copy
+        // of the featuremap transformed in place
+
+        vec3s  is    = size(*data_.input_featuremap(layer_no_, pno));
+        vec3s  cs    = fft_complex_size(is);
+        size_t bytes = sizeof(complex) * cs[0] * cs[1] * cs[2]
+            + sizeof(double) * is[0] * is[1] * is[2];
+
+        network_.add_tasks(1);
+
+        trace::async_priority_mem(layer_no_ * 1000 + pno, bytes,
+                                  trace::forward_task, layer_no_, pno,
+                                  &this_type::transform_input_task, this, pno);
+    }
+
     void run_backward(size_t perceptron_no, unique_cube<double>& g)
     {
+        trace::attribute_to ta(layer_no_, perceptron_no);
+
         ZI_ASSERT(perceptron_no<outputs_.size());
         ZI_ASSERT(outputs_[perceptron_no].received==0);
 
@@ -610,20 +1031,28 @@ public:
         const unique_cube<double>& f =
             data_.featuremap(layer_no_, perceptron_no);
 
-        transfer_fn_.apply_grad(*g, *f);
+        {
+            trace::scope ts(trace::epilogue);
+
+            transfer_fn_.apply_grad(*g, *f);
 
-        data_.dEdB(layer_no_, perceptron_no) = arma::accu(*g);
+            store_dEdB(perceptron_no, arma::accu(*g));
+        }
 
         // If sparse, decompress the sparsed gradient
 
         if ( data_.pooling_size(layer_no_) != vec3s::one )
         {
+            trace::scope ts(trace::pooling);
             g = pooling_filter_2_bprop( *g, *operc.pooling_indices,
                                         data_.pooling_size(layer_no_),
                                         sparsness);
         }
 
-        flip_dims(*g);
+        {
+            trace::scope ts(trace::epilogue);
+            flip_dims(*g);
+        }
 
         // might be able to get rid of this
         vec3s in_f_size = size(*g) + real_filter_size - vec3s::one;
@@ -635,11 +1064,47 @@ public:
         // clear the memory for grad
         g.reset();
 
-        for ( size_t i = 0; i < inputs_.size(); ++i )
+        // Memory estimate of a filter task: the product of the transforms
+        // and its inverse, plus the gradient's product for hidden layers
+
+        size_t spectrum_bytes = operc.grad_fft->n_elem * sizeof(complex);
+        size_t bytes = spectrum_bytes + sizeof(double) *
+            in_f_size[0] * in_f_size[1] * in_f_size[2];
+
+        if ( layer_no_ > 0 )
+        {
+            bytes += spectrum_bytes;
+        }
+
+        size_t n = inputs_.size();
+
+        network_.add_tasks(n);
+
+        for ( size_t i = 0; i < n; ++i )
+        {
+            trace::async_priority_mem(2000000 - layer_no_*1000 - perceptron_no,
+                                      bytes, trace::backward_task, layer_no_,
+                                      i, &this_type::backward_filter_task, this,
+                                      i, perceptron_no);
+        }
+    }
+
+    void reset()
+    {
+        for ( auto& p: inputs_ )
         {
-            zi::async::async_priority(2000000 - layer_no_*1000 - perceptron_no,
-                                      &this_type::backward_filter, this, i,
-                                      perceptron_no);
+            p.received  = 0;
+            p.consumers = 0;
+            p.grad.reset();
+            p.grad_fft.reset();
+            p.shared_fft.reset();
+        }
+
+        for ( auto& p: outputs_ )
+        {
+            p.received = 0;
+            p.featuremap_fft.reset();
+            p.grad_fft.reset();
         }
     }
 
@@ -655,22 +1120,200 @@ private:
     typedef std::unique_ptr<parallel_network_layer>         layer_ptr ;
     typedef std::vector<cube<double>>                       cubes_type;
 
+    typedef zi::async::promise<void>                        forward_promise;
+    typedef zi::async::promise<unique_cube<double>*>        backward_promise;
+
 private:
     layered_network_data&  net_;
     transfer_fn            transfer_fn_;
     std::vector<layer_ptr> layers_;
-    waiter                 waiter_;
+
+    // One promise per perceptron of each layer, fulfilled when the
+    // perceptron is done. The next layer is started by the continuations,
+    // inline on the thread that completed the perceptron.
+
+    std::vector<std::vector<forward_promise>>  forward_done_ ;
+    std::vector<std::vector<backward_promise>> backward_done_;
+
+    // Ready once all the gradients of the layer (dEdW and dEdB) are
+    // computed in the current backward pass. Layers complete in order,
+    // from the last one to the first.
+
+    std::vector<zi::async::future<void>> gradients_ready_;
+
+    // Copies of the gradients of the backward pass in flight
+
+    std::vector<unique_cube<double>> grads_;
+
+    // When set, the gradients are accumulated into a minibatch instead
+    // of being stored in net_
+
+    batch_gradient* batch_ = nullptr;
+
+    // Apply the update of each weight as soon as its gradient is known,
+    // during the backward pass
+
+    bool fused_update_ = false;
+
+    // No backward pass: the featuremaps (but the outputs), their
+    // transforms and the pooling indices are dropped as soon as the
+    // forward pass is done with them
+
+    bool inference_ = false;
+
+    // The transforms of the filters are cached for the next pass (of
+    // the same input size). In the inference mode they can instead be
+    // dropped right after use, when memory is shorter than time.
+
+    bool keep_filter_transforms_ = true;
+
+    // The transforms of the inputs of the pass in flight, when given,
+    // and the size of the inputs
+
+    std::vector<std::shared_ptr<const cube<complex>>> input_spectra_     ;
+    vec3s                                             input_spectra_size_;
+
+    // The transforms of the filters, when taken from another network
+    // whose filters are these ones flipped along the axes k with
+    // filter_flips_[k] (inference only)
+
+    shared_filter_spectra*                            filter_spectra_ = nullptr;
+    vec3s                                             filter_flips_      ;
+
+    // The pass in flight is done once none of its tasks is left, the
+    // last one to finish fulfilling (or failing) its promise. An error
+    // of a task is kept, and the tasks started after it skip their work.
+
+    forward_promise          pass_        ;
+    std::atomic<size_t>      tasks_       {0};
+    std::atomic<bool>        failed_      {false};
+    std::exception_ptr       error_       ;
+    std::mutex               error_mutex_ ;
 
 private:
     void do_forward(size_t i, const cube<double>& f)
     {
-        net_.input(i) = pool<double>::get_unique_copy(f);
-        layers_.front()->run_forward(i);
+        run_task([&]() {
+                net_.input(i) = pool<double>::get_unique_copy(f);
+                layers_.front()->run_forward(i);
+            });
+    }
+
+    void do_forward_take(size_t i, unique_cube<double>& f)
+    {
+        run_task([&]() {
+                net_.input(i) = std::move(f);
+                layers_.front()->run_forward(i);
+            });
+    }
+
+    void do_forward_spectrum(size_t i)
+    {
+        run_task([&]() { layers_.front()->run_forward(i); });
+    }
+
+    // The last task of the pass is done. After a failure, the promises
+    // of the perceptrons not done are failed as well (so are the
+    // futures of gradients_ready()), and the layers made ready for the
+    // next pass.
+
+    void end_pass()
+    {
+        forward_promise p = pass_;
+
+        if ( !failed_ )
+        {
+            p.set_value();
+            return;
+        }
+
+        std::exception_ptr e = error_;
+
+        error_ = nullptr;
+        failed_ = false;
+
+        for ( auto& l: forward_done_ )
+        {
+            for ( auto& d: l ) d.set_exception(e);
+        }
+
+        for ( auto& l: backward_done_ )
+        {
+            for ( auto& d: l ) d.set_exception(e);
+        }
+
+        for ( auto& l: layers_ )
+        {
+            l->reset();
+        }
+
+        p.set_exception(e);
+    }
+
+    // Runs f (counted as a task of the pass) once the gate is complete,
+    // whether it failed or not, right away without a gate. Called from
+    // a task of the pass, or before its tasks are started.
+
+    void run_gated(const zi::async::future<void>& gate,
+                   std::function<void()> f)
+    {
+        if ( !gate.valid() )
+        {
+            f();
+            return;
+        }
+
+        add_tasks(1);
+        gate.on_complete([this,f]() { run_task(f); });
+    }
+
+    zi::async::future<void> begin_pass(size_t tasks)
+    {
+        pass_ = forward_promise();
+        tasks_ += tasks;
+        return pass_.get_future();
+    }
+
+    // Sets up the continuations of a forward pass, returns the future
+    // of the whole pass. The layers with a (valid) gate only start once
+    // it's complete.
+
+    zi::async::future<void>
+    prepare_forward(size_t tasks,
+                    const std::vector<zi::async::future<void>>& gates
+                    = std::vector<zi::async::future<void>>())
+    {
+        for ( size_t l = 0; l < layers_.size(); ++l )
+        {
+            forward_done_[l].clear();
+            forward_done_[l].resize(net_.layer(l).num_outputs());
+
+            for ( size_t p = 0; p < forward_done_[l].size(); ++p )
+            {
+                auto f = forward_done_[l][p].get_future();
+
+                if ( l + 1 < gates.size() && gates[l+1].valid() )
+                {
+                    parallel_network_layer* next = layers_[l+1].get();
+                    zi::async::future<void> g = gates[l+1];
+                    f.then([this,next,p,g]() {
+                            run_gated(g, [next,p]() { next->run_forward(p); });
+                        });
+                }
+                else if ( l < layers_.size() - 1 )
+                {
+                    parallel_network_layer* next = layers_[l+1].get();
+                    f.then([next,p]() { next->run_forward(p); });
+                }
+            }
+        }
+
+        return begin_pass(tasks);
     }
 
     void do_backward(size_t i, unique_cube<double>& g)
     {
-        layers_.back()->run_backward(i, g);
+        run_task([&]() { layers_.back()->run_backward(i, g); });
     }
 
 public:
@@ -685,10 +1328,133 @@ public:
         return net_;
     }
 
+    batch_gradient* batch()
+    {
+        return batch_;
+    }
+
+    void set_batch(batch_gradient* b)
+    {
+        batch_ = b;
+    }
+
+    // The fused update is not possible when the gradients have to be
+    // accumulated first
+
+    bool fused_update() const
+    {
+        return fused_update_ && !batch_;
+    }
+
+    void set_fused_update(bool f)
+    {
+        fused_update_ = f;
+    }
+
+    bool inference() const
+    {
+        return inference_;
+    }
+
+    void set_inference(bool i)
+    {
+        inference_ = i;
+    }
+
+    bool keep_filter_transforms() const
+    {
+        return keep_filter_transforms_;
+    }
+
+    void set_keep_filter_transforms(bool k)
+    {
+        keep_filter_transforms_ = k;
+    }
+
+    shared_filter_spectra* filter_spectra() const
+    {
+        return filter_spectra_;
+    }
+
+    const vec3s& filter_flips() const
+    {
+        return filter_flips_;
+    }
+
+    // The filters of the network are the ones of s flipped along the
+    // axes k with flips[k], s outliving the network. Only the forward
+    // pass uses them, so only the inference mode can take them.
+
+    void set_filter_spectra(shared_filter_spectra* s, const vec3s& flips)
+    {
+        if ( !inference_ )
+        {
+            throw std::logic_error("parallel_network: shared filter "
+                                   "transforms need the inference mode");
+        }
+
+        filter_spectra_ = s;
+        filter_flips_   = flips;
+    }
+
+    // The transform of the i-th input given to the pass in flight
+    // (taken by the first layer), null if not given
+
+    std::shared_ptr<const cube<complex>>& input_spectrum(size_t i)
+    {
+        return input_spectra_[i];
+    }
+
+    const vec3s& input_spectrum_size() const
+    {
+        return input_spectra_size_;
+    }
+
+    // Each task of a pass is counted before it's submitted, by its
+    // parent task (so the count only drops to zero with the last task),
+    // and runs its work through run_task. The future of a pass thus
+    // completes once all its tasks are done: the failed pass as well,
+    // so the network can be destroyed or reused right away. The tasks
+    // are not to touch the network after run_task.
+
+    void add_tasks(size_t n)
+    {
+        tasks_ += n;
+    }
+
+    template<typename F>
+    void run_task(F f)
+    {
+        if ( !failed_ )
+        {
+            try
+            {
+                f();
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> g(error_mutex_);
+                if ( !error_ )
+                {
+                    error_ = std::current_exception();
+                }
+                failed_ = true;
+            }
+        }
+
+        if ( --tasks_ == 0 )
+        {
+            end_pass();
+        }
+    }
+
     parallel_network(layered_network_data& net, transfer_fn tf)
         : net_(net)
         , transfer_fn_(tf)
         , layers_(net.num_layers())
+        , forward_done_(net.num_layers())
+        , backward_done_(net.num_layers())
+        , input_spectra_(net.num_inputs())
     {
         for ( size_t i = 0; i < layers_.size(); ++i )
         {
@@ -700,21 +1466,111 @@ public:
         layers_[0]->init(vec3s::one);
     }
 
-    cubes_type forward(const cubes_type& input)
+    // Starts the forward pass, the input has to stay alive until the
+    // returned future is ready. The future's get() rethrows the error
+    // of a failed pass.
+
+    zi::async::future<void> forward_async(const cubes_type& input)
     {
         ZI_ASSERT(input.size()>0);
         ZI_ASSERT(input.size()==net_.num_inputs());
 
-        waiter_.set(net_.num_outputs());
+        zi::async::future<void> done = prepare_forward(input.size());
 
         for ( size_t i = 0; i < input.size(); ++i )
         {
-            zi::async::async(&parallel_network::do_forward,
-                             this, i, std::ref(input[i]));
+            trace::async(trace::dispatch_task, 0, i,
+                         &parallel_network::do_forward,
+                         this, i, std::ref(input[i]));
         }
 
-        waiter_.wait();
+        return done;
+    }
+
+    // Same, each layer l starting only once gates[l] is complete (e.g.
+    // once its weights are updated by another pass), failed or not
+
+    zi::async::future<void>
+    forward_async(const cubes_type& input,
+                  const std::vector<zi::async::future<void>>& gates)
+    {
+        ZI_ASSERT(input.size()==net_.num_inputs());
+        ZI_ASSERT(gates.size()<=layers_.size());
+
+        zi::async::future<void> done = prepare_forward(input.size(), gates);
+
+        zi::async::future<void> g0 = gates.size() ? gates[0]
+            : zi::async::future<void>();
+
+        for ( size_t i = 0; i < input.size(); ++i )
+        {
+            const cube<double>* in = &input[i];
+            run_gated(g0, [this,i,in]() {
+                    trace::async(trace::dispatch_task, 0, i,
+                                 &parallel_network::do_forward,
+                                 this, i, std::cref(*in));
+                });
+        }
+
+        return done;
+    }
+
+    // Same, taking over the inputs (e.g. cubes of the pool filled in
+    // place), which saves a copy of each. The outputs are then found
+    // in data().output(i), until the next pass.
+
+    zi::async::future<void> forward_async(std::vector<unique_cube<double>>& input)
+    {
+        ZI_ASSERT(input.size()==net_.num_inputs());
+
+        zi::async::future<void> done = prepare_forward(input.size());
+
+        for ( size_t i = 0; i < input.size(); ++i )
+        {
+            trace::async(trace::dispatch_task, 0, i,
+                         &parallel_network::do_forward_take,
+                         this, i, std::ref(input[i]));
+        }
 
+        return done;
+    }
+
+    // Same, from the transforms (fftw::forward_copy) of the inputs of
+    // size s instead of the inputs themselves, in the inference mode
+    // only. The transforms are only read, so they can be shared with
+    // other networks over the same input size, e.g. the transformed
+    // copies of a network of the test time augmentation, each saving
+    // the transforms of the inputs.
+
+    zi::async::future<void>
+    forward_async(const std::vector<std::shared_ptr<const cube<complex>>>& spectra,
+                  const vec3s& s)
+    {
+        ZI_ASSERT(spectra.size()==net_.num_inputs());
+
+        if ( !inference_ )
+        {
+            throw std::logic_error("parallel_network: forward pass from "
+                                   "the transforms in the training mode");
+        }
+
+        zi::async::future<void> done = prepare_forward(spectra.size());
+
+        input_spectra_      = spectra;
+        input_spectra_size_ = s;
+
+        for ( size_t i = 0; i < spectra.size(); ++i )
+        {
+            trace::async(trace::dispatch_task, 0, i,
+                         &parallel_network::do_forward_spectrum,
+                         this, i);
+        }
+
+        return done;
+    }
+
+    cubes_type outputs()
+    {
         cubes_type ret(net_.num_outputs());
         for ( size_t i = 0; i < net_.num_outputs(); ++i )
         {
@@ -724,45 +1580,117 @@ public:
         return ret;
     }
 
-    void backward(const cubes_type& grads)
+    cubes_type forward(const cubes_type& input)
+    {
+        forward_async(input).get();
+        return outputs();
+    }
+
+    zi::async::future<void> backward_async(const cubes_type& grads)
     {
         ZI_ASSERT(grads.size()>0);
         ZI_ASSERT(grads.size()==net_.num_outputs());
 
-        waiter_.set(net_.num_inputs());
+        if ( inference_ )
+        {
+            throw std::logic_error("parallel_network: no backward pass "
+                                   "in the inference mode");
+        }
+
+        gradients_ready_.resize(layers_.size());
+
+        if ( fused_update() )
+        {
+            for ( size_t l = 0; l < layers_.size(); ++l )
+            {
+                net_.begin_layer_update(l);
+            }
+        }
+
+        for ( size_t l = 0; l < layers_.size(); ++l )
+        {
+            backward_done_[l].clear();
+            backward_done_[l].resize(net_.layer(l).num_inputs());
+
+            std::vector<zi::async::future<unique_cube<double>*>> layer_done;
+
+            for ( size_t p = 0; p < backward_done_[l].size(); ++p )
+            {
+                layer_done.push_back(backward_done_[l][p].get_future());
+            }
 
-        std::vector<unique_cube<double>> my_grads(grads.size());
+            // Attached first, so that the layer is reported as done
+            // before the continuations below start on the next layer
+
+            gradients_ready_[l] = zi::async::when_all(layer_done);
+
+            for ( size_t p = 0; p < backward_done_[l].size(); ++p )
+            {
+                if ( l > 0 )
+                {
+                    parallel_network_layer* prev = layers_[l-1].get();
+                    layer_done[p].then([prev,p](unique_cube<double>* g) {
+                            prev->run_backward(p, *g);
+                        });
+                }
+            }
+        }
+
+        zi::async::future<void> done = begin_pass(grads.size());
+
+        grads_.resize(grads.size());
 
         for ( size_t i = 0; i < grads.size(); ++i )
         {
-            my_grads[i] = pool<double>::get_unique_copy(grads[i]);
+            grads_[i] = pool<double>::get_unique_copy(grads[i]);
 
-            zi::async::async(&parallel_network::do_backward,
-                             this, i, std::ref(my_grads[i]));
+            trace::async(trace::dispatch_task, net_.num_layers() - 1, i,
+                         &parallel_network::do_backward,
+                         this, i, std::ref(grads_[i]));
         }
 
-        waiter_.wait();
+        return done;
+    }
 
+    void backward(const cubes_type& grads)
+    {
+        backward_async(grads).get();
     }
 
-    void grad_update()
+    // Of the current (or last) backward pass
+
+    zi::async::future<void> gradients_ready(size_t l) const
+    {
+        ZI_ASSERT(l<gradients_ready_.size());
+        return gradients_ready_[l];
+    }
+
+    // Has to be called whenever the filters change, as the layers
+    // cache their transforms
+
+    void init()
     {
-        net_.apply_grads();
         layers_[0]->init(vec3s::one);
     }
 
-    void forward_done(size_t l, size_t p)
+    // Nothing to do with the fused update, the weights are already
+    // updated by the backward pass (and only the transforms of the
+    // updated filters are dropped)
+
+    void grad_update()
     {
-        if ( l < net_.num_layers() - 1 )
+        if ( !fused_update() )
         {
-            layers_[l+1]->run_forward(p);
-        }
-        else
-        {
-            waiter_.one_done();
+            net_.apply_grads();
+            init();
         }
     }
 
+    void forward_done(size_t l, size_t p)
+    {
+        forward_done_[l][p].set_value();
+    }
+
     void init_done(size_t l, const vec3s& sparse)
     {
         if ( l < net_.num_layers() - 1 )
@@ -773,14 +1701,7 @@ public:
 
     void backward_done(size_t l, size_t p, unique_cube<double>& c)
     {
-        if ( l > 0 )
-        {
-            layers_[l-1]->run_backward(p, c);
-        }
-        else
-        {
-            waiter_.one_done();
-        }
+        backward_done_[l][p].set_value(&c);
     }
 
     vec3s fov()
@@ -0,0 +1,297 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <exception>
+
+#include <zi/async.hpp>
+
+#include "layered_network.hpp"
+#include "layered_network_data.hpp"
+#include "parallel_network.hpp"
+#include "../core/striped_locks.hpp"
+#include "../transfer_fn/transfer_fn.hpp"
+
+
+namespace zi {
+namespace znn {
+
+// Pipelined training. Instead of running forward, backward and the
+// update of each sample strictly in sequence, the weights of each layer
+// are updated as soon as the backward pass is done with the layer, and
+// each layer starts the forward pass of a sample as soon as its own
+// update by the sample staleness + 1 before is applied.
+//
+// The staleness bounds the number of updates of a layer a sample's
+// forward pass might miss: the layer l of the sample k waits for the
+// update of the layer l by the sample k - staleness - 1 (chained on its
+// future, not on the whole sample being done). Zero staleness means the
+// plain sequential training (with the upper layers updated early).
+//
+// Each sample in flight has its own parallel_network (featuremaps), so
+// staleness + 1 samples can be in flight; a slot is reused once its
+// network is done with the backward pass of its previous sample (the
+// one staleness + 1 before, whose updates gate the layers). The updates
+// of each filter are serialized with the computation of its transform
+// (striped locks), so the forward pass always sees a consistent version
+// of every filter, and the backward pass uses the same version as the
+// forward pass.
+//
+// The error of a sample (of its passes, or of its gradient_fn) fails
+// its updates, so the samples after it still go on, and is rethrown by
+// the push reusing its slot, or by flush().
+
+class pipelined_network
+{
+public:
+    typedef std::vector<cube<double>> cubes_type;
+
+    // Computes the gradient of the loss given the network's output. It
+    // is called by the thread finishing the forward pass, possibly
+    // concurrently for different samples.
+
+    typedef std::function<cubes_type(const cubes_type&)> gradient_fn;
+
+private:
+    typedef zi::async::promise<void> promise_type;
+    typedef zi::async::future<void>  future_type ;
+
+    struct slot
+    {
+        std::unique_ptr<layered_network_data> data   ;
+        std::unique_ptr<parallel_network>     net    ;
+        cubes_type                            input  ;
+        gradient_fn                           grad_fn;
+
+        // Of the sample in the slot, fulfilled once the layer is updated
+        // (failed if the sample failed), gating the layers of the next
+        // sample in the slot
+
+        std::vector<promise_type> updated;
+
+        // Once the network is done with the sample
+
+        promise_type              pass   ;
+        future_type               done   ;
+    };
+
+private:
+    layered_network&  net_    ;
+    striped_locks     locks_  ;
+    std::vector<slot> slots_  ;
+    size_t            samples_ = 0;
+
+private:
+    static void settle(const promise_type& p, const future_type& f)
+    {
+        try
+        {
+            f.get();
+            p.set_value();
+        }
+        catch (...)
+        {
+            p.set_exception(std::current_exception());
+        }
+    }
+
+    static void fail(slot& s, std::exception_ptr e)
+    {
+        for ( auto& p: s.updated )
+        {
+            p.set_exception(e);
+        }
+        s.pass.set_exception(e);
+    }
+
+    // Once the forward pass is done. The continuations only hold on to
+    // the promises and the data of the slot, as the next sample can
+    // take the slot as soon as the backward pass is done.
+
+    static void run_backward(slot& s)
+    {
+        future_type done;
+
+        try
+        {
+            cubes_type grads = s.grad_fn(s.net->outputs());
+            done = s.net->backward_async(grads);
+        }
+        catch (...)
+        {
+            fail(s, std::current_exception());
+            return;
+        }
+
+        for ( size_t l = s.updated.size(); l > 0; --l )
+        {
+            layered_network_data* d = s.data.get();
+            promise_type          u = s.updated[l-1];
+
+            s.net->gradients_ready(l-1).when_complete(
+                [d,u,l](const future_type& g) {
+                    if ( g.is_cancelled() || g.has_exception() )
+                    {
+                        settle(u, g);
+                    }
+                    else
+                    {
+                        d->apply_layer_grads(l-1).when_complete(
+                            [u](const future_type& a) { settle(u, a); });
+                    }
+                });
+        }
+
+        promise_type p = s.pass;
+        done.when_complete([p](const future_type& f) { settle(p, f); });
+    }
+
+public:
+    pipelined_network(layered_network& net, transfer_fn tf,
+                      size_t staleness, size_t num_locks = 1024)
+        : net_(net)
+        , locks_(num_locks)
+        , slots_(staleness + 1)
+    {
+        for ( auto& s: slots_ )
+        {
+            s.data = std::unique_ptr<layered_network_data>(
+                new layered_network_data(net));
+            s.data->set_update_locks(&locks_);
+            s.net  = std::unique_ptr<parallel_network>(
+                new parallel_network(*s.data, tf));
+        }
+    }
+
+    ~pipelined_network()
+    {
+        try
+        {
+            flush();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    size_t staleness() const
+    {
+        return slots_.size() - 1;
+    }
+
+    // Starts training on the sample. Blocks while the slot's network is
+    // busy with the sample staleness + 1 before.
+
+    void push(const cubes_type& input, gradient_fn grad_fn)
+    {
+        slot& s = slots_[samples_ % slots_.size()];
+        ++samples_;
+
+        if ( s.done.valid() )
+        {
+            future_type d = s.done;
+            s.done = future_type();
+            d.get();
+        }
+
+        // The layers of this sample wait for the updates of the
+        // previous one in the slot
+
+        std::vector<future_type> gates;
+        for ( auto& p: s.updated )
+        {
+            gates.push_back(p.get_future());
+        }
+
+        s.input   = input;
+        s.grad_fn = std::move(grad_fn);
+
+        s.updated.clear();
+        s.updated.resize(net_.num_layers());
+
+        s.pass = promise_type();
+        s.done = s.pass.get_future();
+
+        // The transforms of the filters cached by the slot are out of
+        // date by now (they are computed again once the gates open)
+
+        s.net->init();
+
+        slot* sp = &s;
+        s.net->forward_async(s.input, gates).when_complete(
+            [sp](const future_type& f) {
+                if ( f.is_cancelled() || f.has_exception() )
+                {
+                    try
+                    {
+                        f.get();
+                    }
+                    catch (...)
+                    {
+                        fail(*sp, std::current_exception());
+                    }
+                }
+                else
+                {
+                    run_backward(*sp);
+                }
+            });
+    }
+
+    // Waits for all the samples in flight to be done (all their updates
+    // applied), rethrows the first error
+
+    void flush()
+    {
+        std::exception_ptr error;
+
+        for ( auto& s: slots_ )
+        {
+            std::vector<future_type> fs;
+
+            if ( s.done.valid() )
+            {
+                fs.push_back(s.done);
+                s.done = future_type();
+            }
+
+            for ( auto& p: s.updated )
+            {
+                fs.push_back(p.get_future());
+            }
+
+            for ( auto& f: fs )
+            {
+                try
+                {
+                    f.get();
+                }
+                catch (...)
+                {
+                    if ( !error )
+                    {
+                        error = std::current_exception();
+                    }
+                }
+            }
+
+            // Only once the backward pass took its promises
+
+            s.updated.clear();
+        }
+
+        if ( error )
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    vec3s fov()
+    {
+        return net_.fov();
+    }
+
+}; // class pipelined_network
+
+}} // namespace zi::znn
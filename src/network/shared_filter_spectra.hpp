@@ -0,0 +1,173 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <complex>
+#include <cmath>
+
+#include "layered_network_data.hpp"
+#include "../core/types.hpp"
+#include "../core/fft.hpp"
+#include "../core/cube_pool.hpp"
+
+
+namespace zi {
+namespace znn {
+
+// a *= the transform of the filter flipped along the axes k with
+// flips[k], w being the transform of the filter itself: both are the
+// halves (x halved, as fftw's) of the transforms of size n, the filter
+// of extent e (sparse) at the origin, as fftw::forward_pad puts it.
+//
+// Along a flipped axis f'(x) = f(e-1-x), so F'(u) = F(-u) times the
+// phase exp(-2 pi i u (e-1) / n). Negating x can't be done within the
+// half transform, but F(-u) is the conjugate of F(u) for a real filter:
+// it is then the conjugate of F with the other two axes negated instead.
+
+inline void pairwise_mult_flipped( cube<complex>& a, const cube<complex>& w,
+                                   const vec3s& n, const vec3s& e,
+                                   const vec3s& flips )
+{
+    ZI_ASSERT(size(a)==size(w));
+    ZI_ASSERT(size(a)==fft_complex_size(n));
+
+    vec3s s = size(a);
+
+    std::vector<complex> phase[3];
+
+    for ( std::size_t k = 0; k < 3; ++k )
+    {
+        phase[k].assign(s[k], complex(1,0));
+
+        if ( flips[k] )
+        {
+            for ( std::size_t u = 0; u < s[k]; ++u )
+            {
+                double t = -2 * M_PI * ( ( u * ( e[k] - 1 ) ) % n[k] ) / n[k];
+                phase[k][u] = complex(std::cos(t), std::sin(t));
+            }
+        }
+    }
+
+    bool conj = flips[0];
+
+    for ( std::size_t z = 0; z < s[2]; ++z )
+    {
+        std::size_t wz = ( flips[2] != 0 ) != conj ? ( n[2] - z ) % n[2] : z;
+
+        for ( std::size_t y = 0; y < s[1]; ++y )
+        {
+            std::size_t wy = ( flips[1] != 0 ) != conj
+                ? ( n[1] - y ) % n[1] : y;
+
+            complex        pyz = phase[1][y] * phase[2][z];
+            complex*       ap  = &a(0,y,z);
+            const complex* wp  = &w(0,wy,wz);
+
+            if ( conj )
+            {
+                for ( std::size_t x = 0; x < s[0]; ++x )
+                {
+                    ap[x] *= std::conj(wp[x]) * ( pyz * phase[0][x] );
+                }
+            }
+            else
+            {
+                for ( std::size_t x = 0; x < s[0]; ++x )
+                {
+                    ap[x] *= wp[x] * pyz;
+                }
+            }
+        }
+    }
+}
+
+// The transforms of the filters of a network, for the networks whose
+// filters are the same ones flipped (the copies of the test time
+// augmentation): each of them multiplies by its flip of the transform
+// (pairwise_mult_flipped) instead of keeping the transforms of its own
+// filters. A transform is computed by the first network to need it, the
+// others waiting for it rather than computing it as well.
+
+class shared_filter_spectra
+{
+private:
+    struct entry
+    {
+        std::mutex                           mutex   ;
+        std::shared_ptr<const cube<complex>> spectrum;
+        vec3s                                size    ;
+    };
+
+private:
+    layered_network_data&                        data_  ;
+    std::vector<std::vector<std::vector<entry>>> layers_;
+
+public:
+    shared_filter_spectra( layered_network_data& data )
+        : data_(data)
+        , layers_(data.num_layers())
+    {
+        for ( std::size_t l = 0; l < layers_.size(); ++l )
+        {
+            layers_[l].resize(data.layer(l).num_inputs());
+
+            for ( auto& i: layers_[l] )
+            {
+                i = std::vector<entry>(data.layer(l).num_outputs());
+            }
+        }
+    }
+
+    shared_filter_spectra(const shared_filter_spectra&) = delete;
+    shared_filter_spectra& operator=(const shared_filter_spectra&) = delete;
+
+    // The transform of the filter (l,i,o) exploded by sparse and padded
+    // to the size fsize, kept for the next calls when keep is set
+
+    std::shared_ptr<const cube<complex>>
+    get( std::size_t l, std::size_t i, std::size_t o,
+         const vec3s& sparse, const vec3s& fsize, bool keep )
+    {
+        entry& e = layers_[l][i][o];
+
+        guard g(e.mutex);
+
+        if ( e.spectrum && e.size == fsize )
+        {
+            return e.spectrum;
+        }
+
+        std::shared_ptr<const cube<complex>> r;
+
+        {
+            guard w = data_.lock_weights(l, i, o);
+            r = fftw::forward_pad(data_.filter(l,i,o), sparse, fsize);
+        }
+
+        if ( keep )
+        {
+            e.spectrum = r;
+            e.size     = fsize;
+        }
+        else
+        {
+            e.spectrum.reset();
+        }
+
+        return r;
+    }
+
+    bool cached( std::size_t l, std::size_t i, std::size_t o,
+                 const vec3s& fsize )
+    {
+        entry& e = layers_[l][i][o];
+
+        guard g(e.mutex);
+        return e.spectrum && e.size == fsize;
+    }
+
+}; // class shared_filter_spectra
+
+}} // namespace zi::znn
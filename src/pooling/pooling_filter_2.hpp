@@ -72,6 +72,46 @@ inline std::pair<unique_cube<T>, unique_cube<uint32_t>>
             pool<uint32_t>::get_unique_crop(indices,ret_size) };
 }
 
+// Same, without keeping track of the indices (no backward pass), and
+// filtering cb itself (overwriting it) instead of a copy of it. The
+// result, of the smaller pooled size, is still cropped into a cube of
+// the pool, but that's the only copy made.
+
+template<typename T, typename F>
+inline unique_cube<T> pooling_filter_2_destructive( cube<T>& cb,
+                                                    F compare,
+                                                    const vec3s& fs,
+                                                    const vec3s& ss)
+{
+    ZI_ASSERT((fs[0]>0)&&(fs[0]<3)&&(fs[1]>0)&&
+              (fs[1]<3)&&(fs[2]>0)&&(fs[2]<3));
+
+    if ( fs[0] == 2 )
+        for ( size_t z = 0; z < cb.n_slices; ++z )
+            for ( size_t y = 0; y < cb.n_cols; ++y )
+                for ( size_t x = 0; x < cb.n_rows-ss[0]; ++x )
+                    if ( compare(cb(x+ss[0],y,z),cb(x,y,z)) )
+                        cb(x,y,z) = cb(x+ss[0],y,z);
+
+    if ( fs[1] == 2 )
+        for ( size_t z = 0; z < cb.n_slices; ++z )
+            for ( size_t y = 0; y < cb.n_cols-ss[1]; ++y )
+                for ( size_t x = 0; x < cb.n_rows-ss[0]; ++x )
+                    if ( compare(cb(x,y+ss[1],z),cb(x,y,z)) )
+                        cb(x,y,z) = cb(x,y+ss[1],z);
+
+    if ( fs[2] == 2 )
+        for ( size_t z = 0; z < cb.n_slices-ss[2]; ++z )
+            for ( size_t y = 0; y < cb.n_cols-ss[1]; ++y )
+                for ( size_t x = 0; x < cb.n_rows-ss[0]; ++x )
+                    if ( compare(cb(x,y,z+ss[2]),cb(x,y,z)) )
+                        cb(x,y,z) = cb(x,y,z+ss[2]);
+
+    vec3s ret_size = size(cb) - (fs-vec3s::one) * ss;
+
+    return pool<T>::get_unique_crop(cb,ret_size);
+}
+
 template<typename T>
 inline unique_cube<T> pooling_filter_2_undo( const cube<T>& c,
                                              const cube<uint32_t>& idx,
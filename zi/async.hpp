@@ -8,8 +8,17 @@
 #include <mutex>
 #include <condition_variable>
 #include <iostream>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+#include <exception>
 
 #include <zi/utility/singleton.hpp>
+#include <zi/utility/assert.hpp>
 
 namespace zi {
 namespace async {
@@ -20,15 +29,643 @@ void trivial_callback_function(const F& f, const A& a)
    f(a());
 }
 
+class cancelled_error: public std::runtime_error
+{
+public:
+   cancelled_error()
+       : std::runtime_error("zi::async::future was cancelled")
+   {}
+};
+
+template<typename T> class future ;
+template<typename T> class promise;
+
+namespace detail {
+
+// The state shared between a promise and its futures. The continuations
+// are executed by the thread that fulfills (or cancels, or fails) the
+// promise, right after the value is set. The condition variable is only
+// touched when someone actually blocks in wait().
+//
+// A failed state holds the exception instead of a value, rethrown by
+// get(). The continuations are not to throw (the ones of then() pass
+// their errors on to their own futures): the error of one is dropped,
+// and the others still run.
+
+class shared_state_base
+{
+protected:
+   std::mutex                         mutex_;
+   std::condition_variable            cv_;
+   std::size_t                        waiting_   = 0;
+   bool                               ready_     = false;
+   std::atomic<bool>                  cancelled_ ;
+   std::exception_ptr                 exception_;
+   std::vector<std::function<void()>> continuations_;
+
+   static void run_continuation(const std::function<void()>& c)
+   {
+      try
+      {
+         c();
+      }
+      catch (...)
+      {
+      }
+   }
+
+   void finish(std::unique_lock<std::mutex>& g)
+   {
+      ready_ = true;
+
+      std::vector<std::function<void()>> cs;
+      cs.swap(continuations_);
+
+      if ( waiting_ ) cv_.notify_all();
+
+      g.unlock();
+
+      for ( auto& c: cs ) run_continuation(c);
+   }
+
+   // Once ready
+
+   void check() const
+   {
+      if ( cancelled_ ) throw cancelled_error();
+      if ( exception_ ) std::rethrow_exception(exception_);
+   }
+
+public:
+   shared_state_base()
+       : cancelled_(false)
+   {}
+
+   shared_state_base(const shared_state_base&) = delete;
+   shared_state_base& operator=(const shared_state_base&) = delete;
+
+   bool is_ready()
+   {
+      std::unique_lock<std::mutex> g(mutex_);
+      return ready_;
+   }
+
+   bool is_cancelled() const
+   {
+      return cancelled_.load(std::memory_order_relaxed);
+   }
+
+   void wait()
+   {
+      std::unique_lock<std::mutex> g(mutex_);
+      ++waiting_;
+      while ( !ready_ )
+      {
+         cv_.wait(g);
+      }
+      --waiting_;
+   }
+
+   // Null unless failed
+
+   std::exception_ptr exception()
+   {
+      std::unique_lock<std::mutex> g(mutex_);
+      return exception_;
+   }
+
+   void cancel()
+   {
+      std::unique_lock<std::mutex> g(mutex_);
+      if ( ready_ ) return;
+      cancelled_ = true;
+      finish(g);
+   }
+
+   void set_exception(std::exception_ptr e)
+   {
+      std::unique_lock<std::mutex> g(mutex_);
+      if ( ready_ ) return;
+      exception_ = e;
+      finish(g);
+   }
+
+   void add_continuation(std::function<void()>&& f)
+   {
+      {
+         std::unique_lock<std::mutex> g(mutex_);
+         if ( !ready_ )
+         {
+            continuations_.emplace_back(std::move(f));
+            return;
+         }
+      }
+      run_continuation(f);
+   }
+
+}; // class shared_state_base
+
+template<typename T>
+class shared_state: public shared_state_base
+{
+private:
+   typename std::aligned_storage<sizeof(T), alignof(T)>::type value_;
+
+public:
+   ~shared_state()
+   {
+      if ( ready_ && !cancelled_ && !exception_ )
+      {
+         reinterpret_cast<T*>(&value_)->~T();
+      }
+   }
+
+   template<typename V>
+   void set_value(V&& v)
+   {
+      std::unique_lock<std::mutex> g(mutex_);
+      if ( ready_ ) return;
+      new (&value_) T(std::forward<V>(v));
+      finish(g);
+   }
+
+   T& value()
+   {
+      wait();
+      check();
+      return *reinterpret_cast<T*>(&value_);
+   }
+
+}; // class shared_state
+
+template<>
+class shared_state<void>: public shared_state_base
+{
+public:
+   void set_value()
+   {
+      std::unique_lock<std::mutex> g(mutex_);
+      if ( ready_ ) return;
+      finish(g);
+   }
+
+   void value()
+   {
+      wait();
+      check();
+   }
+
+}; // class shared_state<void>
+
+struct future_access
+{
+   template<typename T>
+   static const std::shared_ptr<shared_state<T>>& state(const future<T>& f)
+   {
+      return f.state_;
+   }
+};
+
+} // namespace detail
+
+template<typename T>
+class promise
+{
+private:
+   std::shared_ptr<detail::shared_state<T>> state_;
+
+public:
+   promise()
+       : state_(std::make_shared<detail::shared_state<T>>())
+   {}
+
+   future<T> get_future() const
+   {
+      return future<T>(state_);
+   }
+
+   template<typename... V>
+   void set_value(V&&... v) const
+   {
+      state_->set_value(std::forward<V>(v)...);
+   }
+
+   void cancel() const
+   {
+      state_->cancel();
+   }
+
+   // The futures rethrow e instead of returning a value
+
+   void set_exception(std::exception_ptr e) const
+   {
+      state_->set_exception(e);
+   }
+
+   bool is_cancelled() const
+   {
+      return state_->is_cancelled();
+   }
+
+}; // class promise
+
+namespace detail {
+
+template<typename R>
+struct fulfill
+{
+   template<typename F, typename... A>
+   static void apply(promise<R>& p, F& f, A&... a)
+   {
+      p.set_value(f(a...));
+   }
+};
+
+template<>
+struct fulfill<void>
+{
+   template<typename F, typename... A>
+   static void apply(promise<void>& p, F& f, A&... a)
+   {
+      f(a...);
+      p.set_value();
+   }
+};
+
+// Fulfills p with the result of f, or fails it with the error of f
+
+template<typename R, typename F, typename... A>
+void fulfill_or_fail(promise<R>& p, F& f, A&... a)
+{
+   try
+   {
+      fulfill<R>::apply(p, f, a...);
+   }
+   catch (...)
+   {
+      p.set_exception(std::current_exception());
+   }
+}
+
+} // namespace detail
+
+template<typename T>
+class future
+{
+private:
+   std::shared_ptr<detail::shared_state<T>> state_;
+
+   template<typename> friend class promise;
+   friend struct detail::future_access;
+
+   explicit future(const std::shared_ptr<detail::shared_state<T>>& s)
+       : state_(s)
+   {}
+
+   template<typename F>
+   struct result
+   {
+      typedef decltype(std::declval<F&>()(std::declval<T&>())) type;
+   };
+
+public:
+   future()
+   {}
+
+   bool valid() const
+   {
+      return static_cast<bool>(state_);
+   }
+
+   bool is_ready() const
+   {
+      return state_->is_ready();
+   }
+
+   bool is_cancelled() const
+   {
+      return state_->is_cancelled();
+   }
+
+   // Once ready, whether it failed
+
+   bool has_exception() const
+   {
+      return static_cast<bool>(state_->exception());
+   }
+
+   void wait() const
+   {
+      state_->wait();
+   }
+
+   // Rethrows the error of a failed future
+
+   T& get() const
+   {
+      return state_->value();
+   }
+
+   // Cancels the pending work, the continuations are cancelled as well
+
+   void cancel() const
+   {
+      state_->cancel();
+   }
+
+   // Runs f once the future is either ready, cancelled or failed
+
+   template<typename F>
+   void on_complete(F f) const
+   {
+      state_->add_continuation(std::function<void()>(f));
+   }
+
+   // Same, f being given the future (rather than capturing it, which
+   // would keep the state alive for as long as it's not complete)
+
+   template<typename F>
+   void when_complete(F f) const
+   {
+      std::weak_ptr<detail::shared_state<T>> w = state_;
+      state_->add_continuation([w,f]() { f(future<T>(w.lock())); });
+   }
+
+   // The continuation is executed inline, either by the thread that
+   // completes this future, or right away when it's already complete.
+   // The returned future is cancelled or failed, without f being run,
+   // when this one is, and is failed by the error of f. The state is
+   // only referenced weakly, as the continuation belongs to it: it's
+   // alive whenever the continuation runs.
+
+   template<typename F>
+   future<typename result<F>::type> then(F f) const
+   {
+      typedef typename result<F>::type R;
+
+      promise<R> p;
+      std::weak_ptr<detail::shared_state<T>> w = state_;
+
+      state_->add_continuation([w,p,f]() mutable {
+            std::shared_ptr<detail::shared_state<T>> s = w.lock();
+
+            ZI_ASSERT(s);
+            if ( !s )
+            {
+               return;
+            }
+
+            if ( s->is_cancelled() )
+            {
+               p.cancel();
+            }
+            else if ( std::exception_ptr e = s->exception() )
+            {
+               p.set_exception(e);
+            }
+            else
+            {
+               detail::fulfill_or_fail(p, f, s->value());
+            }
+         });
+
+      return p.get_future();
+   }
+
+}; // class future
+
+template<>
+class future<void>
+{
+private:
+   std::shared_ptr<detail::shared_state<void>> state_;
+
+   template<typename> friend class promise;
+   friend struct detail::future_access;
+
+   explicit future(const std::shared_ptr<detail::shared_state<void>>& s)
+       : state_(s)
+   {}
+
+public:
+   future()
+   {}
+
+   bool valid() const
+   {
+      return static_cast<bool>(state_);
+   }
+
+   bool is_ready() const
+   {
+      return state_->is_ready();
+   }
+
+   bool is_cancelled() const
+   {
+      return state_->is_cancelled();
+   }
+
+   // Once ready, whether it failed
+
+   bool has_exception() const
+   {
+      return static_cast<bool>(state_->exception());
+   }
+
+   void wait() const
+   {
+      state_->wait();
+   }
+
+   void get() const
+   {
+      state_->value();
+   }
+
+   void cancel() const
+   {
+      state_->cancel();
+   }
+
+   // Runs f once the future is either ready, cancelled or failed
+
+   template<typename F>
+   void on_complete(F f) const
+   {
+      state_->add_continuation(std::function<void()>(f));
+   }
+
+   template<typename F>
+   void when_complete(F f) const
+   {
+      std::weak_ptr<detail::shared_state<void>> w = state_;
+      state_->add_continuation([w,f]() { f(future<void>(w.lock())); });
+   }
+
+   template<typename F>
+   future<decltype(std::declval<F&>()())> then(F f) const
+   {
+      typedef decltype(std::declval<F&>()()) R;
+
+      promise<R> p;
+      std::weak_ptr<detail::shared_state<void>> w = state_;
+
+      state_->add_continuation([w,p,f]() mutable {
+            std::shared_ptr<detail::shared_state<void>> s = w.lock();
+
+            ZI_ASSERT(s);
+            if ( !s )
+            {
+               return;
+            }
+
+            if ( s->is_cancelled() )
+            {
+               p.cancel();
+            }
+            else if ( std::exception_ptr e = s->exception() )
+            {
+               p.set_exception(e);
+            }
+            else
+            {
+               detail::fulfill_or_fail(p, f);
+            }
+         });
+
+      return p.get_future();
+   }
+
+}; // class future<void>
+
+namespace detail {
+
+struct when_all_state
+{
+   std::atomic<std::size_t> left     ;
+   std::atomic<bool>        cancelled;
+   std::mutex               mutex    ;
+   std::exception_ptr       error    ;
+
+   explicit when_all_state(std::size_t n)
+      : left(n)
+      , cancelled(false)
+   {}
+};
+
+} // namespace detail
+
+// Completes once all the futures complete. It fails with the first
+// error if any of them failed, else it's cancelled if any of them was
+// cancelled.
+
+template<typename T>
+future<void> when_all(const std::vector<future<T>>& fs)
+{
+   promise<void> p;
+
+   if ( fs.size() == 0 )
+   {
+      p.set_value();
+      return p.get_future();
+   }
+
+   auto st = std::make_shared<detail::when_all_state>(fs.size());
+
+   for ( const auto& f: fs )
+   {
+      std::weak_ptr<detail::shared_state<T>> w =
+         detail::future_access::state(f);
+
+      f.on_complete([p,st,w]() {
+            std::shared_ptr<detail::shared_state<T>> s = w.lock();
+
+            ZI_ASSERT(s);
+            if ( !s )
+            {
+               return;
+            }
+
+            if ( s->is_cancelled() )
+            {
+               st->cancelled = true;
+            }
+            else if ( std::exception_ptr e = s->exception() )
+            {
+               std::lock_guard<std::mutex> g(st->mutex);
+               if ( !st->error ) st->error = e;
+            }
+
+            if ( --st->left == 0 )
+            {
+               if ( st->error )
+               {
+                  p.set_exception(st->error);
+               }
+               else if ( st->cancelled )
+               {
+                  p.cancel();
+               }
+               else
+               {
+                  p.set_value();
+               }
+            }
+         });
+   }
+
+   return p.get_future();
+}
+
+
+class async_thread_pool;
+
+namespace detail {
+
+// The pool the tasks submitted by this thread go to, null meaning the
+// global one. Set for the workers of each pool, so the tasks spawned by
+// a task stay within its pool.
+
+inline async_thread_pool*& current_pool_override()
+{
+   static thread_local async_thread_pool* p = nullptr;
+   return p;
+}
+
+} // namespace detail
+
 class async_thread_pool
 {
 private:
-   std::map<std::size_t, std::list<std::function<void()>>> tasks_;
+   // Each task carries an estimate of the memory it will allocate while
+   // running. When a memory budget is set, a task is held back while
+   // the estimates of the running tasks plus its own would exceed the
+   // budget. A task is always admitted when nothing else is running, so
+   // the progress is guaranteed even for tasks larger than the budget.
+   //
+   // While the highest priority task is held back, its estimate stays
+   // reserved: the tasks of lower priorities are only admitted if they
+   // fit next to it, so they can't keep it from ever fitting.
+
+   struct task
+   {
+      std::function<void()> f    ;
+      std::size_t           bytes;
+   };
+
+   typedef std::map<std::size_t, std::list<task>> task_map;
+
+   task_map tasks_;
 
    std::size_t spawned_threads_;
    std::size_t concurrency_    ;
    std::size_t idle_threads_   ;
 
+   std::size_t memory_budget_  ;
+   std::size_t in_flight_bytes_;
+   std::size_t peak_bytes_     ;
+
    std::mutex              mutex_;
    std::condition_variable manager_cv_;
    std::condition_variable workers_cv_;
@@ -36,6 +673,8 @@ private:
 private:
    void worker_loop()
    {
+       detail::current_pool_override() = this;
+
        {
            std::unique_lock<std::mutex> g(mutex_);
 
@@ -53,19 +692,22 @@ private:
 
        while (true)
        {
-           std::function<void()> f;
+           task t;
 
            {
                std::unique_lock<std::mutex> g(mutex_);
 
-               while ( tasks_.empty() && concurrency_ >= spawned_threads_ )
+               task_map::reverse_iterator it = next_admissible();
+
+               while ( it == tasks_.rend() && concurrency_ >= spawned_threads_ )
                {
                    ++idle_threads_;
                    workers_cv_.wait(g);
                    --idle_threads_;
+                   it = next_admissible();
                }
 
-               if ( tasks_.empty() )
+               if ( it == tasks_.rend() )
                {
                    --spawned_threads_;
                    if ( spawned_threads_ == concurrency_ )
@@ -75,10 +717,25 @@ private:
                    return;
                }
 
-               f = std::move(next_task());
+               t = std::move(take_task(it));
+
+               in_flight_bytes_ += t.bytes;
+               peak_bytes_ = std::max(peak_bytes_, in_flight_bytes_);
            }
 
-           f();
+           t.f();
+
+           if ( t.bytes )
+           {
+               std::unique_lock<std::mutex> g(mutex_);
+               in_flight_bytes_ -= t.bytes;
+
+               // Some of the held back tasks might fit now
+               if ( idle_threads_ > 0 && tasks_.size() )
+               {
+                   workers_cv_.notify_all();
+               }
+           }
        }
    }
 
@@ -87,10 +744,24 @@ public:
        : spawned_threads_{0}
        , concurrency_{0}
        , idle_threads_{0}
+       , memory_budget_{0}
+       , in_flight_bytes_{0}
+       , peak_bytes_{0}
    {
        set_concurrency(std::thread::hardware_concurrency());
    }
 
+   explicit async_thread_pool(std::size_t n)
+       : spawned_threads_{0}
+       , concurrency_{0}
+       , idle_threads_{0}
+       , memory_budget_{0}
+       , in_flight_bytes_{0}
+       , peak_bytes_{0}
+   {
+       set_concurrency(n);
+   }
+
    async_thread_pool(const async_thread_pool&) = delete;
    async_thread_pool& operator=(const async_thread_pool&) = delete;
 
@@ -150,24 +821,95 @@ public:
        return concurrency_ - idle_threads_;
    }
 
+   // Zero means no limit
+
+   void set_memory_budget(std::size_t bytes)
+   {
+       std::unique_lock<std::mutex> g(mutex_);
+       memory_budget_ = bytes;
+       if ( idle_threads_ > 0 ) workers_cv_.notify_all();
+   }
+
+   std::size_t get_memory_budget()
+   {
+       std::unique_lock<std::mutex> g(mutex_);
+       return memory_budget_;
+   }
+
+   std::size_t in_flight_bytes()
+   {
+       std::unique_lock<std::mutex> g(mutex_);
+       return in_flight_bytes_;
+   }
+
+   std::size_t peak_in_flight_bytes()
+   {
+       std::unique_lock<std::mutex> g(mutex_);
+       return peak_bytes_;
+   }
+
+   void reset_peak_in_flight_bytes()
+   {
+       std::unique_lock<std::mutex> g(mutex_);
+       peak_bytes_ = in_flight_bytes_;
+   }
+
 private:
-   std::function<void()> next_task()
+   bool admissible(const task& t, std::size_t reserved) const
+   {
+       return ( memory_budget_ == 0 ) || ( t.bytes == 0 ) ||
+           ( in_flight_bytes_ == 0 && reserved == 0 ) ||
+           ( in_flight_bytes_ + reserved + t.bytes <= memory_budget_ );
+   }
+
+   // The highest priority task that fits into the budget, only the
+   // first task of each priority is considered
+
+   task_map::reverse_iterator next_admissible()
+   {
+       std::size_t reserved = 0;
+
+       for ( auto it = tasks_.rbegin(); it != tasks_.rend(); ++it )
+       {
+           const task& t = it->second.front();
+
+           if ( admissible(t, reserved) )
+           {
+               return it;
+           }
+
+           if ( it == tasks_.rbegin() )
+           {
+               reserved = t.bytes;
+           }
+       }
+       return tasks_.rend();
+   }
+
+   task take_task(task_map::reverse_iterator it)
    {
-       std::function<void()> f = std::move(tasks_.rbegin()->second.front());
+       task t = std::move(it->second.front());
 
-       tasks_.rbegin()->second.pop_front();
-       if ( tasks_.rbegin()->second.size() == 0 )
+       it->second.pop_front();
+       if ( it->second.size() == 0 )
        {
-           tasks_.erase(tasks_.rbegin()->first);
+           tasks_.erase(it->first);
        }
-       return f;
+       return t;
    }
 
 public:
    void add_task(std::size_t priority, std::function<void()>&& f)
+   {
+       add_task(priority, 0, std::forward<std::function<void()>>(f));
+   }
+
+   void add_task(std::size_t priority, std::size_t bytes,
+                 std::function<void()>&& f)
    {
        std::unique_lock<std::mutex> g(mutex_);
-       tasks_[priority].emplace_back(std::forward<std::function<void()>>(f));
+       tasks_[priority].push_back(
+           task{std::forward<std::function<void()>>(f), bytes});
        if ( idle_threads_ > 0 ) workers_cv_.notify_all();
    }
 
@@ -178,24 +920,66 @@ async_thread_pool& async_thread_pool_instance =
    singleton<async_thread_pool>::instance();
 }
 
+inline async_thread_pool& current_pool()
+{
+   async_thread_pool* p = detail::current_pool_override();
+   return p ? *p : async_thread_pool_instance;
+}
+
+// While in scope, the tasks submitted by this thread (and the tasks
+// they spawn) are executed by the given pool instead of the global one
+
+class pool_scope
+{
+private:
+   async_thread_pool* old_;
+
+public:
+   explicit pool_scope(async_thread_pool& p)
+       : old_(detail::current_pool_override())
+   {
+      detail::current_pool_override() = &p;
+   }
+
+   ~pool_scope()
+   {
+      detail::current_pool_override() = old_;
+   }
+
+   pool_scope(const pool_scope&) = delete;
+   pool_scope& operator=(const pool_scope&) = delete;
+
+}; // class pool_scope
+
 template<typename... Args>
 void async(Args&&... args)
 {
-   async_thread_pool_instance.add_task
+   current_pool().add_task
        (0, std::bind(std::forward<Args>(args)...));
 }
 
 template<typename... Args>
 void async_priority(std::size_t priority, Args&&... args)
 {
-   async_thread_pool_instance.add_task
+   current_pool().add_task
        (priority, std::bind(std::forward<Args>(args)...));
 }
 
+// The task is expected to allocate about the given number of bytes
+// while running, see async_thread_pool
+
+template<typename... Args>
+void async_priority_mem(std::size_t priority, std::size_t bytes,
+                        Args&&... args)
+{
+   current_pool().add_task
+       (priority, bytes, std::bind(std::forward<Args>(args)...));
+}
+
 template<typename F, typename... Args>
 void async_cb(F&& f, Args&&... args)
 {
-   async_thread_pool_instance.add_task
+   current_pool().add_task
        (0, std::bind(std::forward<F>(f),
                      std::bind(std::forward<Args>(args)...)));
 }
@@ -203,20 +987,73 @@ void async_cb(F&& f, Args&&... args)
 template<typename F, typename... Args>
 void async_priority_cb(F&& f, std::size_t priority, Args&&... args)
 {
-   async_thread_pool_instance.add_task
+   current_pool().add_task
        (priority, std::bind(std::forward<F>(f),
                             std::bind(std::forward<Args>(args)...)));
 }
 
 
+// Same as the above, but return a future of the result. A task that
+// was cancelled before it was started is never executed. An error of
+// the task fails the future. (The tasks without a future are not to
+// throw: there is nobody to pass the error to.)
+
+template<typename... Args>
+auto async_priority_future(std::size_t priority, Args&&... args)
+   -> future<decltype(std::bind(std::forward<Args>(args)...)())>
+{
+   typedef decltype(std::bind(std::forward<Args>(args)...)()) result_type;
+
+   promise<result_type> p;
+   auto f = std::bind(std::forward<Args>(args)...);
+
+   current_pool().add_task
+       (priority, [p,f]() mutable {
+          if ( !p.is_cancelled() )
+          {
+             detail::fulfill_or_fail(p, f);
+          }
+       });
+
+   return p.get_future();
+}
+
+template<typename... Args>
+auto async_future(Args&&... args)
+   -> decltype(async_priority_future(0, std::forward<Args>(args)...))
+{
+   return async_priority_future(0, std::forward<Args>(args)...);
+}
+
+
 std::size_t get_concurrency()
 {
-   return async_thread_pool_instance.get_concurrency();
+   return current_pool().get_concurrency();
 }
 
 std::size_t set_concurrency(std::size_t n)
 {
-   return async_thread_pool_instance.set_concurrency(n);
+   return current_pool().set_concurrency(n);
+}
+
+inline void set_memory_budget(std::size_t bytes)
+{
+   current_pool().set_memory_budget(bytes);
+}
+
+inline std::size_t get_memory_budget()
+{
+   return current_pool().get_memory_budget();
+}
+
+inline std::size_t peak_in_flight_bytes()
+{
+   return current_pool().peak_in_flight_bytes();
+}
+
+inline void reset_peak_in_flight_bytes()
+{
+   current_pool().reset_peak_in_flight_bytes();
 }
 
 